@@ -12,6 +12,7 @@
 #import "NVRenderContext.h"
 #import "NVWindowController.h"
 
+#include "font.hpp"
 #include "log.h"
 #include "msgpack.hpp"
 #include "neovim.hpp"
@@ -157,14 +158,45 @@ static NVWindowController* openWith(NSArray<NVWindowController*> *windows,
     NVRenderContextOptions options;
     options.rasterizerWidth = 512;
     options.rasterizerHeight = 512;
+    options.rasterizerCount = std::min<size_t>([[NSProcessInfo processInfo] activeProcessorCount], 4);
     options.cachePageWidth = 1024;
     options.cachePageHeight = 1024;
     options.cacheGrowthFactor = 1.5;
     options.cacheInitialCapacity = 1;
-    options.cacheEvictionThreshold = 8;
+    options.cacheMemoryBudget = 32 * 1048576;
     options.cacheEvictionPreserve = 2;
 
+    // A glyph cache is shared by every window on the same GPU. The budget
+    // default is given in megabytes.
+    NSInteger glyphCacheBudget = [defaults integerForKey:@"NVPreferencesGlyphCacheBudget"];
+
+    if (glyphCacheBudget > 0) {
+        options.cacheMemoryBudget = glyphCacheBudget * 1048576;
+    }
+
+    // Glyph masks are cached once for every color, but they're rasterized
+    // without font smoothing, so they're opt in.
+    options.glyphMasks = [defaults boolForKey:@"NVPreferencesGlyphMasks"];
+
     contextManager = [[NVRenderContextManager alloc] initWithOptions:options delegate:self];
+
+    // Most windows use the default font, get a head start on caching it.
+    // Don't wait on the render contexts here, that would hold up spawning the
+    // first window's Neovim process.
+    if (NSScreen *screen = [NSScreen mainScreen]) {
+        font_manager *fontManager = contextManager.fontManager;
+        arc_ptr descriptor = font_manager::default_descriptor();
+
+        font_family font = fontManager->get(descriptor.get(),
+                                            [NSFont systemFontSize],
+                                            [screen backingScaleFactor]);
+
+        NVRenderContextManager *manager = contextManager;
+
+        [manager notifyWhenLoaded:^{
+            [[manager renderContextForScreen:screen] prewarmFont:font];
+        }];
+    }
 }
 
 - (void)handleAppleEvent:(NSAppleEventDescriptor *)event withReplyEvent: (NSAppleEventDescriptor *)replyEvent {
@@ -231,6 +263,13 @@ static NVWindowController* openWith(NSArray<NVWindowController*> *windows,
 
 - (BOOL)applicationOpenUntitledFile:(NSApplication *)sender {
     NVWindowController *controller = [[NVWindowController alloc] initWithContextManager:contextManager];
+
+    // Launching with -NVReplayCapture <path> replays a capture file instead of
+    // starting Neovim.
+    if (NSString *capture = [[NSUserDefaults standardUserDefaults] stringForKey:@"NVReplayCapture"]) {
+        return [controller replay:capture] == 0;
+    }
+
     return [controller spawn] == 0;
 }
 
@@ -43,6 +43,16 @@ NS_ASSUME_NONNULL_BEGIN
 /// view's font may cause the view's cell size to change.
 @property (nonatomic) const font_family &font;
 
+/// Measures the latency of frames answering key presses.
+/// Set before the first frame is drawn. @see latency_tracker.
+@property (nonatomic, nullable) latency_tracker *latencyTracker;
+
+/// Receives a frame_sample for every presented frame, counts display
+/// refreshes, and controls whether the stats overlay is drawn. Set before the
+/// first frame is drawn.
+/// @see frame_stats.
+@property (nonatomic, nullable) frame_stats *frameStats;
+
 /// Returns the size of a single width cell.
 @property (nonatomic, readonly) NSSize cellSize;
 
@@ -77,6 +87,42 @@ NS_ASSUME_NONNULL_BEGIN
 /// Restores the cursor style from the current grid object.
 - (void)setActive;
 
+/// Schedules frames on display refreshes.
+///
+/// Once scheduled, any number of redraw requests made between two display
+/// refreshes result in a single frame. Frames are drawn on the next refresh
+/// of the display showing the view. When nothing has changed for a few
+/// refreshes, the display link is stopped until the next request.
+///
+/// Frames are drawn on the main thread, or optionally, encoded and presented
+/// on the display link thread. The exception is live resizing, where frames
+/// are drawn on the main thread and presented with the window's transaction.
+///
+/// The view obtains its own grids. Request a new grid with -[setNeedsGrid],
+/// do not set the grid property once frames are scheduled.
+///
+/// @param provider     Returns the most up to date grid. Called with the
+///                     view's render state locked, on either the display link
+///                     thread or the main thread.
+/// @param handler      Called on the main thread when the provided grid size
+///                     changes.
+/// @param renderThread Encode and present frames on the display link thread.
+- (void)scheduleFramesWithGridProvider:(const nvim::grid* (^)(void))provider
+                       gridSizeHandler:(void (^)(nvim::grid_size))handler
+                          renderThread:(BOOL)renderThread;
+
+/// Stops scheduling frames.
+/// Waits for any frame in progress on the display link thread to finish, after
+/// which the grid provider is no longer called.
+- (void)stopDisplayLink;
+
+/// Requests a new grid from the grid provider for the next frame.
+- (void)setNeedsGrid;
+
+/// Called once the view presents its first frame. Called on the thread that
+/// presented the frame, either the main thread or the display link thread.
+@property (nonatomic, copy, nullable) void (^firstFrameHandler)(void);
+
 @end
 
 NS_ASSUME_NONNULL_END
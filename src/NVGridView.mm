@@ -7,15 +7,26 @@
 //  See LICENSE.txt for details.
 //
 
+#import <CoreVideo/CoreVideo.h>
 #import <QuartzCore/CAMetalLayer.h>
 #import <Metal/Metal.h>
 #import "NVGridView.h"
+#include <os/signpost.h>
+#include <mutex>
+#include <bit>
+#include <numeric>
+#include "log.h"
 #include "shader_types.hpp"
+#include "unfair_lock.hpp"
 
 /// Utility class to help manage Metal buffers.
 /// The class provides two additional abstractions over a MTLBuffer:
 ///   1. A low overhead locking mechanism.
 ///   2. A means to coalesce multiple allocations into a single MTLBuffer.
+///
+/// On devices with unified memory the buffer uses shared storage, and the GPU
+/// sees CPU writes directly. Otherwise it uses managed storage, and modified
+/// ranges must be reported with update().
 class mtlbuffer {
 private:
     id<MTLDevice> buffer_device;
@@ -23,6 +34,8 @@ private:
     char *ptr;
     size_t length;
     size_t capacity;
+    size_t updated;
+    bool unified;
     std::atomic_flag in_use;
 
     static constexpr size_t align_up(size_t val, size_t alignment) {
@@ -43,6 +56,8 @@ public:
         ptr = nullptr;
         length = 0;
         capacity = 0;
+        updated = 0;
+        unified = false;
     }
 
     /// Creates the underlying MTLBuffer.
@@ -54,22 +69,31 @@ public:
     /// length, it is reused. Otherwise a new buffer is allocated and the
     /// existing buffer is freed. Calling this function invalidates any
     /// previously allocated memory regions.
-    void create(id<MTLDevice> device, size_t size) {
+    ///
+    /// @returns True if a new buffer was allocated, false if the existing
+    /// buffer was reused. When the buffer is reused, the contents of regions
+    /// allocated in the same order and with the same sizes are preserved.
+    bool create(id<MTLDevice> device, size_t size) {
         length = 0;
 
         if (buffer_device != device) {
             buffer_device = device;
+            unified = [device hasUnifiedMemory];
             size = std::max(1048576ul, align_up(size, 8));
         } else if (size <= capacity) {
-            return;
+            return false;
         }
 
+        MTLResourceOptions storage = unified ? MTLResourceStorageModeShared :
+                                               MTLResourceStorageModeManaged;
+
         buffer = [device newBufferWithLength:size
-                                     options:MTLResourceStorageModeManaged |
+                                     options:storage |
                                              MTLResourceCPUCacheModeWriteCombined];
 
         ptr = static_cast<char*>([buffer contents]);
         capacity = size;
+        return true;
     }
 
     /// Allocates a region of memory from the underlying MTLBuffer.
@@ -89,9 +113,19 @@ public:
     }
 
     /// Informs the Metal device that the given range has been modified.
+    /// Does nothing for shared buffers, which need no synchronization.
     /// @see -[MTLBuffer didModifyRange] for more information.
     void update(size_t start, size_t length) {
-        [buffer didModifyRange:NSMakeRange(start, length)];
+        updated += length;
+
+        if (!unified) {
+            [buffer didModifyRange:NSMakeRange(start, length)];
+        }
+    }
+
+    /// Returns the number of bytes passed to update() since the last call.
+    size_t take_updated() {
+        return std::exchange(updated, 0);
     }
 
     /// Try to acquire the buffers lock. Returns immediately.
@@ -111,106 +145,141 @@ public:
 };
 
 /// Adjusts the color attributes of cells under a block cursor.
-class AdjustedGrid {
+/// Iterates over a single grid row, resolving each cell, and swapping out the
+/// cells under a block cursor for recolored copies.
+class AdjustedRow {
 private:
-    struct Range {
-        const nvim::cell *begin;
-        int16_t rowBegin;
-        int16_t rowEnd;
-        int16_t colBegin;
-        int16_t colEnd;
-    };
-
+    const nvim::grid *grid;
+    const nvim::packed_cell *cells;
+    int16_t width;
+    int16_t cursorBegin;
+    int16_t cursorEnd;
     nvim::cell adjustedCells[2];
-    Range ranges[4];
-    size_t rangesCount;
 
 public:
-    AdjustedGrid(const nvim::grid *grid, const nvim::cursor &cursor) {
-        ranges[0].begin = grid->begin();
-        ranges[0].rowBegin = 0;
-        ranges[0].colBegin = 0;
-
-        // If we're not dealing with a block cursor, no adjusments need to be
-        // made. We can iterate the grid in one swoop.
-        if (cursor.shape() != nvim::cursor_shape::block) {
-            rangesCount = 1;
-            ranges[0].rowEnd = grid->height();
-            ranges[0].colEnd = grid->width();
+    AdjustedRow(const nvim::grid *grid, const nvim::cursor &cursor, size_t row): grid(grid) {
+        cells = grid->get(row, 0);
+        width = grid->width();
+
+        // If we're not dealing with a block cursor, or the cursor is on
+        // another row, no adjusments need to be made.
+        if (cursor.shape() != nvim::cursor_shape::block || cursor.row() != row) {
+            cursorBegin = width;
+            cursorEnd = width;
             return;
         }
 
-        // We need to adjust the cursor cells.
         // Grid's are immutable, so we make a copy of the adjusted cells.
-        const nvim::cell *cursorCell = &cursor.cell();
         size_t cursorWidth = cursor.width();
 
-        adjustedCells[0] = cursorCell[0].recolored(cursor.foreground(),
+        adjustedCells[0] = cursor.cell().recolored(cursor.foreground(),
                                                    cursor.background(),
                                                    cursor.special());
 
         if (cursorWidth == 2) {
-            adjustedCells[1] = cursorCell[1].recolored(cursor.foreground(),
-                                                       cursor.background(),
-                                                       cursor.special());
+            adjustedCells[1] = grid->resolve(row, cursor.col() + 1).recolored(cursor.foreground(),
+                                                                              cursor.background(),
+                                                                              cursor.special());
         }
 
-        // When iterating over the grid, we need to swap out cursor cells with
-        // our adjusted cells. The iteration order required to do that is
-        // stored in an array of four Range objects.
-        rangesCount = 4;
-
-        // Start with full rows up until the cursor row.
-        ranges[0].rowEnd = cursor.row();
-        ranges[0].colEnd = grid->width();
-
-        // Iterate from the start over the cursor row till the cursor column.
-        ranges[1].begin    = cursorCell - cursor.col();
-        ranges[1].rowBegin = cursor.row();
-        ranges[1].rowEnd   = cursor.row() + 1;
-        ranges[1].colBegin = 0;
-        ranges[1].colEnd   = cursor.col();
-
-        // We're at the cursor cells. Iterate over the adjusted cells instead.
-        ranges[2].begin    = adjustedCells;
-        ranges[2].rowBegin = cursor.row();
-        ranges[2].rowEnd   = cursor.row() + 1;
-        ranges[2].colBegin = cursor.col();
-        ranges[2].colEnd   = cursor.col() + cursorWidth;
-
-        // Start from after the cursor cells and finish off the grid.
-        ranges[3].begin    = cursorCell + cursorWidth;
-        ranges[3].rowBegin = cursor.row();
-        ranges[3].rowEnd   = grid->height();
-        ranges[3].colBegin = cursor.col() + cursorWidth;
-        ranges[3].colEnd   = grid->width();
-    }
-
-    /// Iterate over the cursor adjusted grid.
+        cursorBegin = cursor.col();
+        cursorEnd = cursor.col() + cursorWidth;
+    }
+
+    /// Iterate over the cursor adjusted row.
     /// Calls the function object callback once for every cell in ascending
-    /// order. The callback is invoked with three arguments:
-    ///   1. The cell's row (int16_t).
-    ///   2. The cell's column (int16_t).
-    ///   3. A const pointer to the cell (const nvim::cell*).
+    /// order. The callback is invoked with two arguments:
+    ///   1. The cell's column (int16_t).
+    ///   2. A const pointer to the resolved cell (const nvim::cell*).
     /// The return value of the callback is ignored.
     template<typename Callable>
     void forEach(Callable callback) {
-        for (size_t i=0; i<rangesCount; ++i) {
-            const Range &range = ranges[i];
-            const nvim::cell *cell = range.begin;
-            int16_t col = range.colBegin;
-
-            for (int16_t row = range.rowBegin; row < range.rowEnd; ++row) {
-                for (; col < range.colEnd; ++col, ++cell) {
-                    callback(row, col, cell);
-                }
+        int16_t col = 0;
 
-                col = 0;
-            }
+        for (; col < cursorBegin; ++col) {
+            nvim::cell cell = grid->resolve(cells[col]);
+            callback(col, &cell);
+        }
+
+        for (; col < cursorEnd; ++col) {
+            callback(col, &adjustedCells[col - cursorBegin]);
+        }
+
+        for (; col < width; ++col) {
+            nvim::cell cell = grid->resolve(cells[col]);
+            callback(col, &cell);
         }
     }
 };
 
+/// Describes what was encoded into a mtlbuffer on a previous frame.
+///
+/// Background and glyph data are laid out with one row slot of entries per
+/// grid row. Row slots keep their contents from frame to frame, so as long as
+/// nothing invalidated the buffer's contents, only rows that changed since the
+/// buffer was last used need to be encoded again.
+///
+/// Grid rows aren't tied to a particular slot. Scrolls are replayed by moving
+/// rows between slots, so scrolled rows are drawn from the slots they were
+/// already encoded in, and only the exposed rows need to be encoded.
+struct BufferState {
+    const glyph_manager *glyphManager;
+    uint64_t glyphGeneration;
+    uint64_t fontGeneration;
+    uint64_t gridTick;
+    nvim::grid_size gridSize;
+    size_t cursorRow;
+    std::vector<uint16_t> rowSlots;
+    bool valid;
+};
+
+/// Formats the stats overlay, one string per line.
+static std::vector<std::string> statsOverlayLines(const frame_stats_summary &stats) {
+    std::vector<std::string> lines;
+    char line[128];
+
+    snprintf(line, sizeof(line), " frames  %zu in %.1f s ", stats.frames, stats.seconds);
+    lines.push_back(line);
+
+    snprintf(line, sizeof(line), " cells   %.0f per frame ", stats.cells);
+    lines.push_back(line);
+
+    snprintf(line, sizeof(line), " glyphs  %.1f hits, %.1f misses, %.1f rasterized ",
+             stats.glyph_hits, stats.glyph_misses, stats.rasterized);
+    lines.push_back(line);
+
+    snprintf(line, sizeof(line), " atlas   %llu pages, %llu evictions ",
+             (unsigned long long)stats.cache_pages, (unsigned long long)stats.evictions);
+    lines.push_back(line);
+
+    snprintf(line, sizeof(line), " upload  %.1f KB per frame ", stats.upload_bytes / 1024);
+    lines.push_back(line);
+
+    snprintf(line, sizeof(line), " present %.2f ms mean, %.2f ms max ",
+             stats.present_mean, stats.present_max);
+    lines.push_back(line);
+
+    snprintf(line, sizeof(line), " rpc     %.1f KB/s in, %.1f KB/s out, %.0f events/s ",
+             stats.rpc_received_per_sec / 1024, stats.rpc_sent_per_sec / 1024,
+             stats.rpc_events_per_sec);
+    lines.push_back(line);
+
+    return lines;
+}
+
+/// Caches the line data of each grid row.
+/// Lines are sparse and variable in number, so unlike backgrounds and glyphs
+/// they're not given a fixed slot per cell. Instead we keep the lines of each
+/// row, update the rows that changed, and copy the lot out every frame.
+struct LineCache {
+    std::vector<std::vector<line_data>> rows;
+    uint64_t fontGeneration;
+    uint64_t gridTick;
+    nvim::grid_size gridSize;
+    size_t cursorRow;
+    bool valid;
+};
+
 @implementation NVGridView {
     CAMetalLayer *metalLayer;
 
@@ -223,8 +292,13 @@ public:
     id<MTLRenderPipelineState> lineRenderPipeline;
 
     glyph_manager *glyphManager;
+    size_t glyphClient;
     font_family fontFamily;
     mtlbuffer buffers[3];
+    BufferState bufferStates[3];
+    LineCache lineCache;
+    std::vector<size_t> dirtySlots;
+    std::vector<std::pair<size_t, size_t>> dirtyRuns;
     nvim::cursor cursor;
     const nvim::grid *grid;
 
@@ -241,8 +315,36 @@ public:
     bool inactive;
 
     uint64_t frameIndex;
+    uint64_t fontGeneration;
+
+    // Once frames are scheduled, they're drawn on display link refreshes,
+    // either on the display link thread or the main thread. The render state
+    // above is guarded by stateLock, which the main thread holds whenever it
+    // modifies the state.
+    unfair_lock stateLock;
+    CVDisplayLinkRef displayLink;
+    const nvim::grid* (^gridProvider)(void);
+    void (^gridSizeHandler)(nvim::grid_size);
+    nvim::grid_size providedGridSize;
+    BOOL renderThread;
+    std::atomic<bool> gridNeeded;
+    std::atomic<bool> frameNeeded;
+    std::atomic<bool> mainFramePending;
+    std::atomic<bool> liveResizing;
+    std::atomic<uint32_t> idleRefreshes;
+    uint64_t framesPresented;
+
+    latency_tracker *latencyTracker;
+    uint64_t lastInputTime;
+
+    // Display refreshes are counted without taking stateLock.
+    std::atomic<frame_stats*> frameStats;
+    uint64_t lastFlushTime;
 }
 
+// The display link stops after this many display refreshes without requests.
+static constexpr uint32_t idleRefreshLimit = 30;
+
 - (instancetype)init {
     self = [super init];
     self.wantsLayer = YES;
@@ -253,10 +355,28 @@ public:
                                         dispatch_get_main_queue());
 
     dispatch_set_context(blinkTimer, (__bridge void*)self);
+
+    [[NSNotificationCenter defaultCenter] addObserver:self
+                                             selector:@selector(glyphCacheEvictionDue:)
+                                                 name:NVGlyphCacheEvictionDueNotification
+                                               object:nil];
     return self;
 }
 
 - (void)setRenderContext:(NVRenderContext *)context {
+    std::lock_guard lock(stateLock);
+
+    // Render contexts share a glyph lock.
+    {
+        std::lock_guard glyphLock(*context.glyphLock);
+
+        if (glyphManager) {
+            glyphManager->remove_client(glyphClient);
+        }
+
+        glyphClient = context.glyphManager->add_client();
+    }
+
     renderContext            = context;
     device                   = context.device;
     commandQueue             = context.commandQueue;
@@ -267,6 +387,28 @@ public:
     glyphManager             = context.glyphManager;
 
     metalLayer.device = device;
+    [self prewarmFont];
+}
+
+/// Prewarms the render context's glyph cache with the current font.
+/// Draws a frame, so our visible glyphs are looked up before the glyph cache
+/// we share with other windows is evicted.
+- (void)glyphCacheEvictionDue:(NSNotification *)notification {
+    if (notification.object != renderContext) {
+        return;
+    }
+
+    if (displayLink && !liveResizing) {
+        [self requestFrame];
+    } else {
+        [self setNeedsDisplay:YES];
+    }
+}
+
+- (void)prewarmFont {
+    if (renderContext && fontFamily.regular()) {
+        [renderContext prewarmFont:fontFamily];
+    }
 }
 
 - (NVRenderContext *)renderContext {
@@ -285,6 +427,7 @@ public:
 }
 
 - (NSSize)desiredFrameSize {
+    std::lock_guard lock(stateLock);
     NSSize frameSize;
     frameSize.width = backingCellSize.width * grid->width();
     frameSize.height = backingCellSize.height * grid->height();
@@ -313,8 +456,13 @@ static void blinkCursorToggleOff(void *context);
 static void blinkCursorToggleOn(void *context);
 
 - (void)setGrid:(const nvim::grid *)newGrid {
+    std::lock_guard lock(stateLock);
     [self setNeedsDisplay:YES];
+    [self updateGrid:newGrid];
+}
 
+/// Updates the grid and the cursor blink loop. Requires stateLock.
+- (void)updateGrid:(const nvim::grid *)newGrid {
     grid = newGrid;
     cursor = newGrid->cursor();
 
@@ -349,10 +497,14 @@ static void blinkCursorToggleOn(void *context);
 }
 
 - (const nvim::grid *)grid {
+    // The render thread swaps in provided grids.
+    std::lock_guard lock(stateLock);
     return grid;
 }
 
 - (void)setInactive {
+    std::lock_guard lock(stateLock);
+
     if (inactive) {
         return;
     }
@@ -370,14 +522,18 @@ static void blinkCursorToggleOn(void *context);
 }
 
 - (void)setActive {
+    std::lock_guard lock(stateLock);
+
     if (inactive) {
         inactive = false;
-        [self setGrid:grid];
+        [self setNeedsDisplay:YES];
+        [self updateGrid:grid];
     }
 }
 
 static void blinkCursorToggleOff(void *context) {
     NVGridView *self = (__bridge NVGridView*)context;
+    std::lock_guard lock(self->stateLock);
 
     self->cursor.toggle_off();
     [self setNeedsDisplay:YES];
@@ -390,8 +546,9 @@ static void blinkCursorToggleOff(void *context) {
 
 static void blinkCursorToggleOn(void *context) {
     NVGridView *self = (__bridge NVGridView*)context;
+    std::lock_guard lock(self->stateLock);
 
-    if (!self.grid->hide_cursor()) {
+    if (!self->grid->hide_cursor()) {
         self->cursor.toggle_on();
     }
     [self setNeedsDisplay:YES];
@@ -404,11 +561,15 @@ static void blinkCursorToggleOn(void *context) {
 
 - (void)setFrameSize:(NSSize)newSize {
     [super setFrameSize:newSize];
+
+    std::lock_guard lock(stateLock);
     [metalLayer setDrawableSize:[self convertSizeToBacking:newSize]];
 }
 
 - (void)setFont:(const font_family&)font {
+    std::lock_guard lock(stateLock);
     fontFamily = font;
+    fontGeneration += 1;
 
     CGFloat leading = floor(font.leading());
     CGFloat descent = floor(font.descent());
@@ -448,6 +609,7 @@ static void blinkCursorToggleOn(void *context) {
 
     cursorLineThickness = 2 * font.scale_factor();
     [metalLayer setContentsScale:font.scale_factor()];
+    [self prewarmFont];
 }
 
 - (const font_family&)font {
@@ -455,43 +617,235 @@ static void blinkCursorToggleOn(void *context) {
 }
 
 - (void)displayLayer:(CALayer*)layer {
+    // Once frames are scheduled, they're drawn on display refreshes. While
+    // live resizing, frames are drawn here, in sync with the window.
+    if (displayLink && !liveResizing) {
+        [self requestFrame];
+        return;
+    }
+
+    std::lock_guard lock(stateLock);
+
+    if (displayLink && gridNeeded.exchange(false)) {
+        [self takeProvidedGrid];
+    }
+
+    // If we fail to acquire the buffer, drop this frame and try again on the
+    // next draw loop iteration. This should be rare.
+    if (![self renderFrame:YES]) {
+        [self setNeedsDisplay:YES];
+    }
+}
+
+/// Encodes and presents a frame. Requires stateLock.
+/// @param transaction  Present the frame with the current Core Animation
+///                     transaction. Requires presentsWithTransaction.
+/// @returns False if a buffer couldn't be acquired and the frame was dropped.
+- (BOOL)renderFrame:(BOOL)transaction {
     const CGSize drawableSize = [metalLayer drawableSize];
     const uint64_t index = frameIndex % 3;
     mtlbuffer &buffer = buffers[index];
 
-    // If we fail to acquire the buffer, drop this frame and try again on the
-    // next draw loop iteration. This should be rare.
     if (!buffer.try_lock()) {
-        [self setNeedsDisplay:YES];
-        return;
+        return NO;
+    }
+
+    os_signpost_interval_begin(rpc, OS_SIGNPOST_ID_EXCLUSIVE, "Encode");
+
+    // Glyph managers share rasterizers, and windows may render concurrently.
+    // The glyph lock is shared by every window, so it's only held while
+    // glyphs are looked up, and released before waiting for a drawable.
+    std::unique_lock glyphLock(*renderContext.glyphLock);
+
+    // Glyph counters are totals across windows. Holding the glyph lock from
+    // lookup to resolve makes their difference this frame's share.
+    frame_stats *stats = frameStats;
+    glyph_cache_stats glyphStats = stats ? glyphManager->stats() : glyph_cache_stats{};
+    uint64_t cellsVisited = 0;
+
+    const size_t gridWidth = grid->width();
+    const size_t gridHeight = grid->height();
+    const size_t cursorRow = cursor.row();
+
+    // Rows that changed since the state was recorded. The cursor recolors the
+    // cells beneath it, so the rows of the old and new cursor are included.
+    // If the scrolls made since were replayed, rows are compared by content
+    // tick, which follows the rows through the scrolls.
+    auto rowChanged = [&](size_t row, uint64_t tick, size_t oldCursorRow, bool replayed) {
+        uint64_t rowTick = replayed ? grid->content_tick(row) : grid->row_tick(row);
+        return rowTick > tick || row == cursorRow || row == oldCursorRow;
+    };
+
+    // Adjacent cells with the same line style and color are merged into a
+    // single run. Undercurls keep counting across runs, so dotted lines stay
+    // in phase where their color changes.
+    auto encodeLines = [&](size_t row, std::vector<line_data> &rowLines) {
+        int16_t undercurlNext = -1;
+        uint16_t undercurlPosition = 0;
+        rowLines.clear();
+
+        // The index of the run that ends where the next cell would begin.
+        struct openRun {
+            size_t index;
+            int16_t next;
+        };
+
+        openRun lowerRun = {0, -1};
+        openRun strikeRun = {0, -1};
+
+        auto addLine = [&](openRun &run, int16_t col, uint32_t color,
+                           const line_metrics &metrics, uint16_t count) {
+            if (run.next == col) {
+                line_data &line = rowLines[run.index];
+
+                if (line.color == color &&
+                    line.ytranslate == metrics.ytranslate &&
+                    line.period == metrics.period &&
+                    line.thickness == metrics.thickness) {
+                    line.length += 1;
+                    run.next = col + 1;
+                    return;
+                }
+            }
+
+            run.index = rowLines.size();
+            run.next = col + 1;
+            rowLines.push_back(line_data(simd_make_short2(col, row), color, metrics, count));
+        };
+
+        AdjustedRow(grid, cursor, row).forEach([&](int16_t col, const nvim::cell *cell) {
+            if (!cell->has_line_emphasis()) {
+                return;
+            }
+
+            uint32_t color = cell->special();
+
+            // Undercurls and underlines are mutually exclusive. We'll make
+            // undercurls take priority, they usually represent errors,
+            // so users won't appreciate them being hidden.
+            if (cell->has_undercurl()) {
+                if (undercurlNext == col) {
+                    undercurlPosition += 1;
+                } else {
+                    undercurlPosition = 0;
+                }
+
+                undercurlNext = col + 1;
+                addLine(lowerRun, col, color, undercurl, undercurlPosition);
+            } else if (cell->has_underline()) {
+                addLine(lowerRun, col, color, underline, 0);
+            }
+
+            if (cell->has_strikethrough()) {
+                addLine(strikeRun, col, color, strikethrough, 0);
+            }
+        });
+    };
+
+    // Lines are encoded first, so their buffer region can be sized to fit.
+    const bool rebuildLines = !lineCache.valid                         ||
+                              lineCache.fontGeneration != fontGeneration ||
+                              lineCache.gridSize != grid->size()       ||
+                              lineCache.gridTick > grid->tick();
+
+    size_t oldLineCursorRow = lineCache.cursorRow;
+    std::optional<std::span<const nvim::grid_scroll_move>> lineMoves;
+
+    if (rebuildLines) {
+        lineCache.rows.resize(gridHeight);
+    } else if ((lineMoves = grid->scroll_moves_since(lineCache.gridTick))) {
+        for (const nvim::grid_scroll_move &move : *lineMoves) {
+            move.apply(lineCache.rows);
+            oldLineCursorRow = move.moved_row(oldLineCursorRow);
+
+            for (size_t row=move.top; row<move.bottom; ++row) {
+                for (line_data &line : lineCache.rows[row]) {
+                    line.grid_position.y = row;
+                }
+            }
+        }
     }
 
-    // Allocate enough memory for the worst case scenario, where every cell has
-    // a glyph, a strikethrough, and an underline / undercurl. It takes two
-    // line_data objects to handle a cell with both a strikethrough and an
-    // underline / undercurl.
-    //
-    // We're using a lot of memory to handle our line data, but most grids have
-    // very few lines. Maybe this could be reworked.
+    size_t linesCount = 0;
+
+    for (size_t row=0; row<gridHeight; ++row) {
+        std::vector<line_data> &rowLines = lineCache.rows[row];
+
+        if (rebuildLines || rowChanged(row, lineCache.gridTick, oldLineCursorRow,
+                                       lineMoves.has_value())) {
+            encodeLines(row, rowLines);
+        }
+
+        linesCount += rowLines.size();
+    }
+
+    lineCache.fontGeneration = fontGeneration;
+    lineCache.gridTick = grid->tick();
+    lineCache.gridSize = grid->size();
+    lineCache.cursorRow = cursorRow;
+    lineCache.valid = true;
+
+    // The stats overlay is laid out as a small grid of its own, drawn over
+    // the top left corner of the grid with the grid pipelines. It's written
+    // in full every frame.
+    std::vector<std::string> overlayLines;
+
+    if (stats && stats->overlay_enabled()) {
+        overlayLines = statsOverlayLines(stats->summary());
+    }
+
+    const size_t overlayHeight = std::min(overlayLines.size(), gridHeight);
+    size_t overlayWidth = 0;
+
+    for (size_t row=0; row<overlayHeight; ++row) {
+        overlayWidth = std::max(overlayWidth, overlayLines[row].size());
+    }
+
+    overlayWidth = std::min(overlayWidth, gridWidth);
+
+    // Every cell has a fixed background and glyph slot. Line runs are sized to
+    // the lines we have, rounded up so the buffer isn't reallocated each time
+    // another run appears. The line region comes after the grid regions, so
+    // changing its size preserves them. The overlay regions come last.
     const size_t gridSize = grid->cells_size();
+    const size_t overlaySize = overlayWidth * overlayHeight;
+    const size_t lineCapacity = std::bit_ceil(std::max<size_t>(linesCount, 64));
     const size_t uniformBufferSize    = sizeof(uniform_data);
+    const size_t slotBufferSize       = grid->height() * sizeof(uint16_t);
     const size_t backgroundBufferSize = gridSize * sizeof(uint32_t);
     const size_t glyphBufferSize      = gridSize * sizeof(glyph_data);
-    const size_t lineBufferSize       = gridSize * sizeof(line_data) * 2;
+    const size_t lineBufferSize       = lineCapacity * sizeof(line_data);
+
+    const size_t overlayUniformSize    = overlaySize ? sizeof(uniform_data) : 0;
+    const size_t overlaySlotSize       = overlayHeight * sizeof(uint16_t);
+    const size_t overlayBackgroundSize = overlaySize * sizeof(uint32_t);
+    const size_t overlayGlyphSize      = overlaySize * sizeof(glyph_data);
 
     // Pad to account for over allocations caused by alignment.
-    const size_t bufferSize = (256 * 4) + uniformBufferSize
+    const size_t bufferSize = (256 * 9) + uniformBufferSize
+                                        + slotBufferSize
                                         + backgroundBufferSize
                                         + glyphBufferSize
-                                        + lineBufferSize;
+                                        + lineBufferSize
+                                        + overlayUniformSize
+                                        + overlaySlotSize
+                                        + overlayBackgroundSize
+                                        + overlayGlyphSize;
 
-    buffer.create(device, bufferSize);
+    const bool reallocated = buffer.create(device, bufferSize);
     auto uniformBuffer    = buffer.allocate(uniformBufferSize);
+    auto slotBuffer       = buffer.allocate(slotBufferSize);
     auto backgroundBuffer = buffer.allocate(backgroundBufferSize);
     auto glyphBuffer      = buffer.allocate(glyphBufferSize);
     auto lineBuffer       = buffer.allocate(lineBufferSize);
 
+    auto overlayUniformBuffer    = buffer.allocate(overlayUniformSize);
+    auto overlaySlotBuffer       = buffer.allocate(overlaySlotSize);
+    auto overlayBackgroundBuffer = buffer.allocate(overlayBackgroundSize);
+    auto overlayGlyphBuffer      = buffer.allocate(overlayGlyphSize);
+
     auto uniforms    = static_cast<uniform_data*>(uniformBuffer.ptr);
+    auto slotRows    = static_cast<uint16_t*>(slotBuffer.ptr);
     auto backgrounds = static_cast<uint32_t*>(backgroundBuffer.ptr);
     auto glyphs      = static_cast<glyph_data*>(glyphBuffer.ptr);
     auto lines       = static_cast<line_data*>(lineBuffer.ptr);
@@ -509,48 +863,168 @@ static void blinkCursorToggleOn(void *context) {
     uniforms->cursor_line_width = cursorLineThickness;
     uniforms->cursor_cell_width = cursor.width();
 
-    glyph_data *glyphsBegin = glyphs;
-    line_data *linesBegin = lines;
-    simd_short2 undercurlNext = simd_make_short2(-1, -1);
-    uint16_t undercurlPosition = 0;
+    BufferState &state = bufferStates[index];
+
+    // Empty cells are given zero sized glyphs, which produce no fragments, to
+    // keep every cell at a fixed offset in its row slot.
+    auto encodeRow = [&](size_t row) {
+        size_t slot = state.rowSlots[row];
+        uint32_t *rowBackgrounds = backgrounds + (slot * gridWidth);
+        glyph_data *rowGlyphs = glyphs + (slot * gridWidth);
+        cellsVisited += gridWidth;
+
+        AdjustedRow(grid, cursor, row).forEach([&](int16_t col, const nvim::cell *cell) {
+            simd_short2 gridpos = simd_make_short2(col, row);
+            rowBackgrounds[col] = cell->background();
+
+            if (!cell->empty()) {
+                rowGlyphs[col] = glyph_data(gridpos, cell->width(), cell->foreground(), glyph_rect{});
+                glyphManager->get_deferred(fontFamily, *cell, &rowGlyphs[col].rect);
+            } else {
+                rowGlyphs[col] = glyph_data(gridpos, 1, 0, glyph_rect{});
+            }
+        });
+    };
 
-    AdjustedGrid(grid, cursor).forEach([&](int16_t row, int16_t col, const nvim::cell *cell) {
-        simd_short2 gridpos = simd_make_short2(col, row);
-        *backgrounds++ = cell->background();
+    // Before an eviction, every visible glyph is looked up again so the glyph
+    // manager knows which glyphs are still in use.
+    const bool rebuild = reallocated                                     ||
+                         glyphManager->eviction_due(glyphClient)         ||
+                         !state.valid                                    ||
+                         state.glyphManager != glyphManager              ||
+                         state.glyphGeneration != glyphManager->generation() ||
+                         state.fontGeneration != fontGeneration          ||
+                         state.gridSize != grid->size()                  ||
+                         state.gridTick > grid->tick();
+
+    // Glyph cache misses are resolved in one batch once every changed row has
+    // been encoded, so we only record which ranges to update for now.
+    dirtySlots.clear();
+    dirtyRuns.clear();
+
+    if (rebuild) {
+        state.rowSlots.resize(gridHeight);
+        std::iota(state.rowSlots.begin(), state.rowSlots.end(), 0);
+
+        for (size_t row=0; row<gridHeight; ++row) {
+            encodeRow(row);
+        }
+    } else {
+        size_t oldCursorRow = state.cursorRow;
+        auto moves = grid->scroll_moves_since(state.gridTick);
 
-        if (cell->has_line_emphasis()) {
-            nvim::rgb_color color = cell->special();
+        if (moves) {
+            for (const nvim::grid_scroll_move &move : *moves) {
+                move.apply(state.rowSlots);
+                oldCursorRow = move.moved_row(oldCursorRow);
+            }
+        }
 
-            // Undercurls and underlines are mutually exclusive. We'll make
-            // undercurls take priority, they usually represent errors,
-            // so users won't appreciate them being hidden.
-            if (cell->has_undercurl()) {
-                if (simd_equal(undercurlNext, gridpos)) {
-                    undercurlPosition += 1;
-                } else {
-                    undercurlPosition = 0;
-                }
+        for (size_t row=0; row<gridHeight; ++row) {
+            if (rowChanged(row, state.gridTick, oldCursorRow, moves.has_value())) {
+                encodeRow(row);
+                dirtySlots.push_back(state.rowSlots[row]);
+            }
+        }
 
-                undercurlNext = simd_make_short2(col + 1, row);
-                *lines++ = line_data(gridpos, color, undercurl, undercurlPosition);
-            } else if (cell->has_underline()) {
-                *lines++ = line_data(gridpos, color, underline);
+        std::sort(dirtySlots.begin(), dirtySlots.end());
+
+        for (size_t slot : dirtySlots) {
+            if (dirtyRuns.size() && dirtyRuns.back().second == slot) {
+                dirtyRuns.back().second += 1;
+            } else {
+                dirtyRuns.emplace_back(slot, slot + 1);
             }
+        }
+    }
 
-            if (cell->has_strikethrough()) {
-                *lines++ = line_data(gridpos, color, strikethrough);
+    for (size_t row=0; row<gridHeight; ++row) {
+        slotRows[state.rowSlots[row]] = row;
+    }
+
+    if (overlaySize) {
+        auto overlayUniforms    = static_cast<uniform_data*>(overlayUniformBuffer.ptr);
+        auto overlaySlots       = static_cast<uint16_t*>(overlaySlotBuffer.ptr);
+        auto overlayBackgrounds = static_cast<uint32_t*>(overlayBackgroundBuffer.ptr);
+        auto overlayGlyphs      = static_cast<glyph_data*>(overlayGlyphBuffer.ptr);
+
+        *overlayUniforms = *uniforms;
+        overlayUniforms->grid_width = static_cast<uint32_t>(overlayWidth);
+
+        nvim::cell_attributes attrs = {};
+        attrs.background = nvim::rgb_color(0x202020);
+        attrs.foreground = nvim::rgb_color(0xE0E0E0);
+
+        for (size_t row=0; row<overlayHeight; ++row) {
+            const std::string &line = overlayLines[row];
+            overlaySlots[row] = row;
+
+            for (size_t col=0; col<overlayWidth; ++col) {
+                size_t index = (row * overlayWidth) + col;
+                simd_short2 gridpos = simd_make_short2(static_cast<int16_t>(col),
+                                                       static_cast<int16_t>(row));
+                char ch = col < line.size() ? line[col] : ' ';
+
+                overlayBackgrounds[index] = attrs.background;
+
+                if (ch == ' ') {
+                    overlayGlyphs[index] = glyph_data(gridpos, 1, 0, glyph_rect{});
+                    continue;
+                }
+
+                nvim::grapheme_cluster text = {};
+                text[0] = ch;
+
+                nvim::cell cell(text, 1, attrs);
+                overlayGlyphs[index] = glyph_data(gridpos, 1, attrs.foreground, glyph_rect{});
+                glyphManager->get_deferred(fontFamily, cell, &overlayGlyphs[index].rect);
             }
         }
+    }
+
+    glyphManager->resolve();
 
-        if (!cell->empty()) {
-            glyph_rect glyph = glyphManager->get(fontFamily, *cell);
-            *glyphs++ = glyph_data(gridpos, cell->width(), glyph);
+    // Evictions and cache growth copy glyphs to a new texture, so the texture
+    // our glyph_rects point into stays valid once the glyph lock is released.
+    const id<MTLTexture> glyphTexture = glyphManager->texture();
+    const uint64_t glyphGeneration = glyphManager->generation();
+    const glyph_cache_stats frameGlyphStats = stats ? glyphManager->stats() : glyph_cache_stats{};
+    glyphLock.unlock();
+
+    if (rebuild) {
+        buffer.update(0, glyphBuffer.offset + glyphBufferSize);
+    } else {
+        buffer.update(uniformBuffer.offset, uniformBufferSize);
+        buffer.update(slotBuffer.offset, slotBufferSize);
+
+        // Adjacent changed slots are coalesced into a single modified range for
+        // each of the background and glyph regions.
+        for (auto [runBegin, runEnd] : dirtyRuns) {
+            size_t begin = runBegin * gridWidth;
+            size_t count = (runEnd - runBegin) * gridWidth;
+
+            buffer.update(backgroundBuffer.offset + (begin * sizeof(uint32_t)),
+                          count * sizeof(uint32_t));
+
+            buffer.update(glyphBuffer.offset + (begin * sizeof(glyph_data)),
+                          count * sizeof(glyph_data));
         }
-    });
+    }
+
+    state.glyphManager = glyphManager;
+    state.glyphGeneration = glyphGeneration;
+    state.fontGeneration = fontGeneration;
+    state.gridTick = grid->tick();
+    state.gridSize = grid->size();
+    state.cursorRow = cursorRow;
+    state.valid = true;
 
-    size_t glyphsCount = glyphs - glyphsBegin;
-    size_t linesCount = lines - linesBegin;
-    buffer.update(0, glyphBuffer.offset + (sizeof(glyph_data) * glyphsCount));
+    line_data *nextLine = lines;
+
+    for (const std::vector<line_data> &rowLines : lineCache.rows) {
+        memcpy(nextLine, rowLines.data(), sizeof(line_data) * rowLines.size());
+        nextLine += rowLines.size();
+    }
 
     id<CAMetalDrawable> drawable = [metalLayer nextDrawable];
     MTLRenderPassDescriptor *desc = [MTLRenderPassDescriptor renderPassDescriptor];
@@ -565,20 +1039,19 @@ static void blinkCursorToggleOn(void *context) {
     [commandEncoder setRenderPipelineState:backgroundRenderPipeline];
     [commandEncoder setVertexBuffer:buffer.get() offset:uniformBuffer.offset atIndex:0];
     [commandEncoder setVertexBuffer:buffer.get() offset:backgroundBuffer.offset atIndex:1];
+    [commandEncoder setVertexBuffer:buffer.get() offset:slotBuffer.offset atIndex:2];
     [commandEncoder drawPrimitives:MTLPrimitiveTypeTriangleStrip
                        vertexStart:0
                        vertexCount:4
                      instanceCount:gridSize];
 
-    if (glyphsCount) {
-        [commandEncoder setRenderPipelineState:glyphRenderPipeline];
-        [commandEncoder setVertexBufferOffset:glyphBuffer.offset atIndex:1];
-        [commandEncoder setFragmentTexture:glyphManager->texture() atIndex:0];
-        [commandEncoder drawPrimitives:MTLPrimitiveTypeTriangleStrip
-                           vertexStart:0
-                           vertexCount:4
-                         instanceCount:glyphsCount];
-    }
+    [commandEncoder setRenderPipelineState:glyphRenderPipeline];
+    [commandEncoder setVertexBufferOffset:glyphBuffer.offset atIndex:1];
+    [commandEncoder setFragmentTexture:glyphTexture atIndex:0];
+    [commandEncoder drawPrimitives:MTLPrimitiveTypeTriangleStrip
+                       vertexStart:0
+                       vertexCount:4
+                     instanceCount:gridSize];
 
     if (linesCount) {
         buffer.update(lineBuffer.offset, sizeof(line_data) * linesCount);
@@ -620,20 +1093,355 @@ static void blinkCursorToggleOn(void *context) {
             break;
 
         case nvim::cursor_shape::block:
-            break; // Block cursors are handled with AdjustedGrids.
+            break; // Block cursors are handled with AdjustedRows.
+    }
+
+    if (overlaySize) {
+        buffer.update(overlayUniformBuffer.offset,
+                      overlayGlyphBuffer.offset + overlayGlyphSize - overlayUniformBuffer.offset);
+
+        [commandEncoder setRenderPipelineState:backgroundRenderPipeline];
+        [commandEncoder setVertexBufferOffset:overlayUniformBuffer.offset atIndex:0];
+        [commandEncoder setVertexBufferOffset:overlayBackgroundBuffer.offset atIndex:1];
+        [commandEncoder setVertexBufferOffset:overlaySlotBuffer.offset atIndex:2];
+        [commandEncoder drawPrimitives:MTLPrimitiveTypeTriangleStrip
+                           vertexStart:0
+                           vertexCount:4
+                         instanceCount:overlaySize];
+
+        [commandEncoder setRenderPipelineState:glyphRenderPipeline];
+        [commandEncoder setVertexBufferOffset:overlayGlyphBuffer.offset atIndex:1];
+        [commandEncoder drawPrimitives:MTLPrimitiveTypeTriangleStrip
+                           vertexStart:0
+                           vertexCount:4
+                         instanceCount:overlaySize];
     }
 
     [commandEncoder endEncoding];
+    os_signpost_interval_end(rpc, OS_SIGNPOST_ID_EXCLUSIVE, "Encode");
+
+    // The frame's sample is pushed once it's presented, along with the time
+    // from the flush that completed the grid. Later frames of the same grid
+    // don't measure the flush again.
+    frame_sample sample = {};
+    uint64_t flushTime = grid->flushed_time();
+    bool measureFlush = flushTime != lastFlushTime;
+    lastFlushTime = flushTime;
+
+    if (stats) {
+        sample.cells = cellsVisited;
+        sample.glyph_hits = frameGlyphStats.hits - glyphStats.hits;
+        sample.glyph_misses = frameGlyphStats.misses - glyphStats.misses;
+        sample.rasterized = frameGlyphStats.rasterized - glyphStats.rasterized;
+        sample.upload_bytes = buffer.take_updated();
+        sample.cache_pages = frameGlyphStats.pages;
+        sample.evictions = frameGlyphStats.evictions;
+    }
+
+    // Only the first frame containing a key press's flush is measured.
+    latency_tracker *tracker = nullptr;
+    uint64_t inputTime = grid->input_time();
+
+    if (latencyTracker && inputTime != lastInputTime) {
+        tracker = latencyTracker;
+        tracker->record(latency_stage::encode, inputTime);
+    }
+
+    lastInputTime = inputTime;
+
+    os_signpost_id_t signpost = os_signpost_id_generate(rpc);
+    os_signpost_interval_begin(rpc, signpost, "GPU");
+
     [commandBuffer addCompletedHandler:^(id<MTLCommandBuffer> commandBuffer) {
+        os_signpost_interval_end(rpc, signpost, "GPU");
+
+        if (tracker) {
+            tracker->record(latency_stage::present, inputTime);
+        }
+
+        if (stats) {
+            frame_sample presented = sample;
+            presented.time = frame_stats::now();
+
+            if (measureFlush && flushTime) {
+                presented.present_latency = presented.time - flushTime;
+            }
+
+            stats->push(presented);
+        }
+
         self->buffers[index].unlock();
     }];
 
-    [commandBuffer commit];
-    [commandBuffer waitUntilScheduled];
-    [drawable present];
+    if (transaction) {
+        [commandBuffer commit];
+        [commandBuffer waitUntilScheduled];
+        [drawable present];
+    } else {
+        [commandBuffer presentDrawable:drawable];
+        [commandBuffer commit];
+    }
 
     frameIndex += 1;
-    glyphManager->evict();
+
+    if (framesPresented++ == 0 && self.firstFrameHandler) {
+        self.firstFrameHandler();
+    }
+
+    glyphLock.lock();
+    bool evictionScheduled = glyphManager->evict(glyphClient);
+    glyphLock.unlock();
+
+    if (evictionScheduled) {
+        NVRenderContext *context = renderContext;
+
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [[NSNotificationCenter defaultCenter] postNotificationName:NVGlyphCacheEvictionDueNotification
+                                                                object:context];
+        });
+    }
+
+    return YES;
+}
+
+static CVReturn displayLinkCallback(CVDisplayLinkRef displayLink,
+                                    const CVTimeStamp *now,
+                                    const CVTimeStamp *outputTime,
+                                    CVOptionFlags flagsIn,
+                                    CVOptionFlags *flagsOut,
+                                    void *context);
+
+- (void)scheduleFramesWithGridProvider:(const nvim::grid* (^)(void))provider
+                       gridSizeHandler:(void (^)(nvim::grid_size))handler
+                          renderThread:(BOOL)useRenderThread {
+    if (displayLink) {
+        return;
+    }
+
+    {
+        std::lock_guard lock(stateLock);
+        gridProvider = provider;
+        gridSizeHandler = handler;
+        providedGridSize = grid ? grid->size() : nvim::grid_size{};
+        renderThread = useRenderThread;
+        metalLayer.presentsWithTransaction = !renderThread || liveResizing;
+    }
+
+    CVDisplayLinkCreateWithActiveCGDisplays(&displayLink);
+    CVDisplayLinkSetOutputCallback(displayLink, displayLinkCallback, (__bridge void*)self);
+    [self updateDisplayLinkScreen];
+    [self setNeedsGrid];
+}
+
+- (void)stopDisplayLink {
+    if (!displayLink) {
+        return;
+    }
+
+    // CVDisplayLinkStop waits for the callback to return.
+    CVDisplayLinkStop(displayLink);
+    CVDisplayLinkRelease(displayLink);
+    displayLink = nullptr;
+
+    std::lock_guard lock(stateLock);
+    gridProvider = nil;
+    gridSizeHandler = nil;
+    metalLayer.presentsWithTransaction = YES;
+}
+
+- (void)setNeedsGrid {
+    gridNeeded = true;
+
+    if (liveResizing) {
+        [self setNeedsDisplay:YES];
+    } else {
+        [self wakeDisplayLink];
+    }
+}
+
+/// Requests a frame on the next display refresh. Main thread only.
+- (void)requestFrame {
+    frameNeeded = true;
+    [self wakeDisplayLink];
+}
+
+/// Restarts the display link if it stopped while idle. Main thread only.
+- (void)wakeDisplayLink {
+    if (displayLink && !CVDisplayLinkIsRunning(displayLink)) {
+        idleRefreshes = 0;
+        CVDisplayLinkStart(displayLink);
+    }
+}
+
+/// Stops the display link if nothing was requested since it went idle.
+/// Requests are only made on the main thread, so a request can't be missed.
+- (void)stopIdleDisplayLink {
+    if (displayLink && idleRefreshes >= idleRefreshLimit && !gridNeeded && !frameNeeded) {
+        CVDisplayLinkStop(displayLink);
+    }
+}
+
+// Runs on the display link thread once per display refresh. Any number of
+// flushes and redraw requests made since the last refresh are coalesced into
+// a single frame. On high refresh rate displays, such as ProMotion displays,
+// the display link follows the display's refresh rate.
+- (void)displayLinkDidFire {
+    if (frame_stats *stats = frameStats) {
+        stats->refreshed();
+    }
+
+    if (!gridNeeded && !frameNeeded) {
+        if (++idleRefreshes == idleRefreshLimit) {
+            dispatch_async(dispatch_get_main_queue(), ^{
+                [self stopIdleDisplayLink];
+            });
+        }
+
+        return;
+    }
+
+    idleRefreshes = 0;
+
+    // Without a render thread, frames are drawn on the main thread. At most one
+    // frame is queued at a time, further requests wait for the next refresh.
+    if (!renderThread) {
+        if (!mainFramePending.exchange(true)) {
+            dispatch_async(dispatch_get_main_queue(), ^{
+                self->mainFramePending = false;
+                [self drawScheduledFrame:YES];
+            });
+        }
+
+        return;
+    }
+
+    // Leave the request for the main thread, it draws while live resizing.
+    if (!liveResizing) {
+        [self drawScheduledFrame:NO];
+    }
+}
+
+/// Draws the requested frame, taking a new grid if requested.
+- (void)drawScheduledFrame:(BOOL)transaction {
+    std::lock_guard lock(stateLock);
+
+    if (liveResizing && !transaction) {
+        return;
+    }
+
+    if (gridNeeded.exchange(false)) {
+        [self takeProvidedGrid];
+    }
+
+    frameNeeded = false;
+
+    if (![self renderFrame:transaction]) {
+        frameNeeded = true;
+    }
+}
+
+static CVReturn displayLinkCallback(CVDisplayLinkRef displayLink,
+                                    const CVTimeStamp *now,
+                                    const CVTimeStamp *outputTime,
+                                    CVOptionFlags flagsIn,
+                                    CVOptionFlags *flagsOut,
+                                    void *context) {
+    @autoreleasepool {
+        [(__bridge NVGridView*)context displayLinkDidFire];
+    }
+
+    return kCVReturnSuccess;
+}
+
+/// Replaces the grid with one obtained from the grid provider.
+/// Requires stateLock.
+- (void)takeProvidedGrid {
+    if (!gridProvider) {
+        return;
+    }
+
+    [self updateGrid:gridProvider()];
+    nvim::grid_size size = grid->size();
+
+    if (size != providedGridSize) {
+        providedGridSize = size;
+        auto handler = gridSizeHandler;
+
+        dispatch_async(dispatch_get_main_queue(), ^{
+            handler(size);
+        });
+    }
+}
+
+- (latency_tracker*)latencyTracker {
+    return latencyTracker;
+}
+
+- (void)setLatencyTracker:(latency_tracker*)tracker {
+    std::lock_guard lock(stateLock);
+    latencyTracker = tracker;
+}
+
+- (frame_stats*)frameStats {
+    return frameStats;
+}
+
+- (void)setFrameStats:(frame_stats*)stats {
+    std::lock_guard lock(stateLock);
+    frameStats = stats;
+}
+
+- (void)updateDisplayLinkScreen {
+    NSScreen *screen = self.window.screen;
+
+    if (!displayLink || !screen) {
+        return;
+    }
+
+    NSNumber *screenNumber = screen.deviceDescription[@"NSScreenNumber"];
+    CVDisplayLinkSetCurrentCGDisplay(displayLink, [screenNumber unsignedIntValue]);
+}
+
+- (void)windowDidChangeScreen:(NSNotification *)notification {
+    [self updateDisplayLinkScreen];
+}
+
+- (void)viewDidMoveToWindow {
+    [super viewDidMoveToWindow];
+
+    NSNotificationCenter *center = [NSNotificationCenter defaultCenter];
+    [center removeObserver:self name:NSWindowDidChangeScreenNotification object:nil];
+
+    if (self.window) {
+        [center addObserver:self
+                   selector:@selector(windowDidChangeScreen:)
+                       name:NSWindowDidChangeScreenNotification
+                     object:self.window];
+    }
+
+    [self updateDisplayLinkScreen];
+}
+
+- (void)viewWillStartLiveResize {
+    [super viewWillStartLiveResize];
+
+    std::lock_guard lock(stateLock);
+    liveResizing = true;
+    metalLayer.presentsWithTransaction = YES;
+}
+
+- (void)viewDidEndLiveResize {
+    [super viewDidEndLiveResize];
+
+    {
+        std::lock_guard lock(stateLock);
+        liveResizing = false;
+        metalLayer.presentsWithTransaction = !displayLink || !renderThread;
+    }
+
+    if (displayLink) {
+        [self requestFrame];
+    }
 }
 
 - (BOOL)isFlipped {
@@ -661,6 +1469,14 @@ static void blinkCursorToggleOn(void *context) {
 }
 
 - (void)dealloc {
+    [self stopDisplayLink];
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+
+    if (glyphManager) {
+        std::lock_guard glyphLock(*renderContext.glyphLock);
+        glyphManager->remove_client(glyphClient);
+    }
+
     if (!blinkTimerActive) {
         dispatch_resume(blinkTimer);
     }
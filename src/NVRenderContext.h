@@ -12,9 +12,16 @@
 
 struct font_manager;
 struct glyph_manager;
+class font_family;
+class unfair_lock;
 
 NS_ASSUME_NONNULL_BEGIN
 
+/// Posted on the main thread when a render context's glyph cache is due to be
+/// evicted. The object is the NVRenderContext. Views drawing with the render
+/// context should draw a frame, so their visible glyphs are kept.
+extern NSNotificationName const NVGlyphCacheEvictionDueNotification;
+
 /// @class NVRenderContext
 /// @abstract Manages Metal device related state.
 ///
@@ -55,6 +62,18 @@ NS_ASSUME_NONNULL_BEGIN
 /// The shared font manager.
 @property (nonatomic, readonly) struct font_manager* fontManager;
 
+/// Guards the glyph manager.
+/// Render contexts created by the same manager share glyph rasterizers, so
+/// they share this lock too. Hold it while using the glyph manager.
+@property (nonatomic, readonly) class unfair_lock* glyphLock;
+
+/// Asynchronously caches the printable ASCII and Latin-1 characters of font.
+/// Every font_attributes variant of the family is rasterized and added to the
+/// glyph manager on a background queue. Fonts are only prewarmed once,
+/// repeated calls with the same font are ignored. Has no effect if the glyph
+/// manager doesn't use glyph masks.
+- (void)prewarmFont:(const font_family &)font;
+
 @end
 
 /// Controls the parameters of a NVRenderContexts and the objects it creates.
@@ -65,6 +84,11 @@ struct NVRenderContextOptions {
     /// The glyph_rasterizer width.
     size_t rasterizerWidth;
 
+    /// The number of glyph_rasterizers used to rasterize glyphs concurrently.
+    /// Each rasterizer allocates its own RGBA canvas, sized at double the
+    /// rasterizer width and height.
+    size_t rasterizerCount;
+
     /// The glyph_texture_cache page height.
     size_t cachePageHeight;
 
@@ -77,13 +101,19 @@ struct NVRenderContextOptions {
     /// The glyph_texture_cache growth factor.
     double cacheGrowthFactor;
 
-    /// For a given glyph_texture_cache, when the number of allocated cache
-    /// pages exceeds this threshold, the texture cache is evicted.
-    size_t cacheEvictionThreshold;
+    /// The GPU memory, in bytes, a render context's glyph cache may use. Once
+    /// the allocated cache pages exceed the budget, the cache is evicted. The
+    /// budget is shared by every window drawing with the render context.
+    size_t cacheMemoryBudget;
 
     /// The number of cache pages to preserve when a texture cache is evicted.
-    /// This number should be less than cacheEvictionThreshold.
+    /// This many pages should fit well within cacheMemoryBudget.
     size_t cacheEvictionPreserve;
+
+    /// If true, glyphs are cached as coverage masks and tinted when drawn, so
+    /// a glyph is cached once regardless of its colors. If false, glyphs are
+    /// rasterized with their cell colors, see glyph_rasterizer.
+    bool glyphMasks;
 };
 
 /// @protocol NVMetalDeviceDelegate
@@ -110,11 +140,22 @@ struct NVRenderContextOptions {
 @interface NVRenderContextManager : NSObject
 
 /// Returns a NVRenderContextManager.
+/// Render contexts are created concurrently on background threads, this
+/// method does not wait for them. Methods returning render contexts wait for
+/// them to finish loading. Device initialization failures are reported once
+/// every render context has loaded.
 /// @param options  Render context options.
 /// @param delegate Receives updates on device initialization failures.
 - (instancetype)initWithOptions:(struct NVRenderContextOptions)options
                        delegate:(id<NVMetalDeviceDelegate>)delegate;
 
+/// Waits for the initial render contexts to finish loading.
+- (void)waitUntilLoaded;
+
+/// Calls handler on the main thread once the initial render contexts have
+/// loaded. If they already have, handler is called immediately.
+- (void)notifyWhenLoaded:(dispatch_block_t)handler;
+
 /// The font manager used by managed render contexts.
 ///
 /// Font managers are not bound to specific GPUs. However, for maximum
@@ -123,6 +164,10 @@ struct NVRenderContextOptions {
 /// Note: All render contexts created by this manager share a font manager.
 @property (nonatomic, readonly) struct font_manager* fontManager;
 
+/// Returns a human readable report of each render context's glyph cache,
+/// one device per line.
+- (NSString*)glyphCacheReport;
+
 /// Returns a default render context.
 ///
 /// Uses the Metal device associated with the main display. Note: On systems
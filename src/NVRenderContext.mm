@@ -8,7 +8,14 @@
 //
 
 #import "NVRenderContext.h"
+#include <CommonCrypto/CommonDigest.h>
+#include <stdio.h>
+#include <mutex>
+#include <optional>
+#include <vector>
 #include "font.hpp"
+#include "log.h"
+#include "unfair_lock.hpp"
 
 static inline MTLRenderPipelineDescriptor* defaultPipelineDescriptor() {
     MTLRenderPipelineDescriptor *desc = [[MTLRenderPipelineDescriptor alloc] init];
@@ -30,19 +37,226 @@ static inline MTLRenderPipelineDescriptor* blendedPipelineDescriptor() {
     return desc;
 }
 
+/// Blends premultiplied source colors.
+static inline MTLRenderPipelineDescriptor* premultipliedPipelineDescriptor() {
+    MTLRenderPipelineDescriptor *desc = blendedPipelineDescriptor();
+    desc.colorAttachments[0].sourceRGBBlendFactor = MTLBlendFactorOne;
+    desc.colorAttachments[0].sourceAlphaBlendFactor = MTLBlendFactorOne;
+    return desc;
+}
+
+// Compiled pipelines are kept in a binary archive in the caches directory, so
+// later launches, and newly attached devices of the same kind, can skip
+// compiling shaders. Archives are keyed by device name, app version, OS
+// version, and a hash of the shader library, as an archive is only useful to
+// the compiler and shaders that produced it.
+
+/// Returns a hex digest of the app's default Metal library, or an empty
+/// string if it can't be read. Shaders can change without a version bump, in
+/// development builds especially.
+static NSString* defaultLibraryHash() {
+    static NSString *hash = []() -> NSString* {
+        NSURL *url = [[NSBundle mainBundle] URLForResource:@"default" withExtension:@"metallib"];
+        NSData *data = url ? [NSData dataWithContentsOfURL:url] : nil;
+
+        if (!data) {
+            return @"";
+        }
+
+        unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+        CC_SHA256([data bytes], (CC_LONG)[data length], digest);
+
+        // Half the digest is plenty to tell libraries apart.
+        NSMutableString *string = [NSMutableString stringWithCapacity:CC_SHA256_DIGEST_LENGTH];
+
+        for (size_t i=0; i<CC_SHA256_DIGEST_LENGTH / 2; ++i) {
+            [string appendFormat:@"%02x", digest[i]];
+        }
+
+        return [string copy];
+    }();
+
+    return hash;
+}
+
+/// Returns the pipeline archive location for device, or nil if the caches
+/// directory is unavailable.
+static NSURL* pipelineArchiveURL(id<MTLDevice> device) {
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSBundle *bundle = [NSBundle mainBundle];
+
+    NSURL *caches = [[fileManager URLsForDirectory:NSCachesDirectory
+                                         inDomains:NSUserDomainMask] firstObject];
+
+    if (!caches || ![bundle bundleIdentifier]) {
+        return nil;
+    }
+
+    NSURL *directory = [[caches URLByAppendingPathComponent:[bundle bundleIdentifier]]
+                                URLByAppendingPathComponent:@"Pipelines"];
+
+    if (![fileManager createDirectoryAtURL:directory
+               withIntermediateDirectories:YES
+                                attributes:nil
+                                     error:nil]) {
+        return nil;
+    }
+
+    NSString *appVersion = [bundle objectForInfoDictionaryKey:@"CFBundleVersion"];
+    NSString *osVersion = [[NSProcessInfo processInfo] operatingSystemVersionString];
+    NSString *key = [NSString stringWithFormat:@"%@-%@-%@-%@", [device name], appVersion,
+                                               osVersion, defaultLibraryHash()];
+
+    // Keep the file name to letters, digits and dashes.
+    NSCharacterSet *invalid = [[NSCharacterSet alphanumericCharacterSet] invertedSet];
+    NSString *name = [[key componentsSeparatedByCharactersInSet:invalid] componentsJoinedByString:@"-"];
+
+    return [directory URLByAppendingPathComponent:[name stringByAppendingPathExtension:@"metallib"]];
+}
+
+/// Attaches the pipeline archive at url to each of descriptors. If there's
+/// no usable archive at url, an empty archive is attached, to be filled and
+/// saved by savePipelineArchive().
+API_AVAILABLE(macos(11.0))
+static void attachPipelineArchive(id<MTLDevice> device,
+                                  NSArray<MTLRenderPipelineDescriptor*> *descriptors,
+                                  NSURL *url) {
+    if (!url) {
+        return;
+    }
+
+    NSError *error = nil;
+    MTLBinaryArchiveDescriptor *desc = [[MTLBinaryArchiveDescriptor alloc] init];
+    id<MTLBinaryArchive> archive = nil;
+
+    if ([url checkResourceIsReachableAndReturnError:nil]) {
+        desc.url = url;
+        archive = [device newBinaryArchiveWithDescriptor:desc error:&error];
+
+        if (!archive) {
+            os_log_error(rpc, "Pipeline archive error: Load failed - Error=%@", error);
+            [[NSFileManager defaultManager] removeItemAtURL:url error:nil];
+        }
+    }
+
+    if (!archive) {
+        desc.url = nil;
+        archive = [device newBinaryArchiveWithDescriptor:desc error:&error];
+    }
+
+    if (!archive) {
+        return;
+    }
+
+    for (MTLRenderPipelineDescriptor *pipelineDesc in descriptors) {
+        pipelineDesc.binaryArchives = @[archive];
+    }
+}
+
+/// Adds descriptors' compiled functions to their attached archive, and saves
+/// it to url. Does nothing if the archive was loaded from url.
+API_AVAILABLE(macos(11.0))
+static void savePipelineArchive(NSArray<MTLRenderPipelineDescriptor*> *descriptors,
+                                NSURL *url) {
+    id<MTLBinaryArchive> archive = [[descriptors firstObject].binaryArchives firstObject];
+
+    if (!archive || [url checkResourceIsReachableAndReturnError:nil]) {
+        return;
+    }
+
+    NSError *error = nil;
+
+    for (MTLRenderPipelineDescriptor *desc in descriptors) {
+        if (![archive addRenderPipelineFunctionsWithDescriptor:desc error:&error]) {
+            os_log_error(rpc, "Pipeline archive error: Add failed - Error=%@", error);
+            return;
+        }
+    }
+
+    // Render contexts load concurrently, identical devices may save the same
+    // archive at once. Serialize to a unique file, then rename it into place.
+    NSString *temporaryName = [NSString stringWithFormat:@"%@.%@.tmp", [url lastPathComponent],
+                                                         [[NSUUID UUID] UUIDString]];
+
+    NSURL *temporaryURL = [[url URLByDeletingLastPathComponent]
+                            URLByAppendingPathComponent:temporaryName];
+
+    if (![archive serializeToURL:temporaryURL error:&error]) {
+        os_log_error(rpc, "Pipeline archive error: Save failed - Error=%@", error);
+        [[NSFileManager defaultManager] removeItemAtURL:temporaryURL error:nil];
+        return;
+    }
+
+    if (rename([temporaryURL fileSystemRepresentation], [url fileSystemRepresentation])) {
+        os_log_error(rpc, "Pipeline archive error: Rename failed - Error=%s", strerror(errno));
+        [[NSFileManager defaultManager] removeItemAtURL:temporaryURL error:nil];
+    }
+}
+
+/// Compiles render pipelines concurrently, and waits for them to finish.
+/// @returns The pipelines, in the same order as descriptors. On failure, error
+/// is set to the first error reported.
+static NSArray<id<MTLRenderPipelineState>>* newRenderPipelines(id<MTLDevice> device,
+                                                               NSArray<MTLRenderPipelineDescriptor*> *descriptors,
+                                                               NSError **error) {
+    NSMutableArray *pipelines = [NSMutableArray arrayWithCapacity:[descriptors count]];
+    dispatch_group_t group = dispatch_group_create();
+    __block NSError *pipelineError = nil;
+
+    for (NSUInteger i=0; i<[descriptors count]; ++i) {
+        [pipelines addObject:[NSNull null]];
+        dispatch_group_enter(group);
+
+        [device newRenderPipelineStateWithDescriptor:descriptors[i]
+                                   completionHandler:^(id<MTLRenderPipelineState> pipeline,
+                                                       NSError *compileError) {
+            @synchronized (pipelines) {
+                if (pipeline) {
+                    pipelines[i] = pipeline;
+                } else if (!pipelineError) {
+                    pipelineError = compileError;
+                }
+            }
+
+            dispatch_group_leave(group);
+        }];
+    }
+
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    *error = pipelineError;
+    return pipelines;
+}
+
+NSNotificationName const NVGlyphCacheEvictionDueNotification = @"NVGlyphCacheEvictionDueNotification";
+
+@interface NVRenderContext ()
+
+/// Glyph cache statistics for this render context's device.
+- (glyph_cache_stats)glyphCacheStats;
+
+@end
+
 @implementation NVRenderContext {
     glyph_manager glyphManager;
+    std::optional<glyph_rasterizer> prewarmRasterizer;
+    dispatch_queue_t prewarmQueue;
+    size_t rasterizerWidth;
+    size_t rasterizerHeight;
 }
 
 - (instancetype)initWithDevice:(id<MTLDevice>)device
                    fontManager:(font_manager *)fontManager
                 contextOptions:(NVRenderContextOptions *)options
-               glyphRasterizer:(glyph_rasterizer *)rasterizer
+              glyphRasterizers:(glyph_rasterizer_pool *)rasterizers
+                     glyphLock:(unfair_lock *)glyphLock
                          error:(NSError **)error {
     self = [super init];
     _device = device;
     _commandQueue = [device newCommandQueue];
     _fontManager = fontManager;
+    _glyphLock = glyphLock;
+    rasterizerWidth = options->rasterizerWidth;
+    rasterizerHeight = options->rasterizerHeight;
 
     id<MTLLibrary> lib = [device newDefaultLibrary];
 
@@ -50,44 +264,61 @@ static inline MTLRenderPipelineDescriptor* blendedPipelineDescriptor() {
     backgroundDesc.label = @"Grid background render pipeline";
     backgroundDesc.vertexFunction = [lib newFunctionWithName:@"background_render"];
     backgroundDesc.fragmentFunction = [lib newFunctionWithName:@"background_fill"];
-    _backgroundRenderPipeline = [device newRenderPipelineStateWithDescriptor:backgroundDesc error:error];
 
-    if (*error) return self;
-
-    MTLRenderPipelineDescriptor *glyphDesc = defaultPipelineDescriptor();
+    MTLRenderPipelineDescriptor *glyphDesc = premultipliedPipelineDescriptor();
     glyphDesc.label = @"Glyph render pipeline";
     glyphDesc.vertexFunction = [lib newFunctionWithName:@"glyph_render"];
     glyphDesc.fragmentFunction = [lib newFunctionWithName:@"glyph_fill"];
-    _glyphRenderPipeline = [device newRenderPipelineStateWithDescriptor:glyphDesc error:error];
-
-    if (*error) return self;
 
     MTLRenderPipelineDescriptor *cursorDesc = defaultPipelineDescriptor();
     cursorDesc.label = @"Cursor render pipeline";
     cursorDesc.vertexFunction = [lib newFunctionWithName:@"cursor_render"];
     cursorDesc.fragmentFunction = [lib newFunctionWithName:@"background_fill"];
-    _cursorRenderPipeline = [device newRenderPipelineStateWithDescriptor:cursorDesc error:error];
-
-    if (*error) return self;
 
     MTLRenderPipelineDescriptor *lineDesc = blendedPipelineDescriptor();
     lineDesc.label = @"Line render pipeline";
     lineDesc.vertexFunction = [lib newFunctionWithName:@"line_render"];
     lineDesc.fragmentFunction = [lib newFunctionWithName:@"line_fill"];
-    _lineRenderPipeline = [device newRenderPipelineStateWithDescriptor:lineDesc error:error];
+
+    NSArray<MTLRenderPipelineDescriptor*> *descriptors = @[
+        backgroundDesc, glyphDesc, cursorDesc, lineDesc
+    ];
+
+    NSURL *archiveURL = pipelineArchiveURL(device);
+
+    if (@available(macOS 11.0, *)) {
+        attachPipelineArchive(device, descriptors, archiveURL);
+    }
+
+    NSArray<id<MTLRenderPipelineState>> *pipelines = newRenderPipelines(device, descriptors, error);
 
     if (*error) return self;
 
+    if (@available(macOS 11.0, *)) {
+        savePipelineArchive(descriptors, archiveURL);
+    }
+
+    _backgroundRenderPipeline = pipelines[0];
+    _glyphRenderPipeline = pipelines[1];
+    _cursorRenderPipeline = pipelines[2];
+    _lineRenderPipeline = pipelines[3];
+
     glyph_texture_cache textureCache(_commandQueue,
                                      options->cachePageWidth,
                                      options->cachePageHeight,
                                      options->cacheInitialCapacity,
                                      options->cacheGrowthFactor);
 
-    glyphManager = glyph_manager(rasterizer,
+    // The budget is enforced in whole cache pages.
+    size_t pageBytes = textureCache.page_bytes();
+    size_t evictionThreshold = std::max(options->cacheMemoryBudget / pageBytes,
+                                        options->cacheEvictionPreserve + 1);
+
+    glyphManager = glyph_manager(rasterizers,
                                  std::move(textureCache),
-                                 options->cacheEvictionThreshold,
-                                 options->cacheEvictionPreserve);
+                                 evictionThreshold,
+                                 options->cacheEvictionPreserve,
+                                 options->glyphMasks);
 
     return self;
 }
@@ -96,6 +327,103 @@ static inline MTLRenderPipelineDescriptor* blendedPipelineDescriptor() {
     return &glyphManager;
 }
 
+- (glyph_cache_stats)glyphCacheStats {
+    std::lock_guard lock(*_glyphLock);
+    return glyphManager.stats();
+}
+
+/// A rasterized glyph waiting to be added to the glyph manager.
+struct prewarmed_glyph {
+    CTFontRef font;
+    nvim::grapheme_cluster text;
+    owned_glyph_bitmap bitmap;
+};
+
+/// Returns the UTF-8 encoding of a Latin-1 code point.
+static nvim::grapheme_cluster latin1Grapheme(unsigned char codepoint) {
+    nvim::grapheme_cluster text = {};
+
+    if (codepoint < 0x80) {
+        text[0] = codepoint;
+    } else {
+        text[0] = 0xC0 | (codepoint >> 6);
+        text[1] = 0x80 | (codepoint & 0x3F);
+    }
+
+    return text;
+}
+
+- (void)prewarmFont:(const font_family &)font {
+    if (!prewarmQueue) {
+        prewarmQueue = dispatch_queue_create("io.github.jaysandhu.neovim-mac.prewarm",
+                                             DISPATCH_QUEUE_SERIAL);
+    }
+
+    font_family family = font;
+
+    // The glyph lock is shared with every window's frames, so the main thread
+    // doesn't take it here. It's only held briefly on the prewarm queue.
+    dispatch_async(prewarmQueue, ^{
+        {
+            std::lock_guard lock(*self->_glyphLock);
+
+            if (!self->glyphManager.begin_prewarm(family)) {
+                return;
+            }
+        }
+
+        if (!self->prewarmRasterizer) {
+            self->prewarmRasterizer.emplace(self->rasterizerWidth, self->rasterizerHeight);
+        }
+
+        // Printable ASCII and Latin-1 characters. Spaces are empty cells,
+        // they're never rasterized.
+        std::vector<unsigned char> codepoints;
+
+        for (unsigned c = 0x21; c < 0x7F; ++c) codepoints.push_back(c);
+        for (unsigned c = 0xA0; c <= 0xFF; ++c) codepoints.push_back(c);
+
+        CTFontRef fonts[] = {
+            family.regular(), family.bold(), family.italic(), family.bold_italic()
+        };
+
+        std::vector<prewarmed_glyph> glyphs;
+        glyphs.reserve(std::size(fonts) * codepoints.size());
+
+        for (size_t i=0; i<std::size(fonts); ++i) {
+            // Families fall back to the regular font for missing variants.
+            if (std::find(fonts, fonts + i, fonts[i]) != fonts + i) {
+                continue;
+            }
+
+            for (unsigned char codepoint : codepoints) {
+                nvim::grapheme_cluster text = latin1Grapheme(codepoint);
+                std::string_view view(text.data(), strlen(text.data()));
+
+                prewarmed_glyph &glyph = glyphs.emplace_back();
+                glyph.font = fonts[i];
+                glyph.text = text;
+                glyph.bitmap.assign(self->prewarmRasterizer->rasterize_mask(fonts[i], view),
+                                    glyph_rasterizer::pixel_size);
+            }
+        }
+
+        // Glyphs are added in small batches, so frames drawn meanwhile only
+        // wait for one batch.
+        constexpr size_t batchSize = 64;
+
+        for (size_t begin=0; begin<glyphs.size(); begin += batchSize) {
+            size_t end = std::min(begin + batchSize, glyphs.size());
+            std::lock_guard lock(*self->_glyphLock);
+
+            for (size_t i=begin; i<end; ++i) {
+                const prewarmed_glyph &glyph = glyphs[i];
+                self->glyphManager.add(glyph.font, glyph.text, glyph.bitmap.bitmap);
+            }
+        }
+    });
+}
+
 @end
 
 @implementation NVRenderContextManager {
@@ -104,7 +432,16 @@ static inline MTLRenderPipelineDescriptor* blendedPipelineDescriptor() {
     id<NSObject> deviceObserver;
     NVRenderContextOptions contextOptions;
     font_manager fontManager;
-    glyph_rasterizer rasterizer;
+    glyph_rasterizer_pool rasterizers;
+    unfair_lock glyphLock;
+
+    // Render contexts are created on background threads. Until they're
+    // loaded, loadingDevices and loadedContexts hold the devices and their
+    // contexts, a null context if the device failed to initialize.
+    dispatch_group_t loadGroup;
+    NSArray<id<MTLDevice>> *loadingDevices;
+    std::vector<NVRenderContext*> loadedContexts;
+    BOOL loaded;
 }
 
 - (instancetype)initWithOptions:(NVRenderContextOptions)options
@@ -122,49 +459,121 @@ static inline MTLRenderPipelineDescriptor* blendedPipelineDescriptor() {
     });
 
     if (!devices || ![devices count]) {
+        loaded = YES;
         [delegate metalUnavailable];
         return self;
     }
 
-    NSMutableArray<NSString *> *uninitializedDevices = [NSMutableArray arrayWithCapacity:16];
     renderContexts = [NSMutableArray arrayWithCapacity:16];
-    rasterizer = glyph_rasterizer(options.rasterizerWidth, options.rasterizerHeight);
+    rasterizers = glyph_rasterizer_pool(options.rasterizerCount,
+                                        options.rasterizerWidth,
+                                        options.rasterizerHeight);
     contextOptions = options;
     deviceObserver = observer;
 
-    for (id<MTLDevice> device in devices) {
-        NSError *error = nil;
-        NVRenderContext *context = [[NVRenderContext alloc] initWithDevice:device
-                                                               fontManager:&fontManager
-                                                            contextOptions:&contextOptions
-                                                           glyphRasterizer:&rasterizer
-                                                                     error:&error];
+    // Compiling pipelines is slow. Create every device's render context
+    // concurrently, while the caller gets on with spawning Neovim and
+    // resolving fonts. The contexts are joined by the first caller that
+    // needs one, or on the main queue once they're ready.
+    loadGroup = dispatch_group_create();
+    loadingDevices = devices;
+    loadedContexts.resize([devices count]);
+
+    dispatch_queue_t queue = dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0);
+
+    for (NSUInteger i=0; i<[devices count]; ++i) {
+        dispatch_group_async(loadGroup, queue, ^{
+            NSError *error = nil;
+            NVRenderContext *context = [[NVRenderContext alloc] initWithDevice:devices[i]
+                                                                   fontManager:&self->fontManager
+                                                                contextOptions:&self->contextOptions
+                                                              glyphRasterizers:&self->rasterizers
+                                                                     glyphLock:&self->glyphLock
+                                                                         error:&error];
+
+            if (!error) {
+                self->loadedContexts[i] = context;
+            }
+        });
+    }
+
+    dispatch_group_notify(loadGroup, dispatch_get_main_queue(), ^{
+        [self finishLoading];
+    });
+
+    return self;
+}
+
+- (void)finishLoading {
+    if (loaded) {
+        return;
+    }
+
+    loaded = YES;
+    NSMutableArray<NSString *> *uninitializedDevices = [NSMutableArray arrayWithCapacity:16];
 
-        if (!error) {
-            [renderContexts addObject:context];
+    for (NSUInteger i=0; i<[loadingDevices count]; ++i) {
+        if (loadedContexts[i]) {
+            [renderContexts addObject:loadedContexts[i]];
         } else {
-            [uninitializedDevices addObject:[device name]];
+            [uninitializedDevices addObject:[loadingDevices[i] name]];
         }
     }
 
+    loadingDevices = nil;
+    loadedContexts.clear();
+
     if ([uninitializedDevices count]) {
-        [delegate metalDevicesFailedToInitalize:uninitializedDevices
-                                hasAlternatives:[renderContexts count] != 0];
+        [deviceDelegate metalDevicesFailedToInitalize:uninitializedDevices
+                                      hasAlternatives:[renderContexts count] != 0];
     }
+}
 
-    return self;
+- (void)waitUntilLoaded {
+    if (!loaded) {
+        dispatch_group_wait(loadGroup, DISPATCH_TIME_FOREVER);
+        [self finishLoading];
+    }
+}
+
+- (void)notifyWhenLoaded:(dispatch_block_t)handler {
+    if (loaded) {
+        return handler();
+    }
+
+    dispatch_group_notify(loadGroup, dispatch_get_main_queue(), ^{
+        [self finishLoading];
+        handler();
+    });
 }
 
 - (void)dealloc {
     MTLRemoveDeviceObserver(deviceObserver);
 }
 
+- (NSString*)glyphCacheReport {
+    [self waitUntilLoaded];
+    NSMutableString *report = [NSMutableString string];
+
+    for (NVRenderContext *context in renderContexts) {
+        glyph_cache_stats stats = [context glyphCacheStats];
+
+        [report appendFormat:@"%@: %zu/%zu pages, %.1f/%.1f MB, %zu glyphs, %zu windows, %llu evictions\n",
+                             context.device.name, stats.pages, stats.pages_capacity,
+                             stats.bytes / 1048576.0, stats.budget / 1048576.0,
+                             stats.glyphs, stats.clients, stats.evictions];
+    }
+
+    return report;
+}
+
 - (NVRenderContext*)addMetalDevice:(id<MTLDevice>)device {
     NSError *error = nil;
     NVRenderContext *context = [[NVRenderContext alloc] initWithDevice:device
                                                            fontManager:&fontManager
                                                         contextOptions:&contextOptions
-                                                       glyphRasterizer:&rasterizer
+                                                      glyphRasterizers:&rasterizers
+                                                             glyphLock:&glyphLock
                                                                  error:&error];
 
     if (error) {
@@ -177,6 +586,7 @@ static inline MTLRenderPipelineDescriptor* blendedPipelineDescriptor() {
 }
 
 - (void)removeMetalDevice:(id<MTLDevice>)device {
+    [self waitUntilLoaded];
     NSInteger contextIndex = [renderContexts indexOfObjectIdenticalTo:device];
 
     if (contextIndex != NSNotFound) {
@@ -189,6 +599,8 @@ static inline MTLRenderPipelineDescriptor* blendedPipelineDescriptor() {
 }
 
 - (nullable NVRenderContext*)renderContextForDevice:(id<MTLDevice>)device {
+    [self waitUntilLoaded];
+
     for (NVRenderContext *context in renderContexts) {
         if (context.device == device) {
             return context;
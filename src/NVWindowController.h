@@ -43,6 +43,13 @@ NS_ASSUME_NONNULL_BEGIN
 /// @returns Zero on success, otherwise an errno error code.
 - (int)connect:(NSString *)addr;
 
+/// Replay a capture file recorded with NVPreferencesCaptureDirectory set.
+/// Neovim's side of the captured session is replayed with its original timing,
+/// input is ignored. The window is displayed, and closes once the replay ends.
+/// @param path Path to the capture file.
+/// @returns Zero on success, otherwise an errno error code.
+- (int)replay:(NSString *)path;
+
 /// Spawn a new Neovim child process.
 /// If a child process is successfully created, the window is displayed.
 - (int)spawn;
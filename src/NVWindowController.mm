@@ -11,6 +11,8 @@
 #import "NVWindowController.h"
 #import "NVGridView.h"
 
+#include <os/signpost.h>
+#include <atomic>
 #include <thread>
 #include "log.h"
 #include "neovim.hpp"
@@ -62,6 +64,14 @@ static NSMutableArray<NVWindowController*> *neovimWindows = [[NSMutableArray all
     BOOL isOpen;
     BOOL isAlive;
     uint64_t isLiveResizing;
+
+    // Until the main thread handles a redraw, further flushes don't queue
+    // another one.
+    std::atomic<bool> redrawPending;
+
+    // Sends input held back by the process object once the run loop has
+    // handled every pending event.
+    CFRunLoopObserverRef inputObserver;
 }
 
 + (NSArray<NVWindowController*>*)windows {
@@ -104,12 +114,14 @@ static NSMutableArray<NVWindowController*> *neovimWindows = [[NSMutableArray all
     self = [super initWithWindow:window];
     nvim.set_controller((__bridge void*)self);
 
+    // With multigrid, windows are drawn to separate grids, so scrolling one
+    // window doesn't redraw the others. Opt in until it's seen more use.
     uiOptions = {
         .ext_cmdline    = false,
         .ext_hlstate    = false,
         .ext_linegrid   = true,
         .ext_messages   = false,
-        .ext_multigrid  = false,
+        .ext_multigrid  = (bool)[defaults boolForKey:@"NVPreferencesExtMultigrid"],
         .ext_popupmenu  = false,
         .ext_tabline    = false,
         .ext_termcolors = false
@@ -160,6 +172,10 @@ static NSMutableArray<NVWindowController*> *neovimWindows = [[NSMutableArray all
 
 - (void)dealloc {
     [[NSUserDefaults standardUserDefaults] removeObserver:self forKeyPath:@"NVPreferencesTitlebarAppearsTransparent"];
+    [self removeInputObserver];
+
+    // The render thread obtains grids from our process object.
+    [gridView stopDisplayLink];
 }
 
 - (void)windowWillClose:(NSNotification *)notification {
@@ -167,6 +183,12 @@ static NSMutableArray<NVWindowController*> *neovimWindows = [[NSMutableArray all
 }
 
 - (BOOL)windowShouldClose:(NSWindow *)sender {
+    // A replay closes its window once it ends, as if Neovim exited.
+    if (nvim.is_replaying()) {
+        nvim.stop_replay();
+        return NO;
+    }
+
     nvim.command("confirm quitall");
     return NO;
 }
@@ -182,6 +204,7 @@ static NSMutableArray<NVWindowController*> *neovimWindows = [[NSMutableArray all
 }
 
 - (void)shutdown {
+    [self removeInputObserver];
     [neovimWindows removeObjectIdenticalTo:self];
 }
 
@@ -255,32 +278,52 @@ static inline NSSize minGridViewSize(NSSize cellSize) {
     [self titleDidChange];
 }
 
-/// Returns a font descriptor and font size based on the guifont option.
-/// Reports errors to Neovim if the font is not found.
-/// @returns A font descriptor and a font size. If none of the fonts given by
-/// the guifont option exist, the font descriptor is NULL.
-static std::pair<arc_ptr<CTFontDescriptorRef>, CGFloat> getFontDescriptor(nvim::process &nvim) {
-    CGFloat defaultSize = [NSFont systemFontSize];
-    std::string guifont = nvim.get_guifont();
+/// A font descriptor and font size matching the guifont option.
+struct guifont_match {
+    arc_ptr<CTFontDescriptorRef> descriptor;
+    CGFloat size;
+    bool invalid;
+};
+
+/// Matches the fonts given by guifont. Safe to call from any thread.
+/// @returns The first matching font. If none of the fonts exist, the font
+/// descriptor is NULL, and invalid is true if guifont named any fonts.
+static guifont_match matchGuifont(const std::string &guifont, CGFloat defaultSize) {
     std::vector<nvim::font> fonts = nvim::parse_guifont(guifont, defaultSize);
 
     for (auto [name, size] : fonts) {
         arc_ptr descriptor = font_manager::make_descriptor(name);
 
         if (descriptor) {
-            return {descriptor, size};
+            return {descriptor, size, false};
         }
     }
 
-    if (fonts.size()) {
-        std::string error;
-        error.reserve(512);
-        error.append("Error: Invalid font(s): guifont=");
-        error.append(guifont);
-        nvim.error_writeln(error);
+    return {{}, defaultSize, fonts.size() != 0};
+}
+
+/// Reports an invalid guifont option to Neovim.
+static void reportInvalidGuifont(nvim::process &nvim, const std::string &guifont) {
+    std::string error;
+    error.reserve(512);
+    error.append("Error: Invalid font(s): guifont=");
+    error.append(guifont);
+    nvim.error_writeln(error);
+}
+
+/// Returns a font descriptor and font size based on the guifont option.
+/// Reports errors to Neovim if the font is not found.
+/// @returns A font descriptor and a font size. If none of the fonts given by
+/// the guifont option exist, the font descriptor is NULL.
+static std::pair<arc_ptr<CTFontDescriptorRef>, CGFloat> getFontDescriptor(nvim::process &nvim) {
+    std::string guifont = nvim.get_guifont();
+    guifont_match match = matchGuifont(guifont, [NSFont systemFontSize]);
+
+    if (match.invalid) {
+        reportInvalidGuifont(nvim, guifont);
     }
 
-    return {{}, defaultSize};
+    return {match.descriptor, match.size};
 }
 
 - (void)handleScreenChanges:(NSNotification *)notification {
@@ -319,6 +362,19 @@ static std::pair<arc_ptr<CTFontDescriptorRef>, CGFloat> getFontDescriptor(nvim::
     NSScreen *proposedScreen = [window screen];
     CGFloat scaleFactor = 1;
 
+    // Matching fonts with CoreText is slow, and so is compiling the render
+    // context's pipelines, which may still be in progress. Match guifont on
+    // a background queue while we get the render context, then join.
+    std::string guifont = nvim.get_guifont();
+    CGFloat defaultSize = [NSFont systemFontSize];
+    guifont_match match = {};
+    guifont_match *matchPtr = &match;
+
+    dispatch_group_t fontGroup = dispatch_group_create();
+    dispatch_group_async(fontGroup, dispatch_get_global_queue(QOS_CLASS_USER_INTERACTIVE, 0), ^{
+        *matchPtr = matchGuifont(guifont, defaultSize);
+    });
+
     if (proposedScreen) {
         scaleFactor = [proposedScreen backingScaleFactor];
         renderContext = [contextManager renderContextForScreen:proposedScreen];
@@ -335,16 +391,28 @@ static std::pair<arc_ptr<CTFontDescriptorRef>, CGFloat> getFontDescriptor(nvim::
     }
 
     const nvim::grid *grid = nvim.get_global_grid();
-    auto [fontDescriptor, fontSize] = getFontDescriptor(nvim);
+    dispatch_group_wait(fontGroup, DISPATCH_TIME_FOREVER);
+
+    if (match.invalid) {
+        reportInvalidGuifont(nvim, guifont);
+    }
 
-    if (!fontDescriptor) {
-        fontDescriptor = font_manager::default_descriptor();
+    if (!match.descriptor) {
+        match.descriptor = font_manager::default_descriptor();
     }
 
     gridView = [[NVGridView alloc] init];
-    gridView.font = fontManager->get(fontDescriptor.get(), fontSize, scaleFactor);
+    gridView.latencyTracker = nvim.latency();
+    gridView.frameStats = nvim.stats();
+    gridView.font = fontManager->get(match.descriptor.get(), match.size, scaleFactor);
     gridView.grid = grid;
 
+    os_signpost_id_t firstFrame = [self firstFrameSignpost];
+
+    gridView.firstFrameHandler = ^{
+        os_signpost_interval_end(rpc, firstFrame, "FirstFrame");
+    };
+
     lastGridSize = grid->size();
     NSSize cellSize = gridView.cellSize;
 
@@ -369,6 +437,21 @@ static std::pair<arc_ptr<CTFontDescriptorRef>, CGFloat> getFontDescriptor(nvim::
         [self handleScreenChanges:nil];
     }
 
+    // From here on, frames are drawn at most once per display refresh, no
+    // matter how often Neovim flushes. Optionally encode and present frames on
+    // the display link thread, so input handling on the main thread doesn't
+    // wait on rendering. The grid view is now the only client of
+    // get_global_grid().
+    nvim::process *process = &nvim;
+    __weak NVWindowController *weakSelf = self;
+    BOOL renderThread = [[NSUserDefaults standardUserDefaults] boolForKey:@"NVPreferencesRenderThread"];
+
+    [gridView scheduleFramesWithGridProvider:^{
+        return process->get_global_grid();
+    } gridSizeHandler:^(nvim::grid_size gridSize) {
+        [weakSelf gridSizeDidChange:gridSize];
+    } renderThread:renderThread];
+
     // This notification is posted when the system display settings change.
     // It is also posted when the device driving a display changes, for example,
     // when a system switches between integrated and discrete graphics. In both
@@ -385,12 +468,20 @@ static std::pair<arc_ptr<CTFontDescriptorRef>, CGFloat> getFontDescriptor(nvim::
     [self optionsDidChange];
 }
 
-- (void)redraw {
-    const nvim::grid *grid = nvim.get_global_grid();
-    nvim::grid_size gridSize = grid->size();
+- (NSString*)glyphCacheReport {
+    return [contextManager glyphCacheReport];
+}
 
-    [gridView setGrid:grid];
+- (BOOL)shouldScheduleRedraw {
+    return !redrawPending.exchange(true);
+}
 
+- (void)redraw {
+    redrawPending = false;
+    [gridView setNeedsGrid];
+}
+
+- (void)gridSizeDidChange:(nvim::grid_size)gridSize {
     if (gridSize != lastGridSize) {
         lastGridSize = gridSize;
 
@@ -407,10 +498,89 @@ static std::pair<arc_ptr<CTFontDescriptorRef>, CGFloat> getFontDescriptor(nvim::
     [neovimWindows addObject:self];
     isAlive = YES;
 
+    [self addInputObserver];
     [self initialRedraw];
 }
 
+// Mouse drags and scroll wheel events arrive much faster than Neovim can
+// handle them. The process object merges them, and we send whatever is left
+// just before the run loop goes to sleep, in a single write.
+- (void)addInputObserver {
+    if (inputObserver) {
+        return;
+    }
+
+    __weak NVWindowController *weakSelf = self;
+
+    inputObserver = CFRunLoopObserverCreateWithHandler(kCFAllocatorDefault,
+                                                       kCFRunLoopBeforeWaiting,
+                                                       true, 0, ^(CFRunLoopObserverRef, CFRunLoopActivity) {
+        NVWindowController *strongSelf = weakSelf;
+
+        if (strongSelf) {
+            strongSelf->nvim.flush_input();
+        }
+    });
+
+    CFRunLoopAddObserver(CFRunLoopGetMain(), inputObserver, kCFRunLoopCommonModes);
+}
+
+- (void)removeInputObserver {
+    if (!inputObserver) {
+        return;
+    }
+
+    CFRunLoopObserverInvalidate(inputObserver);
+    CFRelease(inputObserver);
+    inputObserver = nullptr;
+}
+
+// If NVPreferencesCaptureDirectory is set, every session's RPC traffic is
+// recorded to a new capture file in that directory. Capture files can be
+// replayed with -[replay:], or used as benchmark inputs.
+- (void)startCapture {
+    NSString *directory = [[NSUserDefaults standardUserDefaults] stringForKey:@"NVPreferencesCaptureDirectory"];
+
+    if (!directory) {
+        return;
+    }
+
+    NSDateFormatter *formatter = [[NSDateFormatter alloc] init];
+    formatter.dateFormat = @"yyyy-MM-dd-HHmmss";
+
+    NSString *name = [NSString stringWithFormat:@"neovim-%@-%p.nvcap",
+                      [formatter stringFromDate:[NSDate date]], self];
+
+    NSString *path = [[directory stringByExpandingTildeInPath] stringByAppendingPathComponent:name];
+
+    if (int error = nvim.record([path fileSystemRepresentation])) {
+        os_log_error(rpc, "Capture error: %i: %s\n", error, strerror(error));
+    }
+}
+
+// The FirstFrame signpost interval runs from starting a Neovim session to the
+// window's first presented frame. Spawning Neovim, compiling pipelines, and
+// matching fonts all happen concurrently within it.
+- (os_signpost_id_t)firstFrameSignpost {
+    return os_signpost_id_make_with_pointer(rpc, (__bridge void*)self);
+}
+
+- (int)replay:(NSString *)path {
+    os_signpost_interval_begin(rpc, [self firstFrameSignpost], "FirstFrame");
+    int error = nvim.replay([[path stringByExpandingTildeInPath] fileSystemRepresentation]);
+
+    if (error) {
+        os_log_error(rpc, "Replay error: %i: %s\n", error, strerror(error));
+        return error;
+    }
+
+    [self attach];
+    return 0;
+}
+
 - (int)connect:(NSString *)addr {
+    os_signpost_interval_begin(rpc, [self firstFrameSignpost], "FirstFrame");
+    [self startCapture];
     int error = nvim.connect([addr UTF8String]);
 
     if (error) {
@@ -429,6 +599,8 @@ static std::pair<arc_ptr<CTFontDescriptorRef>, CGFloat> getFontDescriptor(nvim::
     const char *workingDir = [directory UTF8String];
     const char *path = [nvimExecutable UTF8String];
 
+    os_signpost_interval_begin(rpc, [self firstFrameSignpost], "FirstFrame");
+    [self startCapture];
     int error = nvim.spawn(path, argv, (const char**)environ, workingDir);
 
     if (error) {
@@ -639,12 +811,13 @@ public:
     }
 };
 
-static void namedKeyDown(nvim::process &nvim, NSEventModifierFlags flags, std::string_view keyname) {
+static void namedKeyDown(nvim::process &nvim, NSEventModifierFlags flags,
+                         std::string_view keyname, uint64_t time) {
     if (!(flags & (NSEventModifierFlagShift   |
                    NSEventModifierFlagCommand |
                    NSEventModifierFlagControl |
                    NSEventModifierFlagOption))) {
-        nvim.input(keyname);
+        nvim.input(keyname, time);
         return;
     }
 
@@ -655,10 +828,11 @@ static void namedKeyDown(nvim::process &nvim, NSEventModifierFlags flags, std::s
     memcmp(inputbuff + 1 + modifiers.size(), keyname.data() + 1, keyname.size() - 1);
 
     size_t inputsize = modifiers.size() + keyname.size() - 1;
-    nvim.input(std::string_view(inputbuff, inputsize));
+    nvim.input(std::string_view(inputbuff, inputsize), time);
 }
 
-static void keyDownIgnoreModifiers(nvim::process &nvim, NSEventModifierFlags flags, NSEvent *event) {
+static void keyDownIgnoreModifiers(nvim::process &nvim, NSEventModifierFlags flags,
+                                   NSEvent *event, uint64_t time) {
     NSString *nscharacters = [event charactersIgnoringModifiers];
     const char *characters = [nscharacters UTF8String];
     NSUInteger charlength = [nscharacters lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
@@ -668,14 +842,14 @@ static void keyDownIgnoreModifiers(nvim::process &nvim, NSEventModifierFlags fla
     }
 
     if (charlength == 1 && *characters == '<') {
-        namedKeyDown(nvim, flags & ~NSEventModifierFlagShift, "<lt>");
+        namedKeyDown(nvim, flags & ~NSEventModifierFlagShift, "<lt>", time);
         return;
     }
 
     input_modifiers modifiers = input_modifiers(flags & ~NSEventModifierFlagShift);
 
     if (modifiers.size() == 0) {
-        nvim.input(std::string_view(characters, charlength));
+        nvim.input(std::string_view(characters, charlength), time);
         return;
     }
 
@@ -688,7 +862,7 @@ static void keyDownIgnoreModifiers(nvim::process &nvim, NSEventModifierFlags fla
         memcpy(inputbuff + 1 + modifiers.size(), characters, charlength);
         inputbuff[inputsize - 1] = '>';
 
-        nvim.input(std::string_view(inputbuff, inputsize));
+        nvim.input(std::string_view(inputbuff, inputsize), time);
         return;
     }
 
@@ -699,55 +873,67 @@ static void keyDownIgnoreModifiers(nvim::process &nvim, NSEventModifierFlags fla
     input.append(characters, charlength);
     input.push_back('>');
 
-    nvim.input(input);
+    nvim.input(input, time);
 }
 
 - (void)keyDown:(NSEvent *)event {
+    os_signpost_interval_begin(rpc, OS_SIGNPOST_ID_EXCLUSIVE, "KeyDown");
+
+    [self handleKeyDown:event];
+
+    os_signpost_interval_end(rpc, OS_SIGNPOST_ID_EXCLUSIVE, "KeyDown");
+}
+
+- (void)handleKeyDown:(NSEvent *)event {
     unsigned short code = [event keyCode];
     NSEventModifierFlags flags = [event modifierFlags];
 
+    // Event timestamps share a time base with latency_tracker::now(). Only
+    // input sent for this key press is attributed to it.
+    uint64_t time = [event timestamp] * NSEC_PER_SEC;
+
     // TODO: The 'mousehide' Vim option is currently not implemented in nvim. Ideally, we would first check if 'mousehide' is set and if so, hide the mouse. Until nvim implements 'mousehide', we will just hide the mouse since that is the default setting for 'mousehide' anyway.
     [NSCursor setHiddenUntilMouseMoves:YES];
 
     switch (code) {
-        case kVK_Return:        return namedKeyDown(nvim, flags, "<CR>");
-        case kVK_Tab:           return namedKeyDown(nvim, flags, "<Tab>");
-        case kVK_Space:         return namedKeyDown(nvim, flags, "<Space>");
-        case kVK_Delete:        return namedKeyDown(nvim, flags, "<BS>");
-        case kVK_ForwardDelete: return namedKeyDown(nvim, flags, "<Del>");
-        case kVK_Escape:        return namedKeyDown(nvim, flags, "<Esc>");
-        case kVK_LeftArrow:     return namedKeyDown(nvim, flags, "<Left>");
-        case kVK_RightArrow:    return namedKeyDown(nvim, flags, "<Right>");
-        case kVK_DownArrow:     return namedKeyDown(nvim, flags, "<Down>");
-        case kVK_UpArrow:       return namedKeyDown(nvim, flags, "<Up>");
-        case kVK_VolumeUp:      return namedKeyDown(nvim, flags, "<VolumeUp>");
-        case kVK_VolumeDown:    return namedKeyDown(nvim, flags, "<VolumeDown>");
-        case kVK_Mute:          return namedKeyDown(nvim, flags, "<Mute>");
-        case kVK_Help:          return namedKeyDown(nvim, flags, "<Help>");
-        case kVK_Home:          return namedKeyDown(nvim, flags, "<Home>");
-        case kVK_End:           return namedKeyDown(nvim, flags, "<End>");
-        case kVK_PageUp:        return namedKeyDown(nvim, flags, "<PageUp>");
-        case kVK_PageDown:      return namedKeyDown(nvim, flags, "<PageDown>");
-        case kVK_F1:            return namedKeyDown(nvim, flags, "<F1>");
-        case kVK_F2:            return namedKeyDown(nvim, flags, "<F2>");
-        case kVK_F3:            return namedKeyDown(nvim, flags, "<F3>");
-        case kVK_F4:            return namedKeyDown(nvim, flags, "<F4>");
-        case kVK_F5:            return namedKeyDown(nvim, flags, "<F5>");
-        case kVK_F6:            return namedKeyDown(nvim, flags, "<F6>");
-        case kVK_F7:            return namedKeyDown(nvim, flags, "<F7>");
-        case kVK_F8:            return namedKeyDown(nvim, flags, "<F8>");
-        case kVK_F9:            return namedKeyDown(nvim, flags, "<F9>");
-        case kVK_F10:           return namedKeyDown(nvim, flags, "<F10>");
-        case kVK_F11:           return namedKeyDown(nvim, flags, "<F11>");
-        case kVK_F12:           return namedKeyDown(nvim, flags, "<F12>");
-        case kVK_F13:           return namedKeyDown(nvim, flags, "<F13>");
-        case kVK_F14:           return namedKeyDown(nvim, flags, "<F14>");
-        case kVK_F15:           return namedKeyDown(nvim, flags, "<F15>");
-        case kVK_F16:           return namedKeyDown(nvim, flags, "<F16>");
-        case kVK_F17:           return namedKeyDown(nvim, flags, "<F17>");
-        case kVK_F18:           return namedKeyDown(nvim, flags, "<F18>");
-        case kVK_F19:           return namedKeyDown(nvim, flags, "<F19>");
-        case kVK_F20:           return namedKeyDown(nvim, flags, "<F20>");
+        case kVK_Return:        return namedKeyDown(nvim, flags, "<CR>", time);
+        case kVK_Tab:           return namedKeyDown(nvim, flags, "<Tab>", time);
+        case kVK_Space:         return namedKeyDown(nvim, flags, "<Space>", time);
+        case kVK_Delete:        return namedKeyDown(nvim, flags, "<BS>", time);
+        case kVK_ForwardDelete: return namedKeyDown(nvim, flags, "<Del>", time);
+        case kVK_Escape:        return namedKeyDown(nvim, flags, "<Esc>", time);
+        case kVK_LeftArrow:     return namedKeyDown(nvim, flags, "<Left>", time);
+        case kVK_RightArrow:    return namedKeyDown(nvim, flags, "<Right>", time);
+        case kVK_DownArrow:     return namedKeyDown(nvim, flags, "<Down>", time);
+        case kVK_UpArrow:       return namedKeyDown(nvim, flags, "<Up>", time);
+        case kVK_VolumeUp:      return namedKeyDown(nvim, flags, "<VolumeUp>", time);
+        case kVK_VolumeDown:    return namedKeyDown(nvim, flags, "<VolumeDown>", time);
+        case kVK_Mute:          return namedKeyDown(nvim, flags, "<Mute>", time);
+        case kVK_Help:          return namedKeyDown(nvim, flags, "<Help>", time);
+        case kVK_Home:          return namedKeyDown(nvim, flags, "<Home>", time);
+        case kVK_End:           return namedKeyDown(nvim, flags, "<End>", time);
+        case kVK_PageUp:        return namedKeyDown(nvim, flags, "<PageUp>", time);
+        case kVK_PageDown:      return namedKeyDown(nvim, flags, "<PageDown>", time);
+        case kVK_F1:            return namedKeyDown(nvim, flags, "<F1>", time);
+        case kVK_F2:            return namedKeyDown(nvim, flags, "<F2>", time);
+        case kVK_F3:            return namedKeyDown(nvim, flags, "<F3>", time);
+        case kVK_F4:            return namedKeyDown(nvim, flags, "<F4>", time);
+        case kVK_F5:            return namedKeyDown(nvim, flags, "<F5>", time);
+        case kVK_F6:            return namedKeyDown(nvim, flags, "<F6>", time);
+        case kVK_F7:            return namedKeyDown(nvim, flags, "<F7>", time);
+        case kVK_F8:            return namedKeyDown(nvim, flags, "<F8>", time);
+        case kVK_F9:            return namedKeyDown(nvim, flags, "<F9>", time);
+        case kVK_F10:           return namedKeyDown(nvim, flags, "<F10>", time);
+        case kVK_F11:           return namedKeyDown(nvim, flags, "<F11>", time);
+        case kVK_F12:           return namedKeyDown(nvim, flags, "<F12>", time);
+        case kVK_F13:           return namedKeyDown(nvim, flags, "<F13>", time);
+        case kVK_F14:           return namedKeyDown(nvim, flags, "<F14>", time);
+        case kVK_F15:           return namedKeyDown(nvim, flags, "<F15>", time);
+        case kVK_F16:           return namedKeyDown(nvim, flags, "<F16>", time);
+        case kVK_F17:           return namedKeyDown(nvim, flags, "<F17>", time);
+        case kVK_F18:           return namedKeyDown(nvim, flags, "<F18>", time);
+        case kVK_F19:           return namedKeyDown(nvim, flags, "<F19>", time);
+        case kVK_F20:           return namedKeyDown(nvim, flags, "<F20>", time);
     }
 
     NSString *characters = [event characters];
@@ -755,16 +941,16 @@ static void keyDownIgnoreModifiers(nvim::process &nvim, NSEventModifierFlags fla
     bool cmdOrCtrl = flags & (NSEventModifierFlagCommand | NSEventModifierFlagControl);
 
     if (!length || cmdOrCtrl) {
-        keyDownIgnoreModifiers(nvim, flags, event);
+        keyDownIgnoreModifiers(nvim, flags, event, time);
         return;
     }
 
     std::string input([characters UTF8String], length);
 
     if (input == "<") {
-        namedKeyDown(nvim, flags & ~NSEventModifierFlagShift, "<lt>");
+        namedKeyDown(nvim, flags & ~NSEventModifierFlagShift, "<lt>", time);
     } else {
-        nvim.input(input);
+        nvim.input(input, time);
     }
 }
 
@@ -855,6 +1041,7 @@ static inline bool pointInGrid(nvim::grid_point point, nvim::grid_size size) {
     [self mouseUp:event button:MouseButtonOther];
 }
 
+// Each step is merged into a single pending wheel event by the process object.
 static void scrollEvent(nvim::process &nvim, size_t count, std::string_view direction,
                         std::string_view modifiers, nvim::grid_point location) {
     for (size_t i=0; i<count; ++i) {
@@ -1407,6 +1594,10 @@ void window_controller::shutdown() {
 }
 
 void window_controller::redraw() {
+    if (![(__bridge NVWindowController*)controller shouldScheduleRedraw]) {
+        return;
+    }
+
     dispatch_async_f(dispatch_get_main_queue(), controller, [](void *context) {
         [(__bridge NVWindowController*)context redraw];
     });
@@ -1436,4 +1627,12 @@ void window_controller::default_background_color_set() {
     });
 }
 
+void window_controller::glyph_cache_report(std::function<void(std::string_view)> handler) {
+    NVWindowController *windowController = (__bridge NVWindowController*)controller;
+
+    dispatch_async(dispatch_get_main_queue(), ^{
+        handler([[windowController glyphCacheReport] UTF8String]);
+    });
+}
+
 } // namespace nvim
@@ -31,21 +31,43 @@
 // If the current backing buffer is exhausted, we add it to a list of used
 // buffers and replace it with a new larger buffer.
 //
-// On deallocation, all used buffers are freed and the tracking pointer is
-// reset to the end of the current backing buffer.
+// On deallocation, used buffers are moved to a small list of free buffers,
+// which are reused before we malloc new ones. If the allocations didn't fit
+// in the current backing buffer, it's replaced with one large enough to hold
+// them all, so steady state workloads never exhaust the backing buffer. The
+// tracking pointer is then reset to the end of the current backing buffer.
 //
 // If AddressSanitizer is enabled we poison and unpoison memory as needed. We
 // also guard each allocation with a small poisoned memory region.
 
+/// Bump allocator statistics.
+struct bump_allocator_stats {
+    size_t peak_bytes; ///< The most bytes allocated between two dealloc_all calls.
+    size_t chunks;     ///< The number of backing buffers currently owned.
+    size_t mallocs;    ///< The total number of backing buffers malloced.
+};
+
 class bump_allocator {
 private:
+    // Each backing buffer starts with a header, allowing us to chain buffers
+    // into intrusive singly linked lists.
+    struct buffer_header {
+        buffer_header *next;
+        size_t size;
+    };
+
     char *start;
     char *end;
     char *ptr;
-    void **used_buffers;
+    buffer_header *used_buffers;
+    buffer_header *free_buffers;
+    size_t free_count;
+    size_t used_bytes;
+    bump_allocator_stats statistics;
 
     static constexpr size_t alignment = 8;
-    static constexpr size_t header_size = sizeof(void*);
+    static constexpr size_t header_size = sizeof(buffer_header);
+    static constexpr size_t max_free_buffers = 4;
 #if __has_feature(address_sanitizer)
     static constexpr size_t guard_size = 8;
 #else
@@ -60,56 +82,99 @@ private:
         return (val + alignment - 1) & -alignment;
     }
 
-    // Used buffers are stored as an intrusive singly linked list.
-    // The pointer to the next buffer is stored at the start of each buffer.
-    void push_used_buffer(void *buffer) {
-        if (buffer) {
-            void **tmp = used_buffers;
-            used_buffers = static_cast<void**>(buffer);
-            // store the old value at the start of used_buffers
-            *used_buffers = tmp;
-        }
+    static buffer_header* pop_buffer(buffer_header *&list) {
+        buffer_header *buffer = list;
+        list = buffer->next;
+        return buffer;
     }
 
-    void* pop_used_buffer() {
-        void *buffer = used_buffers;
-        // Read the next value from the start of used_buffers.
-        used_buffers = static_cast<void**>(*used_buffers);
+    // Returns a buffer at least size bytes long, including the header.
+    // Reuses the first large enough free buffer, otherwise mallocs one.
+    buffer_header* acquire_buffer(size_t size) {
+        assert(size >= header_size && size % alignment == 0);
+
+        for (buffer_header **link = &free_buffers; *link; link = &(*link)->next) {
+            if ((*link)->size >= size) {
+                free_count -= 1;
+                return pop_buffer(*link);
+            }
+        }
+
+        buffer_header *buffer = static_cast<buffer_header*>(::malloc(size));
+        buffer->size = size;
+
+        statistics.chunks += 1;
+        statistics.mallocs += 1;
         return buffer;
     }
 
-    void new_backing_buffer(size_t size) {
-        assert(size >= header_size && size % alignment == 0);
+    // Adds buffer to the free list. If the free list is full, the smallest
+    // free buffer is freed.
+    void release_buffer(buffer_header *buffer) {
+        char *bytes = reinterpret_cast<char*>(buffer);
+        ASAN_POISON_MEMORY_REGION(bytes + header_size, buffer->size - header_size);
+
+        buffer->next = free_buffers;
+        free_buffers = buffer;
+        free_count += 1;
+
+        if (free_count <= max_free_buffers) {
+            return;
+        }
+
+        buffer_header **smallest = &free_buffers;
+
+        for (buffer_header **link = &free_buffers; *link; link = &(*link)->next) {
+            if ((*link)->size < (*smallest)->size) {
+                smallest = link;
+            }
+        }
+
+        ::free(pop_buffer(*smallest));
+        free_count -= 1;
+        statistics.chunks -= 1;
+    }
 
-        char *buffer = static_cast<char*>(::malloc(size));
-        // We reserve some space so we can chain buffers into a list
-        start = buffer + header_size;
-        end = buffer + size;
+    void set_backing_buffer(buffer_header *buffer) {
+        char *bytes = reinterpret_cast<char*>(buffer);
+        start = bytes + header_size;
+        end = bytes + buffer->size;
         ptr = end;
 
-        ASAN_POISON_MEMORY_REGION(start, size - header_size);
+        ASAN_POISON_MEMORY_REGION(start, end - start);
     }
 
-    char* backing_buffer() const {
+    void new_backing_buffer(size_t size) {
+        set_backing_buffer(acquire_buffer(size));
+    }
+
+    buffer_header* backing_buffer() const {
         if (start) {
-            // The actual malloced pointer is behind our bookkeeping region
-            return start - header_size;
+            // The actual buffer is behind our bookkeeping region
+            return reinterpret_cast<buffer_header*>(start - header_size);
         } else {
             return nullptr;
         }
     }
 
-    NOINLINE void* alloc_with_new_backing(size_t size) {
-        char *oldbuff = backing_buffer();
+    // Moves the current backing buffer to the used list.
+    void push_used_buffer() {
+        if (buffer_header *buffer = backing_buffer()) {
+            used_bytes += end - ptr;
+            buffer->next = used_buffers;
+            used_buffers = buffer;
+        }
+    }
 
-        size_t oldsize = static_cast<size_t>(end - oldbuff);
-        size_t newsize = std::max(oldsize * 2, align_up(size) * 2);
+    NOINLINE void* alloc_with_new_backing(size_t size) {
+        size_t oldsize = capacity();
+        size_t newsize = std::max(oldsize * 2, align_up(size) * 2 + header_size);
 
         if (UNLIKELY(newsize < oldsize)) {
             std::abort(); // abort on overflow
         }
 
-        push_used_buffer(oldbuff);
+        push_used_buffer();
         new_backing_buffer(newsize);
 
         ptr = (char*)align_down((uintptr_t)end - size);
@@ -128,61 +193,76 @@ private:
         return ptr;
     }
 
+    void free_all() {
+        ::free(backing_buffer());
+
+        while (used_buffers) {
+            ::free(pop_buffer(used_buffers));
+        }
+
+        while (free_buffers) {
+            ::free(pop_buffer(free_buffers));
+        }
+    }
+
+    void take(bump_allocator &other) {
+        start = other.start;
+        end = other.end;
+        ptr = other.ptr;
+        used_buffers = other.used_buffers;
+        free_buffers = other.free_buffers;
+        free_count = other.free_count;
+        used_bytes = other.used_bytes;
+        statistics = other.statistics;
+
+        other.start = nullptr;
+        other.end = nullptr;
+        other.ptr = nullptr;
+        other.used_buffers = nullptr;
+        other.free_buffers = nullptr;
+        other.free_count = 0;
+        other.used_bytes = 0;
+        other.statistics = {};
+    }
+
 public:
     bump_allocator() {
         start = nullptr;
         end = nullptr;
         ptr = nullptr;
         used_buffers = nullptr;
+        free_buffers = nullptr;
+        free_count = 0;
+        used_bytes = 0;
+        statistics = {};
     }
 
     /// Construct a new allocator with the given capacity
     /// Note: some space is used for internal bookkeeping
-    explicit bump_allocator(size_t init_capacity) {
-        new_backing_buffer(align_up(init_capacity));
-        used_buffers = nullptr;
+    explicit bump_allocator(size_t init_capacity): bump_allocator() {
+        new_backing_buffer(align_up(std::max(init_capacity, header_size)));
     }
 
     bump_allocator(const bump_allocator&) = delete;
     bump_allocator& operator=(const bump_allocator&) = delete;
 
     bump_allocator(bump_allocator &&other) {
-        start = other.start;
-        end = other.end;
-        ptr = other.ptr;
-        used_buffers = other.used_buffers;
-
-        other.start = nullptr;
-        other.end = nullptr;
-        other.ptr = nullptr;
-        other.used_buffers = nullptr;
+        take(other);
     }
 
     bump_allocator& operator=(bump_allocator &&other) {
-        ::free(backing_buffer());
-        dealloc_all();
-
-        start = other.start;
-        end = other.end;
-        ptr = other.ptr;
-        used_buffers = other.used_buffers;
-
-        other.start = nullptr;
-        other.end = nullptr;
-        other.ptr = nullptr;
-        other.used_buffers = nullptr;
-
+        free_all();
+        take(other);
         return *this;
     }
 
     ~bump_allocator() {
-        ::free(backing_buffer());
-        dealloc_all();
+        free_all();
     }
 
     /// The capacity of the current backing buffer
     size_t capacity() const {
-        return end - backing_buffer();
+        return end - reinterpret_cast<char*>(backing_buffer());
     }
 
     /// The amount of space remaining in the current backing buffer
@@ -190,10 +270,15 @@ public:
         return ptr - start;
     }
 
+    /// Allocation statistics.
+    bump_allocator_stats stats() const {
+        return statistics;
+    }
+
     /// Ensures that at least size bytes can be allocated without reallocation
     void reserve(size_t size) {
         if (size > remaining()) {
-            push_used_buffer(backing_buffer());
+            push_used_buffer();
             new_backing_buffer(align_up(size) + header_size);
         }
     }
@@ -208,12 +293,32 @@ public:
 
     /// Deallocates all current allocations
     void dealloc_all() {
+        size_t total = used_bytes + (end - ptr);
+        statistics.peak_bytes = std::max(statistics.peak_bytes, total);
+        used_bytes = 0;
+
+        if (!used_buffers) {
+            ptr = end;
+            ASAN_POISON_MEMORY_REGION(start, end - start);
+            return;
+        }
+
         while (used_buffers) {
-            ::free(pop_used_buffer());
+            release_buffer(pop_buffer(used_buffers));
         }
 
-        ptr = end;
-        ASAN_POISON_MEMORY_REGION(start, end - start);
+        // The allocations didn't fit in one backing buffer. Retain a buffer
+        // that can hold them all, so the next cycle doesn't have to chain.
+        size_t size = align_up(total) + header_size;
+
+        if (size > capacity()) {
+            buffer_header *current = backing_buffer();
+            new_backing_buffer(size);
+            release_buffer(current);
+        } else {
+            ptr = end;
+            ASAN_POISON_MEMORY_REGION(start, end - start);
+        }
     }
 };
 
@@ -0,0 +1,231 @@
+//
+//  Neovim Mac
+//  capture.cpp
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <mutex>
+#include "capture.hpp"
+#include "log.h"
+
+namespace {
+
+constexpr char capture_magic[8] = {'N', 'V', 'M', 'C', 'A', 'P', '0', '1'};
+
+struct record_header {
+    uint64_t time;
+    uint32_t size;
+    capture_direction direction;
+    uint8_t padding[3];
+};
+
+static_assert(sizeof(record_header) == 16);
+
+// Buffered records are written once the buffer reaches this size, or once
+// the oldest buffered record is this old.
+constexpr size_t flush_size = 256 * 1024;
+constexpr uint64_t flush_interval = NSEC_PER_SEC;
+
+uint64_t now() {
+    return clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+}
+
+struct write_context {
+    int fd;
+    std::string data;
+};
+
+void write_all(void *context) {
+    write_context *ctx = static_cast<write_context*>(context);
+    const char *ptr = ctx->data.data();
+    size_t remaining = ctx->data.size();
+
+    while (remaining) {
+        ssize_t bytes = write(ctx->fd, ptr, remaining);
+
+        if (bytes == -1) {
+            if (errno == EINTR) continue;
+
+            os_log_error(rpc, "Capture error: Write failed - Error=%s",
+                         strerror(errno));
+            break;
+        }
+
+        ptr += bytes;
+        remaining -= bytes;
+    }
+
+    delete ctx;
+}
+
+} // namespace
+
+int capture_writer::open(const char *path) {
+    fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd == -1) {
+        return errno;
+    }
+
+    dispatch_queue_attr_t attr;
+    attr = dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL,
+                                                   QOS_CLASS_UTILITY, 0);
+
+    queue = dispatch_queue_create("capture_writer", attr);
+    start_time = now();
+    flush_time = start_time;
+
+    buffer.reserve(flush_size * 2);
+    buffer.append(capture_magic, sizeof(capture_magic));
+
+    timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, queue);
+    dispatch_source_set_timer(timer, dispatch_time(DISPATCH_TIME_NOW, flush_interval),
+                              flush_interval, flush_interval / 4);
+
+    dispatch_set_context(timer, this);
+    dispatch_source_set_event_handler_f(timer, [](void *context) {
+        capture_writer *writer = static_cast<capture_writer*>(context);
+        std::lock_guard guard(writer->lock);
+        writer->flush_if_stale(now());
+    });
+
+    dispatch_resume(timer);
+    return 0;
+}
+
+capture_writer::~capture_writer() {
+    if (!queue) return;
+
+    // A timer handler already running finishes before the close below.
+    dispatch_source_cancel(timer);
+    dispatch_release(timer);
+
+    {
+        std::lock_guard guard(lock);
+        flush();
+    }
+
+    dispatch_sync_f(queue, &fd, [](void *context) {
+        close(*static_cast<int*>(context));
+    });
+
+    dispatch_release(queue);
+}
+
+/// Hands the buffer to the write queue. Requires lock.
+void capture_writer::flush() {
+    if (buffer.empty()) {
+        return;
+    }
+
+    write_context *context = new write_context{fd, std::move(buffer)};
+    dispatch_async_f(queue, context, write_all);
+
+    buffer = std::string();
+    buffer.reserve(flush_size * 2);
+}
+
+/// Flushes the buffer if it was last flushed at least flush_interval before
+/// time. Requires lock.
+void capture_writer::flush_if_stale(uint64_t time) {
+    if (time - flush_time >= flush_interval) {
+        flush();
+        flush_time = time;
+    }
+}
+
+void capture_writer::record(capture_direction direction, const void *data, size_t size) {
+    if (!queue || !size) {
+        return;
+    }
+
+    uint64_t time = now();
+
+    record_header header = {};
+    header.time = time - start_time;
+    header.size = (uint32_t)size;
+    header.direction = direction;
+
+    std::lock_guard guard(lock);
+    buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    buffer.append(static_cast<const char*>(data), size);
+
+    if (buffer.size() >= flush_size) {
+        flush();
+        flush_time = time;
+    } else {
+        flush_if_stale(time);
+    }
+}
+
+int capture_reader::open(const char *path) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return errno;
+    }
+
+    struct stat info;
+
+    if (fstat(fd, &info) == -1) {
+        int error = errno;
+        close(fd);
+        return error;
+    }
+
+    contents.resize(info.st_size);
+    size_t length = 0;
+
+    while (length < contents.size()) {
+        ssize_t bytes = read(fd, contents.data() + length, contents.size() - length);
+
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) continue;
+
+            int error = bytes ? errno : EINVAL;
+            close(fd);
+            return error;
+        }
+
+        length += bytes;
+    }
+
+    close(fd);
+
+    if (length < sizeof(capture_magic) ||
+        memcmp(contents.data(), capture_magic, sizeof(capture_magic)) != 0) {
+        return EINVAL;
+    }
+
+    offset = sizeof(capture_magic);
+    return 0;
+}
+
+std::optional<capture_record> capture_reader::next() {
+    if (contents.size() - offset < sizeof(record_header)) {
+        return std::nullopt;
+    }
+
+    record_header header;
+    memcpy(&header, contents.data() + offset, sizeof(header));
+    offset += sizeof(header);
+
+    if (contents.size() - offset < header.size) {
+        offset = contents.size();
+        return std::nullopt;
+    }
+
+    std::string_view data(contents.data() + offset, header.size);
+    offset += header.size;
+
+    return capture_record{header.time, header.direction, data};
+}
@@ -0,0 +1,101 @@
+//
+//  Neovim Mac
+//  capture.hpp
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#ifndef CAPTURE_HPP
+#define CAPTURE_HPP
+
+#include <dispatch/dispatch.h>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include "unfair_lock.hpp"
+
+// Capture files record the raw bytes of an RPC session, as they were read
+// from and written to the Neovim process.
+//
+// A capture file starts with an 8 byte magic number, followed by a sequence
+// of records. Each record is a 16 byte header followed by the record's bytes:
+//
+//   uint64_t time      Nanoseconds since the capture started.
+//   uint32_t size      The number of bytes that follow.
+//   uint8_t  direction A capture_direction.
+//   uint8_t  padding[3]
+//
+// Integers are stored in host byte order.
+
+/// The direction of a captured record.
+enum class capture_direction : uint8_t {
+    received = 0, ///< Read from the Neovim process.
+    sent     = 1, ///< Written to the Neovim process.
+};
+
+/// A single record of a capture file.
+struct capture_record {
+    uint64_t time;
+    capture_direction direction;
+    std::string_view data;
+};
+
+/// Writes a capture file.
+///
+/// Records are appended to an in memory buffer, which is written to the file
+/// on a low priority background queue once it's large enough, or old enough.
+/// A timer flushes old records even if no more records arrive, so a session
+/// that goes quiet, then crashes, still has its last records on disk.
+/// Safe to call record() from any thread.
+class capture_writer {
+private:
+    unfair_lock lock;
+    dispatch_queue_t queue;
+    dispatch_source_t timer;
+    std::string buffer;
+    uint64_t start_time;
+    uint64_t flush_time;
+    int fd;
+
+    void flush();
+    void flush_if_stale(uint64_t time);
+
+public:
+    capture_writer(): queue(nullptr), timer(nullptr), start_time(0), flush_time(0), fd(-1) {}
+    capture_writer(const capture_writer&) = delete;
+    capture_writer& operator=(const capture_writer&) = delete;
+
+    /// Writes any buffered records and closes the file.
+    ~capture_writer();
+
+    /// Creates a new capture file at path.
+    /// @returns Zero on success, otherwise an errno error code.
+    int open(const char *path);
+
+    /// Records data sent or received now.
+    void record(capture_direction direction, const void *data, size_t size);
+};
+
+/// Reads a capture file.
+class capture_reader {
+private:
+    std::string contents;
+    size_t offset;
+
+public:
+    capture_reader(): offset(0) {}
+
+    /// Reads the capture file at path.
+    /// @returns Zero on success, otherwise an errno error code. EINVAL if the
+    ///          file isn't a capture file.
+    int open(const char *path);
+
+    /// Returns the next record, or std::nullopt once every record has been
+    /// read. A truncated final record is ignored.
+    std::optional<capture_record> next();
+};
+
+#endif // CAPTURE_HPP
@@ -190,6 +190,20 @@ public:
         length += size;
     }
 
+    /// Returns the number of bytes that can be inserted without resizing.
+    /// Thanks to the mirrored mapping, [end(), end() + space()) is contiguous
+    /// and can be written to directly.
+    size_t space() const {
+        return buffsize - length;
+    }
+
+    /// Append size bytes that have been written directly to end().
+    /// Precondition: size <= space(). Complexity: Constant.
+    void commit(size_t size) {
+        assert(size <= buffsize - length);
+        length += size;
+    }
+
     /// Consume size bytes from the start of the buffer. This marks the region
     /// as safe to overwrite with new data. Complexity: Constant.
     void consume(size_t size) {
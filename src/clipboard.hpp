@@ -10,7 +10,9 @@
 #ifndef CLIPBOARD_HPP
 #define CLIPBOARD_HPP
 
-#include <string>
+#include <dispatch/dispatch.h>
+#include <functional>
+#include <string_view>
 #include <tuple>
 #include <vector>
 
@@ -27,25 +29,39 @@
 /// do not handle block pasting correctly.
 ///
 /// See :help clipboard for more.
+///
+/// The pasteboard is only accessed from a serial clipboard queue, so large
+/// yanks and pastes don't hold up the caller. Work queued on the clipboard
+/// queue completes in order, a get always sees the preceding set.
 
 /// Clipboard data
 ///
 /// A tuple of:
 ///   1. An array of lines.
 ///   2. A string representing the register type.
-using clipboard_data = std::tuple<std::vector<std::string>, msg::string>;
+///
+/// Lines reference the clipboard's text, they're only valid for the duration
+/// of the handler they're passed to.
+using clipboard_data = std::tuple<std::vector<std::string_view>, msg::string>;
 
-/// Sets the system clipboard.
+/// Sets the system clipboard asynchronously.
 ///
-/// @param args The arguments to the RPC request, where:
-///             - args[0] is an array of lines.
-///             - args[1] is the register type.
+/// @param args     The arguments to the RPC request, where:
+///                 - args[0] is an array of lines.
+///                 - args[1] is the register type.
+/// @param group    Entered until the clipboard has been set.
+/// @param handler  Called on the clipboard queue once the clipboard is set.
 ///
-/// If the args array is malformed the clipboard is not set.
-void clipboard_set(msg::array args);
+/// The lines are joined into a single buffer before this function returns,
+/// args need not outlive the call. If the args array is malformed the
+/// clipboard is not set, and handler is called before returning.
+void clipboard_set(msg::array args, dispatch_group_t group,
+                   std::function<void()> handler);
 
-/// Get the contents of the system clipboard.
-/// @returns A clipboard_data object.
-clipboard_data clipboard_get();
+/// Get the contents of the system clipboard asynchronously.
+/// @param group    Entered until handler returns.
+/// @param handler  Called on the clipboard queue with the clipboard's data.
+void clipboard_get(dispatch_group_t group,
+                   std::function<void(const clipboard_data&)> handler);
 
 #endif // CLIPBOARD_HPP
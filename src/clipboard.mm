@@ -64,21 +64,52 @@ msg::string to_register_string(register_type regtype) {
     }
 }
 
-clipboard_data make_clipboard_data(register_type regtype, NSString *string) {
-    NSCharacterSet *newLines = [NSCharacterSet newlineCharacterSet];
-    NSArray *nsLines = [string componentsSeparatedByCharactersInSet:newLines];
+// Pasteboard access is serialized on this queue, off the RPC queue, so
+// redraws keep flowing while large clipboards are transferred.
+dispatch_queue_t clipboard_queue() {
+    static dispatch_queue_t queue = [] {
+        dispatch_queue_attr_t attr;
+        attr = dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL,
+                                                       QOS_CLASS_UTILITY, 0);
+        return dispatch_queue_create("clipboard", attr);
+    }();
+
+    return queue;
+}
+
+// Splits text into lines on \n, \r\n and \r line breaks.
+std::vector<std::string_view> split_lines(std::string_view text) {
+    std::vector<std::string_view> lines;
+    const char *begin = text.data();
+    const char *end = begin + text.size();
+
+    for (const char *ptr = begin; ptr != end; ++ptr) {
+        if (*ptr != '\n' && *ptr != '\r') {
+            continue;
+        }
+
+        lines.emplace_back(begin, ptr - begin);
 
-    std::vector<std::string> lines;
-    lines.reserve([nsLines count]);
+        if (*ptr == '\r' && ptr + 1 != end && ptr[1] == '\n') {
+            ptr += 1;
+        }
 
-    for (NSString *line in nsLines) {
-        lines.emplace_back([line UTF8String]);
+        begin = ptr + 1;
     }
 
-    return clipboard_data(std::move(lines), to_register_string(regtype));
+    lines.emplace_back(begin, end - begin);
+    return lines;
 }
 
-clipboard_data autoreleased_clipboard_get() {
+void call_with_clipboard_data(register_type regtype, NSString *string,
+                              const std::function<void(const clipboard_data&)> &handler) {
+    std::string_view text([string UTF8String],
+                          [string lengthOfBytesUsingEncoding:NSUTF8StringEncoding]);
+
+    handler(clipboard_data(split_lines(text), to_register_string(regtype)));
+}
+
+void autoreleased_clipboard_get(const std::function<void(const clipboard_data&)> &handler) {
     NSPasteboard *pasteboard = [NSPasteboard generalPasteboard];
     NSArray *supportedTypes = @[NVimPasteboardType, NSPasteboardTypeString];
 
@@ -96,35 +127,57 @@ clipboard_data autoreleased_clipboard_get() {
             [plist[0] isKindOfClass:[NSNumber class]] &&
             [plist[1] isKindOfClass:[NSString class]]) {
             auto regtype = static_cast<register_type>((int)[plist[0] intValue]);
-            return make_clipboard_data(regtype, plist[1]);
+            return call_with_clipboard_data(regtype, plist[1], handler);
         }
     }
 
     NSString *string = [pasteboard stringForType:NSPasteboardTypeString];
 
     if (!string) {
-        return clipboard_data();
+        return handler(clipboard_data());
     }
 
-    return make_clipboard_data(register_type::unknown, string);
+    return call_with_clipboard_data(register_type::unknown, string, handler);
 }
 
-void autoreleased_clipboard_set(msg::array lines, msg::string regstring) {
-    std::string buffer;
-    buffer.reserve(lines.size() * 128);
+// Joins lines with newlines into a single malloc'd buffer. The buffer is
+// sized exactly, lines are copied straight out of the msgpack data.
+std::pair<char*, size_t> join_lines(msg::array lines) {
+    size_t length = lines.size() ? lines.size() - 1 : 0;
+
+    for (msg::object line : lines) {
+        length += line.get<msg::string>().size();
+    }
+
+    char *buffer = static_cast<char*>(malloc(std::max(length, 1ul)));
+    char *ptr = buffer;
+
+    for (size_t i=0; i<lines.size(); ++i) {
+        msg::string line = lines[i].get<msg::string>();
+
+        if (i) {
+            *ptr++ = '\n';
+        }
 
-    for (auto object : lines) {
-        msg::string line = object.get<msg::string>();
-        buffer.append(line.data(), line.size());
-        buffer.push_back('\n');
+        memcpy(ptr, line.data(), line.size());
+        ptr += line.size();
     }
 
-    size_t length = std::max(buffer.length(), 1ul) - 1;
-    NSString *string = [[NSString alloc] initWithBytes:buffer.data()
-                                                length:length
-                                              encoding:NSUTF8StringEncoding];
+    return {buffer, length};
+}
+
+void autoreleased_clipboard_set(char *buffer, size_t length, register_type regtype) {
+    // The string takes ownership of the buffer.
+    NSString *string = [[NSString alloc] initWithBytesNoCopy:buffer
+                                                      length:length
+                                                    encoding:NSUTF8StringEncoding
+                                                freeWhenDone:YES];
+
+    if (!string) {
+        free(buffer);
+        return os_log_error(rpc, "Clipboard set encoding error - Length=%zu", length);
+    }
 
-    register_type regtype = to_register_type(regstring);
     NSPasteboard *pasteboard = [NSPasteboard generalPasteboard];
     NSArray *supportedTypes = @[NVimPasteboardType, NSPasteboardTypeString];
     NSArray *plist = @[[NSNumber numberWithInt:(int)regtype], string];
@@ -152,24 +205,40 @@ bool type_check_lines(msg::array lines) {
 
 } // internal
 
-clipboard_data clipboard_get() {
-    @autoreleasepool {
-        return autoreleased_clipboard_get();
-    }
+void clipboard_get(dispatch_group_t group,
+                   std::function<void(const clipboard_data&)> handler) {
+    dispatch_group_async(group, clipboard_queue(), ^{
+        @autoreleasepool {
+            autoreleased_clipboard_get(handler);
+        }
+    });
 }
 
-void clipboard_set(msg::array args) {
+void clipboard_set(msg::array args, dispatch_group_t group,
+                   std::function<void()> handler) {
     if (type_check_args(args)) {
         msg::array lines = args[0].get<msg::array>();
-        msg::string regtype = args[1].get<msg::string>();
+        msg::string regstring = args[1].get<msg::string>();
 
         if (type_check_lines(lines)) {
-            @autoreleasepool {
-                return autoreleased_clipboard_set(lines, regtype);
-            }
+            // Lines reference the caller's read buffer, copy them out now.
+            std::pair<char*, size_t> joined = join_lines(lines);
+            char *buffer = joined.first;
+            size_t length = joined.second;
+            register_type regtype = to_register_type(regstring);
+
+            return dispatch_group_async(group, clipboard_queue(), ^{
+                @autoreleasepool {
+                    autoreleased_clipboard_set(buffer, length, regtype);
+                }
+
+                handler();
+            });
         }
     }
 
-    return os_log_info(rpc, "Clipboard set type error - Args=%s",
-                       msg::to_string(args).c_str());
+    os_log_info(rpc, "Clipboard set type error - Args=%s",
+                msg::to_string(args).c_str());
+
+    handler();
 }
@@ -12,10 +12,11 @@
 
 #include <simd/simd.h>
 #include <Metal/Metal.h>
-#include <unordered_map>
+#include <algorithm>
 #include <memory>
 #include <vector>
 #include <string>
+#include <tuple>
 #include "shader_types.hpp"
 #include "ui.hpp"
 
@@ -229,6 +230,7 @@ struct glyph_bitmap {
     int16_t ascent;        ///< The glyphs ascent metric.
     int16_t width;         ///< The width of the pixel buffer.
     int16_t height;        ///< The height of the pixel buffer.
+    bool mask;             ///< True if the bitmap is a coverage mask.
 
     /// Returns the glyphs descent.
     int16_t descent() const {
@@ -236,6 +238,31 @@ struct glyph_bitmap {
     }
 };
 
+/// A glyph_bitmap that owns its pixel buffer.
+/// Bitmaps returned by a glyph_rasterizer point into the rasterizer's canvas,
+/// which is overwritten by the next rasterization. Copy bitmaps that need to
+/// outlive that into an owned_glyph_bitmap.
+struct owned_glyph_bitmap {
+    glyph_bitmap bitmap;
+    std::vector<unsigned char> pixels;
+
+    /// Copies source, along with its pixels, into this object.
+    /// The copy is tightly packed, its stride is its row size.
+    void assign(const glyph_bitmap &source, size_t pixel_size) {
+        const size_t row_size = source.width * pixel_size;
+        pixels.resize(row_size * source.height);
+
+        for (size_t row=0; row<source.height; ++row) {
+            memcpy(pixels.data() + (row * row_size),
+                   source.buffer + (row * source.stride), row_size);
+        }
+
+        bitmap = source;
+        bitmap.buffer = pixels.data();
+        bitmap.stride = row_size;
+    }
+};
+
 /// Rasterizes text into glyph_bitmaps.
 /// Uses the sRGB colorspace and the RGBA premultiplied alpha pixel format.
 ///
@@ -253,6 +280,13 @@ struct glyph_bitmap {
 /// unfortunately, that's not possible either. When rendering to an alpha only
 /// CGContext, CoreText only considers the text foreground color, so we have no
 /// way of obtaining accurate, correctly dilated, alpha masks.
+///
+/// That said, baking colors into every glyph is expensive: the same glyph in
+/// twenty highlight colors takes twenty rasterizations and twenty cache slots.
+/// rasterize_mask() trades exact dilation for color independence. It renders
+/// undilated coverage masks that are tinted at draw time. Color glyphs, such
+/// as emoji, can't be tinted, they're rasterized in color on a transparent
+/// background instead.
 class glyph_rasterizer {
 private:
     arc_ptr<CGContextRef> context;
@@ -261,6 +295,8 @@ private:
     size_t midx;
     size_t midy;
 
+    glyph_bitmap layout(CTLineRef line);
+
 public:
     static constexpr size_t pixel_size = 4;
 
@@ -287,21 +323,68 @@ public:
                            nvim::rgb_color foreground,
                            std::string_view text);
 
+    /// Rasterize a string as a coverage mask.
+    /// The coverage is stored in every channel of the output pixels, which are
+    /// premultiplied white. If the text is drawn using a font with color
+    /// glyphs, the output is in color, and the mask flag is not set.
+    /// @param font         The font to use.
+    /// @param text         The text to rasterize.
+    /// @returns A glyph bitmap containing the rasterized output.
+    glyph_bitmap rasterize_mask(CTFontRef font, std::string_view text);
+
     /// The stride value for glyph_bitmaps produced by this rasterizer.
     size_t stride() const {
         return midx * 2 * pixel_size;
     }
 };
 
+/// A fixed size pool of glyph_rasterizers.
+/// Rasterizers are not thread safe. A pool lets us rasterize glyphs on several
+/// threads at once, using a rasterizer per thread.
+class glyph_rasterizer_pool {
+private:
+    std::vector<glyph_rasterizer> rasterizers;
+
+public:
+    /// Default constructed objects should only be assigned to or destroyed.
+    /// This constructor is only provided because Objective-C++ requires C++
+    /// instance variables to be default constructible.
+    glyph_rasterizer_pool() = default;
+
+    /// Construct a pool of count rasterizers with the given canvas size.
+    /// @see glyph_rasterizer::glyph_rasterizer.
+    glyph_rasterizer_pool(size_t count, size_t width, size_t height) {
+        rasterizers.reserve(std::max(count, 1ul));
+
+        for (size_t i=0; i<std::max(count, 1ul); ++i) {
+            rasterizers.emplace_back(width, height);
+        }
+    }
+
+    /// Returns the number of rasterizers in the pool. Always at least one.
+    size_t size() const {
+        return rasterizers.size();
+    }
+
+    /// Returns the rasterizer at the given index.
+    glyph_rasterizer& operator[](size_t index) {
+        return rasterizers[index];
+    }
+};
+
 /// Caches glyphs in a Metal texture.
 /// Glyphs are cached in an array of 2d textures. Each texture in the texture
-/// array is a cache page. Cache pages are added and evicted as needed. The
-/// texture cache uses a FIFO cache eviction scheme.
+/// array is a cache page. Cache pages are added as needed, glyphs are packed
+/// into the current page in rows. Pages are evicted by compacting the page
+/// array, individual glyphs from evicted pages may be copied to the current
+/// page before the old texture is released.
 class glyph_texture_cache {
 private:
     id<MTLDevice> device;
     id<MTLCommandQueue> queue;
     id<MTLTexture> texture;
+    id<MTLCommandBuffer> copy_buffer;
+    id<MTLBlitCommandEncoder> copy_encoder;
     double growth_factor;
     size_t page_count;
     size_t page_index;
@@ -311,7 +394,9 @@ private:
     size_t y_used;
     size_t row_height;
 
-    simd_short3 add_new_page(const glyph_bitmap &bitmap);
+    simd_short3 allocate(size_t width, size_t height);
+
+    simd_short3 allocate_new_page(size_t width, size_t height);
 
     void realloc(size_t new_page_count, size_t begin, size_t count);
 
@@ -343,12 +428,18 @@ public:
         return y_size;
     }
 
+    /// Returns the size of a cache page in bytes.
+    size_t page_bytes() const {
+        return x_size * y_size * 4;
+    }
+
     /// Returns the capacity of the cache page array.
     size_t pages_capacity() {
         return page_count;
     }
 
-    /// Returns the number of cache pages currently in use.
+    /// Returns the index of the cache page currently in use.
+    /// Pages [0, pages_size()] contain glyphs.
     size_t pages_size() {
         return page_index;
     }
@@ -370,18 +461,47 @@ public:
     ///          z - The cache page the bitmap was stored in.
     simd_short3 add(const glyph_bitmap &bitmap);
 
-    /// Evicts all but the newest n cache pages.
-    /// Eviction is done by copying the contents of the page array to a new
-    /// smaller MTLTexture. The existing MTLTexture is released, but it is not
-    /// mutated, other references to it remain valid.
+    /// Copies a glyph from another texture into the cache.
+    /// The copy is encoded, but not committed until commit() is called.
+    /// @param source   The texture to copy from. Must not be metal_texture().
+    /// @param origin   The position of the glyph in the source texture, in the
+    ///                 format returned by add().
+    /// @param size     The size of the glyph in pixels.
+    /// @returns The position the glyph was copied to, in the format returned
+    ///          by add().
+    simd_short3 copy(id<MTLTexture> source, simd_short3 origin, simd_short2 size);
+
+    /// Commits copies encoded by copy().
+    void commit();
+
+    /// Evicts every cache page.
+    void clear();
+
+    /// Evicts every cache page not in pages.
+    /// Compaction is done by copying the preserved pages to a new MTLTexture.
+    /// The existing MTLTexture is released, but it is not mutated, other
+    /// references to it remain valid.
     ///
-    /// @param preserve The maximum number of cache pages to preserve. The
-    /// newest cache pages are preserved, starting with the one currently
-    /// in use.
-    ///
-    /// @returns If preserve is a non zero value, returns the number of used
-    /// cache pages that were evicted. If preserve is 0, returns 0.
-    size_t evict(size_t preserve);
+    /// @param pages    The cache pages to preserve, in ascending order. The
+    ///                 page at index i is moved to index i. The last page must
+    ///                 be the page currently in use.
+    /// @param capacity The capacity of the new page array. At least
+    ///                 pages.size() pages are allocated.
+    void compact(const std::vector<size_t> &pages, size_t capacity);
+};
+
+/// Glyph cache statistics.
+struct glyph_cache_stats {
+    size_t pages;          ///< Cache pages in use.
+    size_t pages_capacity; ///< Cache pages allocated.
+    size_t bytes;          ///< GPU memory used by allocated cache pages.
+    size_t budget;         ///< GPU memory allowed before the cache is evicted.
+    size_t glyphs;         ///< Cached glyphs.
+    size_t clients;        ///< Clients drawing with the glyph manager.
+    uint64_t evictions;    ///< Evictions so far.
+    uint64_t hits;         ///< Lookups found in the cache so far.
+    uint64_t misses;       ///< Lookups deferred to resolve() so far.
+    uint64_t rasterized;   ///< Glyphs rasterized so far.
 };
 
 /// Rasterizes and caches glyphs.
@@ -390,6 +510,11 @@ public:
 /// required to render a frame is in GPU memory. Once a frame has been
 /// committed, you should call evict() on the glyph_manager object to give it
 /// a chance to cull old cache pages.
+///
+/// Every lookup stamps its glyph with the current frame. On eviction, the
+/// cache pages with the most recently used glyphs are preserved, and glyphs
+/// used within the last few frames are copied off the evicted pages. Only
+/// glyphs that have gone cold are dropped.
 class glyph_manager {
 private:
     struct key_type {
@@ -424,31 +549,244 @@ private:
         }
     };
 
-    struct key_hash {
-        size_t operator()(const key_type &key) const {
-            return key.hash;
-        }
-    };
-
     struct key_equal {
         bool operator()(const key_type &left, const key_type &right) const {
             return memcmp(&left, &right, sizeof(key_type)) == 0;
         }
     };
 
-    using glyph_map = std::unordered_map<key_type,
-                                         glyph_rect,
-                                         key_hash,
-                                         key_equal>;
+    // A cached glyph and the frame it was last used in.
+    struct glyph_entry {
+        glyph_rect rect;
+        uint64_t used;
+    };
+
+    // An open addressing hash table of glyph entries.
+    // Keys and entries are stored densely in insertion order, the table itself
+    // only holds truncated hashes and entry indices. Probing is linear, each
+    // probe touches 8 bytes, and keys are only compared on a hash match.
+    // Entry indices are stable until entries are removed by erase_if.
+    class glyph_map {
+    private:
+        struct slot {
+            uint32_t hash;
+            uint32_t index;
+        };
+
+        static constexpr uint32_t empty = UINT32_MAX;
+
+        std::vector<slot> slots;
+        std::vector<key_type> keys;
+        std::vector<glyph_entry> entries;
+        size_t shift;
+
+        // Fibonacci hashing, our key hashes favor speed over quality.
+        size_t position(size_t hash) const {
+            return (hash * 11400714819323198485ull) >> shift;
+        }
+
+        void insert_slot(size_t hash, uint32_t index) {
+            const size_t mask = slots.size() - 1;
+
+            for (size_t i=position(hash);; i = (i + 1) & mask) {
+                if (slots[i].index == empty) {
+                    slots[i] = slot{(uint32_t)hash, index};
+                    return;
+                }
+            }
+        }
+
+        void rehash(size_t capacity) {
+            slots.assign(capacity, slot{0, empty});
+            shift = 64 - __builtin_ctzll(capacity);
+
+            for (uint32_t i=0; i<keys.size(); ++i) {
+                insert_slot(keys[i].hash, i);
+            }
+        }
+
+    public:
+        /// Looks up key, inserting a default constructed entry if not found.
+        /// @returns The index of the entry, and true if it was inserted.
+        std::pair<uint32_t, bool> try_emplace(const key_type &key) {
+            if ((entries.size() + 1) * 4 > slots.size() * 3) {
+                rehash(std::max<size_t>(slots.size() * 2, 256));
+            }
+
+            const size_t mask = slots.size() - 1;
+            const uint32_t hash = (uint32_t)key.hash;
+
+            for (size_t i=position(key.hash);; i = (i + 1) & mask) {
+                slot current = slots[i];
+
+                if (current.index == empty) {
+                    assert(entries.size() < empty);
+                    uint32_t index = static_cast<uint32_t>(entries.size());
+                    slots[i] = slot{hash, index};
+                    keys.push_back(key);
+                    entries.emplace_back();
+                    return {index, true};
+                }
+
+                if (current.hash == hash && key_equal()(keys[current.index], key)) {
+                    return {current.index, false};
+                }
+            }
+        }
+
+        /// Returns the number of entries.
+        size_t size() const {
+            return entries.size();
+        }
+
+        /// Returns the entry at index.
+        glyph_entry& operator[](uint32_t index) {
+            return entries[index];
+        }
+
+        auto begin() const {
+            return entries.begin();
+        }
+
+        auto end() const {
+            return entries.end();
+        }
+
+        /// Removes every entry for which predicate returns true.
+        /// The predicate may modify the entries it keeps.
+        /// Invalidates entry indices.
+        template<typename Predicate>
+        void erase_if(Predicate predicate) {
+            size_t size = 0;
+
+            for (size_t i=0; i<entries.size(); ++i) {
+                if (!predicate(entries[i])) {
+                    keys[size] = keys[i];
+                    entries[size] = entries[i];
+                    size += 1;
+                }
+            }
+
+            keys.erase(keys.begin() + size, keys.end());
+            entries.erase(entries.begin() + size, entries.end());
+
+            if (slots.size()) {
+                rehash(slots.size());
+            }
+        }
+
+        void clear() {
+            slots.clear();
+            keys.clear();
+            entries.clear();
+        }
+    };
+
+    // The last glyph looked up. Neighbouring cells often share a glyph, runs
+    // of spaces for example, so we check it before hashing.
+    struct memo_type {
+        CTFontRef font = nullptr;
+        nvim::grapheme_cluster graphemes;
+        uint32_t background;
+        uint32_t foreground;
+        uint32_t index;
+    };
+
+    // A glyph waiting to be rasterized by resolve().
+    // The index is its entry in the glyph map. Entry indices are stable, so it
+    // remains valid as other glyphs are inserted.
+    struct pending_glyph {
+        CTFontRef font;
+        nvim::grapheme_cluster text;
+        size_t text_size;
+        nvim::rgb_color background;
+        nvim::rgb_color foreground;
+        uint32_t index;
+        owned_glyph_bitmap bitmap;
+    };
+
+    // A glyph_rect to be written once its glyph has been resolved.
+    struct deferred_glyph {
+        uint32_t index;
+        glyph_rect *dest;
+    };
+
+    // A client of the glyph manager, usually a view. Before an eviction, every
+    // client looks up its visible glyphs again, so the pages we keep are
+    // decided by the glyphs visible across all clients.
+    struct client_state {
+        bool active;
+        bool stamped;
+        bool ended;
+    };
 
     size_t evict_threshold;
     size_t evict_preserve;
-    glyph_rasterizer *rasterizer;
+    uint64_t evict_generation = 0;
+    uint64_t lookup_hits = 0;
+    uint64_t lookup_misses = 0;
+    uint64_t rasterized = 0;
+    uint64_t frame = 0;
+    uint64_t due_frame = 0;
+    bool evict_due = false;
+    std::vector<client_state> clients;
+    bool masks;
+    glyph_rasterizer_pool *rasterizers;
     glyph_texture_cache texture_cache;
     glyph_map map;
+    memo_type memo;
+    std::vector<pending_glyph> pending;
+    std::vector<deferred_glyph> deferred;
+    std::vector<CTFontRef> prewarmed_fonts;
 
     void do_evict();
 
+    void set_rect(glyph_rect *rect, const glyph_bitmap &bitmap);
+
+    static constexpr int16_t pending_page = -1;
+
+    // Glyphs used within this many frames are copied off evicted pages.
+    static constexpr uint64_t hot_frames = 60;
+
+    // A due eviction waits at most this many frames for clients to look up
+    // their glyphs. Clients that don't draw in time lose their cold glyphs.
+    static constexpr uint64_t max_due_frames = 120;
+
+    bool clients_stamped() const {
+        return std::all_of(clients.begin(), clients.end(), [](const client_state &client) {
+            return !client.active || client.stamped;
+        });
+    }
+
+    bool clients_ended() const {
+        return std::all_of(clients.begin(), clients.end(), [](const client_state &client) {
+            return !client.active || client.ended;
+        });
+    }
+
+    void next_frame() {
+        for (client_state &state : clients) {
+            state.ended = false;
+        }
+
+        frame += 1;
+    }
+
+    // Frames count display frames, not evict() calls. A frame ends once every
+    // active client has ended one, or a client starts drawing another, which
+    // happens when other clients are idle.
+    void end_frame(size_t client) {
+        if (clients[client].ended) {
+            next_frame();
+        }
+
+        clients[client].ended = true;
+
+        if (clients_ended()) {
+            next_frame();
+        }
+    }
+
 public:
     /// Default constructed objects should only be assigned to or destroyed.
     /// This constructor is only provided because Objective-C++ requires C++
@@ -456,53 +794,158 @@ public:
     glyph_manager() = default;
 
     /// Constructs a glyph manager.
-    /// @param rasterizer       The shared glyph rasterizer to use.
+    /// @param rasterizers      The shared glyph rasterizer pool to use.
     /// @param texture_cache    The texture cache to use.
     /// @param evict_threshold  The cache eviction threshold.
     /// @param evict_preserve   The number of texture cache pages preserved
     ///                         on eviction. This number should be less than
     ///                         evict_threshold.
-    glyph_manager(glyph_rasterizer *rasterizer,
+    /// @param masks            If true, glyphs are cached as coverage masks
+    ///                         regardless of their colors.
+    /// @see glyph_rasterizer::rasterize_mask.
+    glyph_manager(glyph_rasterizer_pool *rasterizers,
                   glyph_texture_cache texture_cache,
                   size_t evict_threshold,
-                  size_t evict_preserve):
-        rasterizer(rasterizer),
+                  size_t evict_preserve,
+                  bool masks):
+        rasterizers(rasterizers),
         texture_cache(std::move(texture_cache)),
         evict_threshold(evict_threshold),
-        evict_preserve(evict_preserve) {}
+        evict_preserve(evict_preserve),
+        masks(masks) {}
+
+    /// Looks up a cached glyph, deferring rasterization on a cache miss.
+    /// On a cache hit, the glyph is written to dest immediately. On a miss, the
+    /// glyph is queued, and dest is written by the next call to resolve().
+    /// @param font         The font.
+    /// @param cell         The cell form which the text is obtained.
+    /// @param background   The background color. Ignored in mask mode.
+    /// @param foreground   The foreground color. Ignored in mask mode.
+    /// @param dest         Where to store the glyph. Must remain valid until
+    ///                     resolve() is called.
+    void get_deferred(CTFontRef font,
+                      const nvim::cell &cell,
+                      nvim::rgb_color background,
+                      nvim::rgb_color foreground,
+                      glyph_rect *dest) {
+        if (masks) {
+            background = nvim::rgb_color();
+            foreground = nvim::rgb_color();
+        }
+
+        const nvim::grapheme_cluster graphemes = cell.grapheme();
+        const uint32_t bg = background.opaque();
+        const uint32_t fg = foreground.opaque();
+        uint32_t index;
+        bool inserted = false;
+
+        if (memo.font == font && memo.background == bg &&
+            memo.foreground == fg && memo.graphemes == graphemes) {
+            index = memo.index;
+        } else {
+            key_type key(font, graphemes, background, foreground);
+            std::tie(index, inserted) = map.try_emplace(key);
+            memo = memo_type{font, graphemes, bg, fg, index};
+        }
+
+        glyph_entry &entry = map[index];
+        entry.used = frame;
+
+        if (!inserted && entry.rect.texture_page != pending_page) {
+            *dest = entry.rect;
+            lookup_hits += 1;
+            return;
+        }
+
+        lookup_misses += 1;
+
+        if (inserted) {
+            entry.rect.texture_page = pending_page;
+
+            pending_glyph &glyph = pending.emplace_back();
+            glyph.font = font;
+            glyph.text = cell.grapheme();
+            glyph.text_size = cell.grapheme_view().size();
+            glyph.background = background;
+            glyph.foreground = foreground;
+            glyph.index = index;
+        }
+
+        deferred.push_back(deferred_glyph{index, dest});
+    }
+
+    /// Calls get_deferred using the background and foreground colors of cell.
+    void get_deferred(const font_family &font_family,
+                      const nvim::cell &cell, glyph_rect *dest) {
+        CTFontRef font = font_family.get(cell.font_attributes());
+        get_deferred(font, cell, cell.background(), cell.foreground(), dest);
+    }
+
+    /// Rasterizes the glyphs queued by get_deferred and adds them to the cache.
+    /// Glyphs are rasterized concurrently, using every rasterizer in the pool.
+    /// Once done, every glyph_rect passed to get_deferred is written.
+    void resolve();
+
+    /// True if glyphs are cached as coverage masks, independent of color.
+    bool uses_masks() const {
+        return masks;
+    }
+
+    /// Marks font as prewarmed.
+    /// Only mask glyphs can be prewarmed, colored glyphs depend on cell colors
+    /// which aren't known ahead of time.
+    /// @returns True if the font should be prewarmed. False if the font has
+    /// already been prewarmed, or if the manager doesn't use mask glyphs.
+    bool begin_prewarm(const font_family &font) {
+        if (!masks) {
+            return false;
+        }
+
+        if (std::find(prewarmed_fonts.begin(), prewarmed_fonts.end(),
+                      font.regular()) != prewarmed_fonts.end()) {
+            return false;
+        }
+
+        prewarmed_fonts.push_back(font.regular());
+        return true;
+    }
+
+    /// Adds a glyph rasterized with glyph_rasterizer::rasterize_mask.
+    /// If the glyph is already cached, the cache is not modified.
+    /// Precondition: uses_masks() is true, and there are no unresolved glyphs.
+    void add(CTFontRef font,
+             const nvim::grapheme_cluster &text,
+             const glyph_bitmap &bitmap) {
+        assert(masks && deferred.empty());
+        key_type key(font, text, nvim::rgb_color(), nvim::rgb_color());
+        auto [index, inserted] = map.try_emplace(key);
+
+        if (inserted) {
+            set_rect(&map[index].rect, bitmap);
+            map[index].used = frame;
+        }
+    }
 
     /// Returns a cached glyph with the given attributes.
+    /// Cache misses are rasterized immediately, when looking up more than a
+    /// few glyphs prefer get_deferred().
     /// @param font         The font.
     /// @param cell         The cell form which the text is obtained.
-    /// @param background   The background color.
-    /// @param foreground   The foreground color.
+    /// @param background   The background color. Ignored in mask mode.
+    /// @param foreground   The foreground color. Ignored in mask mode.
     /// @returns A cached glyph.
     glyph_rect get(CTFontRef font,
                    const nvim::cell &cell,
                    nvim::rgb_color background,
                    nvim::rgb_color foreground) {
-        key_type key(font, cell.grapheme(), background, foreground);
+        glyph_rect rect;
+        get_deferred(font, cell, background, foreground, &rect);
 
-        if (auto iter = map.find(key); iter != map.end()) {
-            return iter->second;
+        if (deferred.size()) {
+            resolve();
         }
 
-        glyph_bitmap glyph = rasterizer->rasterize(font,
-                                                   background,
-                                                   foreground,
-                                                   cell.grapheme_view());
-
-        auto texture_position = texture_cache.add(glyph);
-
-        glyph_rect cached;
-        cached.texture_origin = texture_position;
-        cached.position.x = glyph.left_bearing;
-        cached.position.y = -glyph.ascent;
-        cached.size.x = glyph.width;
-        cached.size.y = glyph.height;
-
-        map.emplace(key, cached);
-        return cached;
+        return rect;
     }
 
     /// Calls get using the background and foreground colors of cell.
@@ -516,14 +959,93 @@ public:
         return texture_cache.metal_texture();
     }
 
-    /// Evicts old cache pages if necessary.
-    /// The cache is evicted if the number of allocated cache pages exceeds the
-    /// cache eviction threshold. The newest n cache pages are preserved, where
-    /// n is the evict_preserve value passed to the constructor.
-    void evict() {
-        if (texture_cache.pages_capacity() > evict_threshold) {
-            do_evict();
+    /// Returns the eviction generation.
+    /// The generation is incremented whenever an eviction invalidates
+    /// previously returned glyph_rects. Clients that hold on to glyph_rects
+    /// across frames should discard them when the generation changes.
+    uint64_t generation() const {
+        return evict_generation;
+    }
+
+    /// Registers a client that draws with this glyph manager.
+    /// @returns The client's identifier, for eviction_due() and evict().
+    size_t add_client() {
+        auto iter = std::find_if(clients.begin(), clients.end(), [](const client_state &client) {
+            return !client.active;
+        });
+
+        if (iter == clients.end()) {
+            iter = clients.insert(iter, client_state{});
+        }
+
+        *iter = client_state{true, false, false};
+        return iter - clients.begin();
+    }
+
+    /// Unregisters a client. Its identifier may be reused.
+    void remove_client(size_t client) {
+        clients[client].active = false;
+        clients[client].ended = false;
+    }
+
+    /// True if client should look up all of its visible glyphs this frame.
+    /// Once an eviction is due, every client looks up its visible glyphs
+    /// before cache pages are evicted, so they're known to be in use.
+    bool eviction_due(size_t client) const {
+        return evict_due && !clients[client].stamped;
+    }
+
+    /// Ends client's current frame, evicting old cache pages if necessary.
+    /// Once the number of allocated cache pages exceeds the cache eviction
+    /// threshold, an eviction is scheduled. It happens once every client has
+    /// drawn a frame, or after a limited number of frames. The n most recently
+    /// used cache pages are preserved, where n is the evict_preserve value
+    /// passed to the constructor.
+    /// Precondition: There are no unresolved glyphs.
+    /// @returns True if this call scheduled an eviction. Clients that aren't
+    /// drawing should be asked to draw a frame.
+    bool evict(size_t client) {
+        assert(deferred.empty());
+        bool scheduled = false;
+
+        if (evict_due) {
+            clients[client].stamped = true;
+
+            if (clients_stamped() || frame - due_frame >= max_due_frames) {
+                do_evict();
+            }
+        } else if (texture_cache.pages_capacity() > evict_threshold) {
+            for (client_state &state : clients) {
+                state.stamped = false;
+            }
+
+            evict_due = true;
+            due_frame = frame;
+            scheduled = true;
         }
+
+        end_frame(client);
+        return scheduled;
+    }
+
+    /// Returns glyph cache statistics.
+    glyph_cache_stats stats() {
+        glyph_cache_stats stats = {};
+        stats.pages = texture_cache.pages_size() + 1;
+        stats.pages_capacity = texture_cache.pages_capacity();
+        stats.bytes = stats.pages_capacity * texture_cache.page_bytes();
+        stats.budget = evict_threshold * texture_cache.page_bytes();
+        stats.glyphs = map.size();
+        stats.evictions = evict_generation;
+        stats.hits = lookup_hits;
+        stats.misses = lookup_misses;
+        stats.rasterized = rasterized;
+
+        for (const client_state &client : clients) {
+            stats.clients += client.active;
+        }
+
+        return stats;
     }
 };
 
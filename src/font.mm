@@ -9,6 +9,8 @@
 
 #import <Cocoa/Cocoa.h>
 #include <CoreText/CoreText.h>
+#include <algorithm>
+#include <numeric>
 #include "font.hpp"
 
 CGFloat font_family::width() const {
@@ -202,16 +204,12 @@ static inline arc_ptr<CTLineRef> make_line(CTFontRef font,
     return CTLineCreateWithAttributedString(attr_str.get());
 }
 
-glyph_bitmap glyph_rasterizer::rasterize(CTFontRef font,
-                                         nvim::rgb_color background,
-                                         nvim::rgb_color foreground,
-                                         std::string_view text) {
-    CGContextSetTextPosition(context.get(), midx, midy);
-    arc_ptr line = make_line(font, foreground, text);
-
+/// Computes the bitmap that line would be drawn to.
+/// The bitmap buffer is not cleared, nothing is drawn to it.
+glyph_bitmap glyph_rasterizer::layout(CTLineRef line) {
     // We have to pad the glyph metrics to account for anti aliasing and float
     // to integer conversions. The numbers used were arrived at experimentally.
-    CGRect bounds = CTLineGetBoundsWithOptions(line.get(), kCTLineBoundsUseGlyphPathBounds);
+    CGRect bounds = CTLineGetBoundsWithOptions(line, kCTLineBoundsUseGlyphPathBounds);
     CGFloat descent = bounds.origin.y - 2;
     CGFloat ascent  = bounds.size.height + bounds.origin.y + 2;
     CGFloat leftx   = bounds.origin.x - 2;
@@ -228,12 +226,59 @@ glyph_bitmap glyph_rasterizer::rasterize(CTFontRef font,
         
     bitmap.stride = stride();
     bitmap.buffer = buffer.get() + ((col + row) * pixel_size);
-        
+    bitmap.mask = false;
+    return bitmap;
+}
+
+glyph_bitmap glyph_rasterizer::rasterize(CTFontRef font,
+                                         nvim::rgb_color background,
+                                         nvim::rgb_color foreground,
+                                         std::string_view text) {
+    CGContextSetTextPosition(context.get(), midx, midy);
+    arc_ptr line = make_line(font, foreground, text);
+    glyph_bitmap bitmap = layout(line.get());
+
     clear_bitmap(bitmap, background.opaque());
     CTLineDraw(line.get(), context.get());
     return bitmap;
 }
 
+/// True if any of the line's glyph runs use a font with color glyphs.
+/// CoreText substitutes fonts as needed, so we check the fonts of each run
+/// rather than the font we asked for.
+static bool has_color_glyphs(CTLineRef line) {
+    CFArrayRef runs = CTLineGetGlyphRuns(line);
+
+    for (CFIndex i=0, count=CFArrayGetCount(runs); i<count; ++i) {
+        CTRunRef run = (CTRunRef)CFArrayGetValueAtIndex(runs, i);
+        CFDictionaryRef attributes = CTRunGetAttributes(run);
+        auto font = (CTFontRef)CFDictionaryGetValue(attributes, kCTFontAttributeName);
+
+        if (font && (CTFontGetSymbolicTraits(font) & kCTFontTraitColorGlyphs)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+glyph_bitmap glyph_rasterizer::rasterize_mask(CTFontRef font, std::string_view text) {
+    static const nvim::rgb_color white(0xFFFFFF);
+
+    CGContextSetTextPosition(context.get(), midx, midy);
+    arc_ptr line = make_line(font, white, text);
+    glyph_bitmap bitmap = layout(line.get());
+
+    // Font smoothing assumes an opaque background, which masks don't have.
+    clear_bitmap(bitmap, 0);
+    CGContextSetShouldSmoothFonts(context.get(), false);
+    CTLineDraw(line.get(), context.get());
+    CGContextSetShouldSmoothFonts(context.get(), true);
+
+    bitmap.mask = !has_color_glyphs(line.get());
+    return bitmap;
+}
+
 static id<MTLTexture> alloc_texture(id<MTLDevice> device, size_t width,
                                     size_t height, size_t length) {
     MTLTextureDescriptor *desc = [[MTLTextureDescriptor alloc] init];
@@ -243,6 +288,12 @@ static id<MTLTexture> alloc_texture(id<MTLDevice> device, size_t width,
     desc.width = width;
     desc.height = height;
     desc.mipmapLevelCount = 1;
+
+    // Textures are written from the CPU with replaceRegion. With unified
+    // memory, shared storage avoids keeping a separate GPU copy in sync.
+    desc.storageMode = [device hasUnifiedMemory] ? MTLStorageModeShared :
+                                                   MTLStorageModeManaged;
+
     return [device newTextureWithDescriptor:desc];
 }
 
@@ -271,6 +322,9 @@ glyph_texture_cache::glyph_texture_cache(id<MTLCommandQueue> queue, size_t width
 ///              To resize the cache page array without copying, allocate
 ///              a new texture instead.
 void glyph_texture_cache::realloc(size_t new_page_count, size_t begin, size_t count) {
+    // Pending copies target the old texture, they must land before we copy it.
+    commit();
+
     id<MTLTexture> new_texture = alloc_texture(device, x_size, y_size, new_page_count);
     id<MTLCommandBuffer> commandBuffer = [queue commandBuffer];
     id<MTLBlitCommandEncoder> blitEncoder = [commandBuffer blitCommandEncoder];
@@ -291,113 +345,267 @@ void glyph_texture_cache::realloc(size_t new_page_count, size_t begin, size_t co
     page_count = new_page_count;
 }
 
-size_t glyph_texture_cache::evict(size_t preserve) {
-    if (preserve == 0) {
-        texture = alloc_texture(device, x_size, y_size, 1);
-        page_count = 1;
-        page_index = 0;
-        x_used = 0;
-        y_used = 0;
-        return 0;
-    }
+void glyph_texture_cache::clear() {
+    commit();
+    texture = alloc_texture(device, x_size, y_size, 1);
+    page_count = 1;
+    page_index = 0;
+    x_used = 0;
+    y_used = 0;
+    row_height = 0;
+}
 
-    if (preserve < page_index) {
-        size_t begin = page_index - preserve + 1;
-        realloc(preserve, begin, preserve);
-        page_index = preserve - 1;
-        return begin;
-    }
+void glyph_texture_cache::compact(const std::vector<size_t> &pages, size_t capacity) {
+    assert(pages.size() && pages.back() == page_index);
+    commit();
 
-    if (preserve > page_index) {
-        realloc(page_index, 0, page_index);
-        return 0;
+    capacity = std::max(capacity, pages.size());
+    id<MTLTexture> new_texture = alloc_texture(device, x_size, y_size, capacity);
+    id<MTLCommandBuffer> commandBuffer = [queue commandBuffer];
+    id<MTLBlitCommandEncoder> blitEncoder = [commandBuffer blitCommandEncoder];
+
+    for (size_t i=0; i<pages.size(); ++i) {
+        [blitEncoder copyFromTexture:texture
+                         sourceSlice:pages[i]
+                         sourceLevel:0
+                           toTexture:new_texture
+                    destinationSlice:i
+                    destinationLevel:0
+                          sliceCount:1
+                          levelCount:1];
     }
 
-    return 0;
+    [blitEncoder endEncoding];
+    [commandBuffer commit];
+
+    // The current page is preserved as the last page, so the current row and
+    // its position are still valid.
+    texture = new_texture;
+    page_count = capacity;
+    page_index = pages.size() - 1;
 }
 
-/// Add the bitmap to the cache on a new cache page.
+/// Allocates space for a glyph on a new cache page.
 /// Resizes the underlying Metal texture if needed.
-simd_short3 glyph_texture_cache::add_new_page(const glyph_bitmap &bitmap) {
+simd_short3 glyph_texture_cache::allocate_new_page(size_t width, size_t height) {
     page_index += 1;
 
     if (page_index >= page_count) {
         size_t new_page_count = ceil((double)page_count * growth_factor);
-        realloc(std::max(page_index, new_page_count), 0, page_count);
+        realloc(std::max(page_index + 1, new_page_count), 0, page_count);
     }
 
-    x_used = std::min((size_t)bitmap.width + 1, x_size);
-    y_used = std::min((size_t)bitmap.height, y_size);
-    row_height = y_used;
-    
-    [texture replaceRegion:MTLRegionMake2D(0, 0, x_used, y_used)
-               mipmapLevel:0
-                     slice:page_index
-                 withBytes:bitmap.buffer
-               bytesPerRow:bitmap.stride
-             bytesPerImage:0];
-    
+    x_used = width + 1;
+    y_used = 0;
+    row_height = height;
     return simd_short3{0, 0, (int16_t)page_index};
 }
 
-simd_short3 glyph_texture_cache::add(const glyph_bitmap &bitmap) {
-    size_t glyph_height = bitmap.height;
-    size_t glyph_width  = bitmap.width;
-
-    row_height = std::max(glyph_height, row_height);
+/// Allocates space for a width x height glyph.
+/// Precondition: width <= x_size && height <= y_size.
+simd_short3 glyph_texture_cache::allocate(size_t width, size_t height) {
+    row_height = std::max(height, row_height);
 
     for (;;) {
-        size_t newx = glyph_width + x_used;
+        size_t newx = width + x_used;
         size_t newy = row_height + y_used;
 
         if (newx <= x_size && newy <= y_size) {
-            [texture replaceRegion:MTLRegionMake2D(x_used, y_used, glyph_width, glyph_height)
-                       mipmapLevel:0
-                             slice:page_index
-                         withBytes:bitmap.buffer
-                       bytesPerRow:bitmap.stride
-                     bytesPerImage:0];
-
             simd_short3 origin;
             origin.x = x_used;
             origin.y = y_used;
             origin.z = page_index;
-        
+
             x_used = newx + 1;
             return origin;
         }
 
         y_used = y_used + row_height + 1;
         x_used = 0;
-        row_height = glyph_height;
+        row_height = height;
 
-        if (glyph_width > x_size || glyph_height + y_used > y_size) {
-            return add_new_page(bitmap);
+        if (height + y_used > y_size) {
+            return allocate_new_page(width, height);
         }
     }
 }
 
+simd_short3 glyph_texture_cache::add(const glyph_bitmap &bitmap) {
+    // Glyphs larger than a cache page are clipped.
+    size_t glyph_width  = std::min((size_t)bitmap.width, x_size);
+    size_t glyph_height = std::min((size_t)bitmap.height, y_size);
+    simd_short3 origin = allocate(glyph_width, glyph_height);
+
+    [texture replaceRegion:MTLRegionMake2D(origin.x, origin.y, glyph_width, glyph_height)
+               mipmapLevel:0
+                     slice:origin.z
+                 withBytes:bitmap.buffer
+               bytesPerRow:bitmap.stride
+             bytesPerImage:0];
+
+    return origin;
+}
+
+simd_short3 glyph_texture_cache::copy(id<MTLTexture> source,
+                                      simd_short3 origin, simd_short2 size) {
+    size_t glyph_width  = std::min((size_t)size.x, x_size);
+    size_t glyph_height = std::min((size_t)size.y, y_size);
+    simd_short3 dest = allocate(glyph_width, glyph_height);
+
+    if (glyph_width == 0 || glyph_height == 0) {
+        return dest;
+    }
+
+    if (!copy_encoder) {
+        copy_buffer = [queue commandBuffer];
+        copy_encoder = [copy_buffer blitCommandEncoder];
+    }
+
+    [copy_encoder copyFromTexture:source
+                      sourceSlice:origin.z
+                      sourceLevel:0
+                     sourceOrigin:MTLOriginMake(origin.x, origin.y, 0)
+                       sourceSize:MTLSizeMake(glyph_width, glyph_height, 1)
+                        toTexture:texture
+                 destinationSlice:dest.z
+                 destinationLevel:0
+                destinationOrigin:MTLOriginMake(dest.x, dest.y, 0)];
+
+    return dest;
+}
+
+void glyph_texture_cache::commit() {
+    if (copy_encoder) {
+        [copy_encoder endEncoding];
+        [copy_buffer commit];
+        copy_encoder = nil;
+        copy_buffer = nil;
+    }
+}
+
 void glyph_manager::do_evict() {
-    size_t evicted = texture_cache.evict(evict_preserve);
+    evict_due = false;
+    evict_generation += 1;
 
-    if (evicted == 0) {
-        if (evict_preserve == 0) {
-            map.clear();
-        }
+    memo = memo_type();
 
+    if (evict_preserve == 0) {
+        texture_cache.clear();
+        map.clear();
         return;
     }
 
-    glyph_map new_map;
-    new_map.reserve(map.size());
+    // A page is as recent as its most recently used glyph.
+    const size_t page_count = texture_cache.pages_size() + 1;
+    std::vector<uint64_t> page_used(page_count);
+
+    for (const glyph_entry &entry : map) {
+        uint64_t &used = page_used[entry.rect.texture_page];
+        used = std::max(used, entry.used);
+    }
 
-    for (const auto& [key, value] : map) {
-        if (value.texture_origin.z >= evicted) {
-            auto shifted = value;
-            shifted.texture_origin.z -= evicted;
-            new_map.emplace(key, shifted);
+    // Keep the most recently used pages. The current page is always kept,
+    // new glyphs are still being added to it.
+    std::vector<size_t> pages(page_count - 1);
+    std::iota(pages.begin(), pages.end(), 0);
+
+    size_t keep = std::min(evict_preserve - 1, pages.size());
+    std::nth_element(pages.begin(), pages.begin() + keep, pages.end(),
+                     [&](size_t left, size_t right) {
+        return page_used[left] > page_used[right];
+    });
+
+    pages.resize(keep);
+    std::sort(pages.begin(), pages.end());
+    pages.push_back(page_count - 1);
+
+    std::vector<int16_t> remap(page_count, -1);
+
+    for (size_t i=0; i<pages.size(); ++i) {
+        remap[pages[i]] = i;
+    }
+
+    // Leave room to copy hot glyphs off evicted pages, but stop short of
+    // the eviction threshold, so we don't end up evicting again right away.
+    id<MTLTexture> old_texture = texture_cache.metal_texture();
+    texture_cache.compact(pages, (evict_threshold + evict_preserve) / 2);
+
+    map.erase_if([&](glyph_entry &entry) {
+        int16_t page = remap[entry.rect.texture_page];
+
+        if (page >= 0) {
+            entry.rect.texture_page = page;
+            return false;
+        }
+
+        if (frame - entry.used < hot_frames &&
+            texture_cache.pages_size() + 1 < texture_cache.pages_capacity()) {
+            simd_short3 origin = {entry.rect.texture_origin.x,
+                                  entry.rect.texture_origin.y,
+                                  entry.rect.texture_page};
+
+            origin = texture_cache.copy(old_texture, origin, entry.rect.size);
+            entry.rect.texture_origin = origin.xy;
+            entry.rect.texture_page = origin.z;
+            return false;
+        }
+
+        return true;
+    });
+
+    texture_cache.commit();
+}
+
+/// Adds bitmap to the texture cache and describes the result in rect.
+void glyph_manager::set_rect(glyph_rect *rect, const glyph_bitmap &bitmap) {
+    auto texture_position = texture_cache.add(bitmap);
+
+    rect->texture_origin = texture_position.xy;
+    rect->texture_page = texture_position.z;
+    rect->mask = bitmap.mask;
+    rect->position.x = bitmap.left_bearing;
+    rect->position.y = -bitmap.ascent;
+    rect->size.x = bitmap.width;
+    rect->size.y = bitmap.height;
+}
+
+void glyph_manager::resolve() {
+    const size_t count = pending.size();
+    const size_t workers = std::min(rasterizers->size(), count);
+
+    // Each worker rasterizes every nth glyph with its own rasterizer. Bitmaps
+    // point into their rasterizer's canvas, so we copy them out before moving
+    // on to the next glyph. Only the texture cache upload is serial.
+    auto rasterize = ^(size_t worker) {
+        glyph_rasterizer &rasterizer = (*rasterizers)[worker];
+
+        for (size_t i=worker; i<count; i += workers) {
+            pending_glyph &glyph = pending[i];
+            std::string_view text(glyph.text.data(), glyph.text_size);
+
+            glyph_bitmap bitmap = masks ?
+                rasterizer.rasterize_mask(glyph.font, text) :
+                rasterizer.rasterize(glyph.font, glyph.background, glyph.foreground, text);
+
+            glyph.bitmap.assign(bitmap, glyph_rasterizer::pixel_size);
         }
+    };
+
+    if (workers > 1) {
+        dispatch_apply(workers, DISPATCH_APPLY_AUTO, rasterize);
+    } else if (workers == 1) {
+        rasterize(0);
+    }
+
+    for (pending_glyph &glyph : pending) {
+        set_rect(&map[glyph.index].rect, glyph.bitmap.bitmap);
+    }
+
+    for (const deferred_glyph &glyph : deferred) {
+        *glyph.dest = map[glyph.index].rect;
     }
 
-    map = std::move(new_map);
+    rasterized += count;
+    pending.clear();
+    deferred.clear();
 }
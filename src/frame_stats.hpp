@@ -0,0 +1,277 @@
+//
+//  Neovim Mac
+//  frame_stats.hpp
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#ifndef FRAME_STATS_HPP
+#define FRAME_STATS_HPP
+
+#include <time.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+/// Counters describing a single presented frame.
+struct frame_sample {
+    uint64_t time;            ///< When the frame was presented, in nanoseconds.
+    uint64_t cells;           ///< Grid cells visited while encoding.
+    uint64_t glyph_hits;      ///< Glyph lookups found in the cache.
+    uint64_t glyph_misses;    ///< Glyph lookups deferred to resolve().
+    uint64_t rasterized;      ///< Glyphs rasterized.
+    uint64_t upload_bytes;    ///< Bytes passed to mtlbuffer::update().
+    uint64_t cache_pages;     ///< Glyph cache pages in use.
+    uint64_t evictions;       ///< Glyph cache evictions so far.
+    uint64_t present_latency; ///< Time from the grid's flush to the frame's
+                              ///< presentation, in nanoseconds.
+    uint64_t rpc_received;    ///< Bytes received from Neovim so far.
+    uint64_t rpc_sent;        ///< Bytes sent to Neovim so far.
+    uint64_t rpc_events;      ///< RPC messages and redraw events so far.
+};
+
+/// A summary of the recent frame samples.
+/// Per frame values are means over the summarized samples.
+struct frame_stats_summary {
+    size_t frames;                ///< Frames summarized.
+    double seconds;               ///< Time spanned by the summarized frames.
+    double cells;                 ///< Cells visited per frame.
+    double glyph_hits;            ///< Glyph cache hits per frame.
+    double glyph_misses;          ///< Glyph cache misses per frame.
+    double rasterized;            ///< Glyphs rasterized per frame.
+    double upload_bytes;          ///< Bytes uploaded per frame.
+    uint64_t cache_pages;         ///< Glyph cache pages in use.
+    uint64_t evictions;           ///< Glyph cache evictions so far.
+    double present_mean;          ///< Mean flush to present latency in ms.
+    double present_max;           ///< Max flush to present latency in ms.
+    double rpc_received_per_sec;  ///< Bytes received per second.
+    double rpc_sent_per_sec;      ///< Bytes sent per second.
+    double rpc_events_per_sec;    ///< RPC messages and redraw events per second.
+    uint64_t flushes;             ///< Flush events received so far.
+    uint64_t refreshes;           ///< Display refreshes seen so far.
+    uint64_t presented;           ///< Frames presented so far.
+};
+
+/// Records hot path counters of the renderer and the RPC connection.
+///
+/// Frames push a frame_sample into a fixed size ring, overwriting the oldest
+/// sample. RPC counters are running totals, updated with relaxed atomics, and
+/// sampled into each frame so rates can be computed over the ring. Nothing
+/// here takes a lock, all member functions are safe to call from any thread.
+///
+/// Each ring slot is guarded by a sequence number, which is odd while the
+/// slot is being written. Readers skip slots that changed while they were
+/// being read.
+class frame_stats {
+public:
+    static constexpr size_t capacity = 128;
+
+private:
+    static constexpr size_t field_count = sizeof(frame_sample) / sizeof(uint64_t);
+    static_assert(sizeof(frame_sample) == field_count * sizeof(uint64_t));
+
+    struct slot {
+        std::atomic<uint64_t> sequence;
+        std::array<std::atomic<uint64_t>, field_count> fields;
+    };
+
+    std::array<slot, capacity> slots = {};
+    std::atomic<uint64_t> pushed = 0;
+    std::atomic<uint64_t> rpc_received = 0;
+    std::atomic<uint64_t> rpc_sent = 0;
+    std::atomic<uint64_t> rpc_events = 0;
+    std::atomic<uint64_t> flushes = 0;
+    std::atomic<uint64_t> refreshes = 0;
+    std::atomic<bool> overlay = false;
+
+    bool read_slot(size_t index, frame_sample &sample) const {
+        const slot &s = slots[index % capacity];
+        uint64_t sequence = s.sequence.load(std::memory_order_acquire);
+
+        if (sequence & 1) {
+            return false;
+        }
+
+        uint64_t values[field_count];
+
+        for (size_t i=0; i<field_count; ++i) {
+            values[i] = s.fields[i].load(std::memory_order_relaxed);
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (s.sequence.load(std::memory_order_relaxed) != sequence) {
+            return false;
+        }
+
+        memcpy(&sample, values, sizeof(sample));
+        return true;
+    }
+
+public:
+    /// Returns the current time in nanoseconds.
+    static uint64_t now() {
+        return clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    }
+
+    /// Adds to the bytes and events received from Neovim.
+    void received(size_t size, size_t events) {
+        rpc_received.fetch_add(size, std::memory_order_relaxed);
+        rpc_events.fetch_add(events, std::memory_order_relaxed);
+    }
+
+    /// Adds size bytes to the bytes sent to Neovim.
+    void sent(size_t size) {
+        rpc_sent.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    /// Counts a flush event. Flushes outnumber presented frames when bursts
+    /// of flushes are coalesced into a single frame.
+    void flushed() {
+        flushes.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /// Counts a display refresh seen while frames were scheduled.
+    void refreshed() {
+        refreshes.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /// True if the stats overlay should be drawn.
+    bool overlay_enabled() const {
+        return overlay.load(std::memory_order_relaxed);
+    }
+
+    /// Toggles the stats overlay. Returns the new state.
+    bool toggle_overlay() {
+        bool enabled = overlay.load(std::memory_order_relaxed);
+        while (!overlay.compare_exchange_weak(enabled, !enabled, std::memory_order_relaxed));
+        return !enabled;
+    }
+
+    /// Pushes a frame's sample, filling in its RPC totals.
+    void push(frame_sample sample) {
+        sample.rpc_received = rpc_received.load(std::memory_order_relaxed);
+        sample.rpc_sent = rpc_sent.load(std::memory_order_relaxed);
+        sample.rpc_events = rpc_events.load(std::memory_order_relaxed);
+
+        uint64_t values[field_count];
+        memcpy(values, &sample, sizeof(sample));
+
+        slot &s = slots[pushed.fetch_add(1, std::memory_order_relaxed) % capacity];
+        uint64_t sequence = s.sequence.load(std::memory_order_relaxed);
+
+        s.sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        for (size_t i=0; i<field_count; ++i) {
+            s.fields[i].store(values[i], std::memory_order_relaxed);
+        }
+
+        s.sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    /// Copies up to max of the most recent samples into samples, oldest first.
+    /// @returns The number of samples copied.
+    size_t recent(frame_sample *samples, size_t max) const {
+        uint64_t end = pushed.load(std::memory_order_acquire);
+        uint64_t begin = end - std::min<uint64_t>({end, max, capacity});
+        size_t count = 0;
+
+        for (uint64_t i=begin; i<end; ++i) {
+            count += read_slot(i, samples[count]);
+        }
+
+        return count;
+    }
+
+    /// Summarizes the most recent samples.
+    frame_stats_summary summary() const {
+        std::array<frame_sample, capacity> samples;
+        size_t count = recent(samples.data(), capacity);
+
+        frame_stats_summary summary = {};
+        summary.frames = count;
+        summary.flushes = flushes.load(std::memory_order_relaxed);
+        summary.refreshes = refreshes.load(std::memory_order_relaxed);
+        summary.presented = pushed.load(std::memory_order_relaxed);
+
+        if (!count) {
+            return summary;
+        }
+
+        size_t latencies = 0;
+
+        for (size_t i=0; i<count; ++i) {
+            const frame_sample &sample = samples[i];
+            summary.cells += sample.cells;
+            summary.glyph_hits += sample.glyph_hits;
+            summary.glyph_misses += sample.glyph_misses;
+            summary.rasterized += sample.rasterized;
+            summary.upload_bytes += sample.upload_bytes;
+
+            if (sample.present_latency) {
+                double latency = sample.present_latency / 1e6;
+                summary.present_mean += latency;
+                summary.present_max = std::max(summary.present_max, latency);
+                latencies += 1;
+            }
+        }
+
+        summary.cells /= count;
+        summary.glyph_hits /= count;
+        summary.glyph_misses /= count;
+        summary.rasterized /= count;
+        summary.upload_bytes /= count;
+
+        if (latencies) {
+            summary.present_mean /= latencies;
+        }
+
+        const frame_sample &first = samples[0];
+        const frame_sample &last = samples[count - 1];
+        summary.cache_pages = last.cache_pages;
+        summary.evictions = last.evictions;
+        summary.seconds = (last.time - first.time) / 1e9;
+
+        if (summary.seconds > 0) {
+            summary.rpc_received_per_sec = (last.rpc_received - first.rpc_received) / summary.seconds;
+            summary.rpc_sent_per_sec = (last.rpc_sent - first.rpc_sent) / summary.seconds;
+            summary.rpc_events_per_sec = (last.rpc_events - first.rpc_events) / summary.seconds;
+        }
+
+        return summary;
+    }
+
+    /// Returns the summary as a JSON object.
+    std::string json() const {
+        frame_stats_summary s = summary();
+        char buffer[1024];
+
+        snprintf(buffer, sizeof(buffer),
+                 "{\"frames\":%zu,\"seconds\":%.3f,\"cells\":%.1f,"
+                 "\"glyph_hits\":%.1f,\"glyph_misses\":%.1f,\"rasterized\":%.1f,"
+                 "\"upload_bytes\":%.1f,\"cache_pages\":%llu,\"evictions\":%llu,"
+                 "\"present_mean_ms\":%.3f,\"present_max_ms\":%.3f,"
+                 "\"rpc_received_per_sec\":%.1f,\"rpc_sent_per_sec\":%.1f,"
+                 "\"rpc_events_per_sec\":%.1f,\"flushes\":%llu,"
+                 "\"refreshes\":%llu,\"presented\":%llu}",
+                 s.frames, s.seconds, s.cells,
+                 s.glyph_hits, s.glyph_misses, s.rasterized,
+                 s.upload_bytes, (unsigned long long)s.cache_pages,
+                 (unsigned long long)s.evictions,
+                 s.present_mean, s.present_max,
+                 s.rpc_received_per_sec, s.rpc_sent_per_sec,
+                 s.rpc_events_per_sec, (unsigned long long)s.flushes,
+                 (unsigned long long)s.refreshes, (unsigned long long)s.presented);
+
+        return buffer;
+    }
+};
+
+#endif // FRAME_STATS_HPP
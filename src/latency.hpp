@@ -0,0 +1,155 @@
+//
+//  Neovim Mac
+//  latency.hpp
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#ifndef LATENCY_HPP
+#define LATENCY_HPP
+
+#include <time.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include "unfair_lock.hpp"
+
+/// Stages of keypress to photon latency.
+/// Every stage is measured from the key press that caused it.
+enum class latency_stage : size_t {
+    input,   ///< The key press was written to the RPC write buffer.
+    flush,   ///< The first flush event following the key press arrived.
+    encode,  ///< A frame containing the flush was encoded.
+    present, ///< The frame's command buffer completed.
+};
+
+/// Percentiles of a stage's recent samples, in nanoseconds.
+struct latency_summary {
+    size_t samples;
+    uint64_t p50;
+    uint64_t p99;
+};
+
+/// Tracks keypress to photon latency.
+///
+/// Only the first key press not yet followed by a flush is tracked through
+/// the later stages, further key presses are coalesced into the same frame.
+/// The most recent samples of each stage are kept, from which percentiles are
+/// computed. All member functions are safe to call from any thread.
+class latency_tracker {
+public:
+    static constexpr size_t stage_count = 4;
+    static constexpr size_t max_samples = 512;
+
+private:
+    struct stage_samples {
+        std::array<uint64_t, max_samples> durations;
+        size_t count;
+        size_t next;
+    };
+
+    unfair_lock lock;
+    std::array<stage_samples, stage_count> stages = {};
+    std::atomic<uint64_t> pending_input = 0;
+
+public:
+    /// Returns the current time in nanoseconds.
+    static uint64_t now() {
+        return clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    }
+
+    static const char* stage_name(latency_stage stage) {
+        switch (stage) {
+            case latency_stage::input:   return "Input";
+            case latency_stage::flush:   return "Flush";
+            case latency_stage::encode:  return "Encode";
+            case latency_stage::present: return "Present";
+        }
+    }
+
+    /// Records a key press that happened at time, once it's been written.
+    void input(uint64_t time) {
+        uint64_t expected = 0;
+        pending_input.compare_exchange_strong(expected, time);
+        record(latency_stage::input, time);
+    }
+
+    /// Returns the time of the first key press not yet followed by a flush,
+    /// and clears it. Returns zero if there is no such key press.
+    uint64_t take_input() {
+        return pending_input.exchange(0);
+    }
+
+    /// Records the latency of the given stage for the key press at time.
+    /// Key presses timestamped after now are skipped.
+    void record(latency_stage stage, uint64_t input_time) {
+        uint64_t time = now();
+
+        if (input_time > time) {
+            return;
+        }
+
+        uint64_t duration = time - input_time;
+
+        std::lock_guard guard(lock);
+        stage_samples &samples = stages[static_cast<size_t>(stage)];
+        samples.durations[samples.next] = duration;
+        samples.next = (samples.next + 1) % max_samples;
+        samples.count = std::min(samples.count + 1, max_samples);
+    }
+
+    /// Returns the p50 and p99 latencies of the given stage.
+    latency_summary summary(latency_stage stage) {
+        std::array<uint64_t, max_samples> durations;
+        size_t count;
+
+        {
+            std::lock_guard guard(lock);
+            const stage_samples &samples = stages[static_cast<size_t>(stage)];
+            durations = samples.durations;
+            count = samples.count;
+        }
+
+        if (!count) {
+            return latency_summary{};
+        }
+
+        auto begin = durations.begin();
+        auto end = begin + count;
+
+        auto p50 = begin + (count - 1) * 50 / 100;
+        std::nth_element(begin, p50, end);
+        uint64_t p50_value = *p50;
+
+        auto p99 = begin + (count - 1) * 99 / 100;
+        std::nth_element(begin, p99, end);
+
+        return latency_summary{count, p50_value, *p99};
+    }
+
+    /// Returns a human readable report of every stage, one stage per line.
+    std::string report() {
+        std::string report;
+
+        for (size_t i = 0; i < stage_count; ++i) {
+            latency_stage stage = static_cast<latency_stage>(i);
+            latency_summary stats = summary(stage);
+
+            char line[128];
+            snprintf(line, sizeof(line), "%-8s p50 %7.2f ms  p99 %7.2f ms  (%zu samples)\n",
+                     stage_name(stage), stats.p50 / 1e6, stats.p99 / 1e6, stats.samples);
+
+            report += line;
+        }
+
+        return report;
+    }
+};
+
+#endif // LATENCY_HPP
@@ -0,0 +1,99 @@
+//
+//  Neovim Mac
+//  message_queue.hpp
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#ifndef MESSAGE_QUEUE_HPP
+#define MESSAGE_QUEUE_HPP
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+/// A lock free queue of packed messages.
+///
+/// Any number of threads may push messages. A single consumer takes every
+/// queued message at once, in the order they were pushed. Pushing never
+/// blocks, each message is copied into its own heap allocated node, and
+/// nodes are linked onto an atomic list head.
+class message_queue {
+private:
+    struct node {
+        node *next;
+        size_t size;
+
+        char* data() {
+            return reinterpret_cast<char*>(this + 1);
+        }
+    };
+
+    std::atomic<node*> head = nullptr;
+
+    static void free_list(node *list) {
+        while (list) {
+            node *next = list->next;
+            free(list);
+            list = next;
+        }
+    }
+
+public:
+    message_queue() = default;
+    message_queue(const message_queue&) = delete;
+    message_queue& operator=(const message_queue&) = delete;
+
+    ~message_queue() {
+        free_list(head.exchange(nullptr));
+    }
+
+    /// Queues a copy of size bytes at data.
+    /// @returns True if the queue was empty, i.e. the consumer needs waking.
+    bool push(const void *data, size_t size) {
+        node *message = static_cast<node*>(malloc(sizeof(node) + size));
+        message->size = size;
+        memcpy(message->data(), data, size);
+
+        node *expected = head.load(std::memory_order_relaxed);
+
+        do {
+            message->next = expected;
+        } while (!head.compare_exchange_weak(expected, message,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed));
+
+        return expected == nullptr;
+    }
+
+    /// Takes every queued message, and calls consume(data, size) with each
+    /// message, oldest first. Only one thread may drain the queue.
+    template<typename Consumer>
+    void drain(Consumer &&consume) {
+        node *list = head.exchange(nullptr, std::memory_order_acquire);
+
+        if (!list) {
+            return;
+        }
+
+        // The list is newest first, reverse it.
+        node *ordered = nullptr;
+
+        while (list) {
+            node *next = list->next;
+            list->next = ordered;
+            ordered = list;
+            list = next;
+        }
+
+        for (node *message = ordered; message; message = message->next) {
+            consume(message->data(), message->size);
+        }
+
+        free_list(ordered);
+    }
+};
+
+#endif // MESSAGE_QUEUE_HPP
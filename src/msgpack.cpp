@@ -496,6 +496,11 @@ unpack_object: // Label avoids excess indentation
                 break;
             }
 
+            if (char *borrowed = promise.borrow_bytes(length)) {
+                obj->emplace<binary>((unsigned char*)borrowed, length);
+                break;
+            }
+
             auto *data = new (allocator) unsigned char[length];
             obj->emplace<binary>(data, length);
             co_await promise.read_bytes(data, length);
@@ -508,6 +513,11 @@ unpack_object: // Label avoids excess indentation
                 break;
             }
 
+            if (char *borrowed = promise.borrow_bytes(length)) {
+                obj->emplace<extension>(borrowed, length);
+                break;
+            }
+
             auto *data = new (allocator) char[length];
             obj->emplace<extension>(data, length);
             co_await promise.read_bytes(data, length);
@@ -520,6 +530,11 @@ unpack_object: // Label avoids excess indentation
                 break;
             }
 
+            if (char *borrowed = promise.borrow_bytes(length)) {
+                obj->emplace<string>(borrowed, length);
+                break;
+            }
+
             auto *data = new (allocator) char[length];
             obj->emplace<string>(data, length);
             co_await promise.read_bytes(data, length);
@@ -568,6 +583,148 @@ unpack_object: // Label avoids excess indentation
     goto unpack_object;
 }
 
+// Reads a big endian length of type T from data.
+template<typename T>
+static size_t read_length(const unsigned char *data) {
+    T storage;
+    memcpy(&storage, data, sizeof(T));
+    return byteswap(storage);
+}
+
+size_t object_scanner::scan(const void *data, size_t size) {
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+
+    // Each iteration skips the header and payload of one object. Arrays and
+    // maps add their elements to the number of objects remaining.
+    while (remaining && offset < size) {
+        const unsigned char byte = bytes[offset];
+        const unsigned char *next = bytes + offset + 1;
+        const size_t available = size - offset - 1;
+
+        size_t header = 1;
+        size_t payload = 0;
+        size_t children = 0;
+
+        // Headers with a length field need the whole field to be available.
+        auto length_field = [&](size_t field_size) {
+            header += field_size;
+            return available >= field_size;
+        };
+
+        switch (byte) {
+            case 0x00 ... 0x7f:
+            case 0xc0 ... 0xc3:
+            case 0xe0 ... 0xff:
+                break;
+
+            case 0x80 ... 0x8f:
+                children = (byte & 0b00001111u) * 2;
+                break;
+
+            case 0x90 ... 0x9f:
+                children = byte & 0b00001111u;
+                break;
+
+            case 0xa0 ... 0xbf:
+                payload = byte & 0b00011111u;
+                break;
+
+            case 0xc4:
+            case 0xd9:
+                if (!length_field(1)) return 0;
+                payload = read_length<uint8_t>(next);
+                break;
+
+            case 0xc5:
+            case 0xda:
+                if (!length_field(2)) return 0;
+                payload = read_length<uint16_t>(next);
+                break;
+
+            case 0xc6:
+            case 0xdb:
+                if (!length_field(4)) return 0;
+                payload = read_length<uint32_t>(next);
+                break;
+
+            case 0xc7:
+                if (!length_field(1)) return 0;
+                payload = 1 + read_length<uint8_t>(next);
+                break;
+
+            case 0xc8:
+                if (!length_field(2)) return 0;
+                payload = 1 + read_length<uint16_t>(next);
+                break;
+
+            case 0xc9:
+                if (!length_field(4)) return 0;
+                payload = 1 + read_length<uint32_t>(next);
+                break;
+
+            case 0xcc:
+            case 0xd0:
+                payload = 1;
+                break;
+
+            case 0xcd:
+            case 0xd1:
+                payload = 2;
+                break;
+
+            case 0xca:
+            case 0xce:
+            case 0xd2:
+                payload = 4;
+                break;
+
+            case 0xcb:
+            case 0xcf:
+            case 0xd3:
+                payload = 8;
+                break;
+
+            case 0xd4 ... 0xd8:
+                payload = 1 + (1 << (byte - 0xd4));
+                break;
+
+            case 0xdc:
+                if (!length_field(2)) return 0;
+                children = read_length<uint16_t>(next);
+                break;
+
+            case 0xdd:
+                if (!length_field(4)) return 0;
+                children = read_length<uint32_t>(next);
+                break;
+
+            case 0xde:
+                if (!length_field(2)) return 0;
+                children = read_length<uint16_t>(next) * 2;
+                break;
+
+            case 0xdf:
+                if (!length_field(4)) return 0;
+                children = read_length<uint32_t>(next) * 2;
+                break;
+        }
+
+        offset += header + payload;
+        remaining += children;
+        remaining -= 1;
+    }
+
+    // The last payload may extend past the end of data.
+    if (remaining || offset > size) {
+        return 0;
+    }
+
+    size_t object_size = offset;
+    offset = 0;
+    remaining = 1;
+    return object_size;
+}
+
 std::optional<integer> unpack_integer(const void *data, size_t length) {
     if (length == 0) {
         return std::nullopt;
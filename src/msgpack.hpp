@@ -261,6 +261,16 @@ struct object : std::variant<msg::invalid,
     T& get() {
         return std::get<T>(*this);
     }
+
+    /// Precondition: this->is<T>() returns true.
+    /// Unlike get(), the held type is not checked. Use when the type has
+    /// already been checked, for example by comparing index().
+    template<typename T>
+    const T& get_unchecked() const {
+        const T *ptr = std::get_if<T>(this);
+        if (!ptr) __builtin_unreachable();
+        return *ptr;
+    }
                                  
     template<typename T>
     T* get_if() {
@@ -330,6 +340,7 @@ public:
     // @field length    Size of the input buffer.
     // @field waitbuff  Pointer to the destination of an outstanding copy.
     // @field waitlen   Size of the outstanding copy.
+    // @field borrow    True if objects may refer to the input buffer.
     class promise_type {
     private:
         object *obj;
@@ -337,13 +348,15 @@ public:
         size_t length;
         char *waitbuff;
         size_t waitlen;
+        bool borrow;
 
         promise_type():
             obj(nullptr),
             buffer(nullptr),
             length(0),
             waitbuff(nullptr),
-            waitlen(0) {}
+            waitlen(0),
+            borrow(false) {}
 
         unpacker get_return_object() noexcept {
             return unpacker(this, handle_type::from_promise(*this));
@@ -395,6 +408,21 @@ public:
 
         auto read_bytes(void *dest, size_t size);
 
+        // Returns a pointer to the next size bytes of the input buffer if
+        // borrowing is allowed and the bytes are available, else nullptr.
+        char* borrow_bytes(size_t size) {
+            if (!borrow || length < size) {
+                return nullptr;
+            }
+
+            // Objects are non owning views, they hold mutable pointers, but
+            // never write through them.
+            char *bytes = const_cast<char*>(buffer);
+            buffer += size;
+            length -= size;
+            return bytes;
+        }
+
         template<typename T>
         auto read_numeric();
 
@@ -449,6 +477,22 @@ public:
         assert(!promise->length && "Not completely unpacked");
         promise->buffer = static_cast<const char*>(buffer);
         promise->length = length;
+        promise->borrow = false;
+    }
+
+    /// Feed an input buffer of complete objects to the unpacker.
+    /// Unlike feed(), strings, binaries, and extensions are not copied, the
+    /// unpacked objects refer to the input buffer directly. The input buffer
+    /// must remain valid and unmodified until unpack() returns nullptr.
+    ///
+    /// Precondition: The previous input buffer has been exhausted, and the
+    /// unpacker is not part way through an object.
+    /// @see object_scanner for finding complete objects in a byte stream.
+    void feed_borrowed(const void *buffer, size_t length) {
+        assert(!promise->length && "Not completely unpacked");
+        promise->buffer = static_cast<const char*>(buffer);
+        promise->length = length;
+        promise->borrow = true;
     }
 
     /// Unpacks any data that was previously fed to the unpacker.
@@ -468,6 +512,40 @@ public:
     }
 };
 
+/// Finds the boundaries of MessagePack objects in a byte stream.
+///
+/// Scanning is resumable. If the scanned data ends part way through an object,
+/// the scanner remembers how far it got. The next call to scan() must pass the
+/// same data, with any newly received bytes appended, and scanning continues
+/// from where it left off. Example:
+///
+///     msg::object_scanner scanner;
+///
+///     while (size_t size = scanner.scan(buffer.data(), buffer.size())) {
+///         use_object(buffer.data(), size);
+///         buffer.consume(size);
+///     }
+///
+/// Scanning only decodes headers, it's much cheaper than unpacking.
+class object_scanner {
+private:
+    size_t offset;
+    size_t remaining;
+
+public:
+    object_scanner(): offset(0), remaining(1) {}
+
+    /// True if the last call to scan() stopped part way through an object.
+    bool in_progress() const {
+        return offset != 0;
+    }
+
+    /// Scans data for the end of the object it begins with.
+    /// @returns The size of the object in bytes if data contains the whole
+    ///          object, otherwise 0.
+    size_t scan(const void *data, size_t size);
+};
+
 /// One shot unpacking of integer types.
 ///
 /// @param data     Pointer to input buffer. Should contain a packed
@@ -614,6 +692,11 @@ public:
         buffer.clear();
     }
 
+    /// Appends size bytes of already packed MessagePack data.
+    void pack_raw(const void *data, size_t size) {
+        buffer.insert(data, size);
+    }
+
     /// Explicitly pack a numeric value as PackType. This function does not
     /// optimize for the number of bytes it produces - it will always produce
     /// sizeof(T) + 1 bytes. This avoids some overhead.
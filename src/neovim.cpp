@@ -7,10 +7,13 @@
 //  See LICENSE.txt for details.
 //
 
+#include <pthread.h>
 #include <unistd.h>
 #include <spawn.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <os/signpost.h>
 #include <limits>
 #include <thread>
 
@@ -151,21 +154,36 @@ process::process() {
     queue = nullptr;
     read_source = nullptr;
     write_source = nullptr;
+    send_source = nullptr;
     read_fd = -1;
     write_fd = -1;
+    redraw_events = 0;
+    pending_mouse.count = 0;
+    replay_stop = nullptr;
     semaphore = dispatch_semaphore_create(0);
+    clipboard_group = dispatch_group_create();
 }
 
 process::~process() {
+    // Pending clipboard requests respond through this process.
+    dispatch_group_wait(clipboard_group, DISPATCH_TIME_FOREVER);
+    dispatch_release(clipboard_group);
+
+    if (replay_stop) {
+        dispatch_release(replay_stop);
+    }
+
     if (!queue) return;
 
     assert(dispatch_source_testcancel(read_source));
     assert(dispatch_source_testcancel(write_source));
+    assert(dispatch_source_testcancel(send_source));
     assert(read_fd != -1 && write_fd != -1);
 
     dispatch_release(queue);
     dispatch_release(read_source);
     dispatch_release(write_source);
+    dispatch_release(send_source);
     dispatch_release(semaphore);
     close(read_fd);
 
@@ -223,6 +241,77 @@ int process::connect(std::string_view addr) {
     return io_init(sock, sock);
 }
 
+int process::record(const char *path) {
+    capture = std::make_unique<capture_writer>();
+    return capture->open(path);
+}
+
+int process::replay(const char *path) {
+    auto reader = std::make_unique<capture_reader>();
+
+    if (int ec = reader->open(path)) return ec;
+
+    unnamed_pipe read_pipe;
+
+    if (int ec = read_pipe.open()) return ec;
+
+    file_descriptor null_device(open("/dev/null", O_WRONLY | O_CLOEXEC));
+
+    if (!null_device) {
+        return errno;
+    }
+
+    replay_stop = dispatch_semaphore_create(0);
+    dispatch_retain(replay_stop);
+
+    // The replay thread writes received records to the pipe at the time they
+    // were received. Closing the pipe's write end looks like Neovim exiting.
+    std::thread([reader = std::move(reader),
+                 pipe = std::move(read_pipe.write_end),
+                 stop = replay_stop]() {
+        dispatch_time_t start = dispatch_time(DISPATCH_TIME_NOW, 0);
+
+        while (auto record = reader->next()) {
+            if (record->direction != capture_direction::received) {
+                continue;
+            }
+
+            if (!dispatch_semaphore_wait(stop, dispatch_time(start, record->time))) {
+                break;
+            }
+
+            const char *data = record->data.data();
+            size_t remaining = record->data.size();
+
+            while (remaining) {
+                ssize_t bytes = write(pipe.get(), data, remaining);
+
+                if (bytes == -1) {
+                    if (errno == EINTR) continue;
+                    break;
+                }
+
+                data += bytes;
+                remaining -= bytes;
+            }
+
+            if (remaining) {
+                break;
+            }
+        }
+
+        dispatch_release(stop);
+    }).detach();
+
+    return io_init(read_pipe.read_end.release(), null_device.release());
+}
+
+void process::stop_replay() {
+    if (replay_stop) {
+        dispatch_semaphore_signal(replay_stop);
+    }
+}
+
 /// Initializes and starts the IO loop.
 /// Creates the dispatch queue, dispatch sources and response handler table.
 ///
@@ -233,6 +322,10 @@ int process::connect(std::string_view addr) {
 /// The read source is activated immediately and is never suspended.
 /// The write source is only active while there is data waiting to be written.
 ///
+/// Outgoing messages are queued by any thread without locking, the send
+/// source wakes the queue to move them into the write buffer. Only the queue
+/// touches the write buffer and the write source.
+///
 /// @param readfd   Read file descriptor.
 /// @param writefd  Write file descriptor.
 ///
@@ -263,8 +356,12 @@ int process::io_init(int readfd, int writefd) {
     write_source = dispatch_source_create(
         DISPATCH_SOURCE_TYPE_WRITE, writefd, 0, queue);
 
+    send_source = dispatch_source_create(
+        DISPATCH_SOURCE_TYPE_DATA_OR, 0, 0, queue);
+
     dispatch_set_context(read_source, this);
     dispatch_set_context(write_source, this);
+    dispatch_set_context(send_source, this);
 
     dispatch_source_set_event_handler_f(read_source, [](void *context) {
         static_cast<process*>(context)->io_can_read();
@@ -274,6 +371,10 @@ int process::io_init(int readfd, int writefd) {
         static_cast<process*>(context)->io_can_write();
     });
 
+    dispatch_source_set_event_handler_f(send_source, [](void *context) {
+        static_cast<process*>(context)->io_can_send();
+    });
+
     dispatch_source_set_cancel_handler_f(read_source, [](void *context) {
         process *ptr = static_cast<process*>(context);
         ptr->ui.shutdown();
@@ -286,39 +387,208 @@ int process::io_init(int readfd, int writefd) {
     });
 
     dispatch_resume(read_source);
+    dispatch_resume(send_source);
     read_state = dispatch_source_state::resumed;
     write_state = dispatch_source_state::suspended;
 
     return 0;
 }
 
+namespace {
+
+enum class header_match {
+    mismatched,
+    incomplete,
+    matched
+};
+
+struct redraw_header {
+    header_match match;
+    size_t length;
+    size_t event_count;
+};
+
+} // namespace
+
+/// Matches the start of data against the header of a redraw notification,
+/// [2, "redraw", [events...]], up to and including the events array header.
+/// Anything other than the encoding Neovim uses is left for on_rpc_message.
+static redraw_header match_redraw_header(const char *data, size_t size) {
+    static constexpr char prefix[] = "\x93\x02\xa6redraw";
+    static constexpr size_t prefix_size = sizeof(prefix) - 1;
+
+    const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data);
+    size_t compared = std::min(size, prefix_size);
+
+    if (memcmp(data, prefix, compared) != 0) {
+        return {header_match::mismatched, 0, 0};
+    }
+
+    if (size <= prefix_size) {
+        return {header_match::incomplete, 0, 0};
+    }
+
+    unsigned char byte = bytes[prefix_size];
+    size_t available = size - prefix_size - 1;
+
+    if (byte >= 0x90 && byte <= 0x9f) {
+        return {header_match::matched, prefix_size + 1, byte & 0b00001111u};
+    }
+
+    if (byte == 0xdc || byte == 0xdd) {
+        size_t field_size = byte == 0xdc ? 2 : 4;
+
+        if (available < field_size) {
+            return {header_match::incomplete, 0, 0};
+        }
+
+        size_t count = 0;
+
+        for (size_t i=0; i<field_size; ++i) {
+            count = (count << 8) | bytes[prefix_size + 1 + i];
+        }
+
+        return {header_match::matched, prefix_size + 1 + field_size, count};
+    }
+
+    return {header_match::mismatched, 0, 0};
+}
+
 void process::io_can_read() {
-    ssize_t bytes = read(read_fd, read_buffer, sizeof(read_buffer));
+    // We read at least this many bytes at a time, and drain at most this many
+    // bytes per callback, so a flood of output can't starve the queue.
+    static constexpr size_t min_read_size = 16384;
+    static constexpr size_t max_read_size = 1024 * 1024;
+
+    // The read source's data is an estimate of the number of bytes waiting.
+    // If more arrives while we're reading, FIONREAD lets us know.
+    size_t available = dispatch_source_get_data(read_source);
+    size_t total = 0;
+
+    do {
+        read_buffer.reserve(read_buffer.size() + std::max(available, min_read_size));
+        ssize_t bytes = read(read_fd, read_buffer.end(), read_buffer.space());
+
+        if (bytes <= 0) {
+            if (bytes == -1) {
+                return io_error();
+            }
+
+            ui.window.close();
+            return io_cancel();
+        }
 
-    if (bytes <= 0) {
-        if (bytes == -1) {
-            return io_error();
+        if (capture) {
+            capture->record(capture_direction::received, read_buffer.end(), bytes);
         }
 
-        ui.window.close();
-        return io_cancel();
+        read_buffer.commit(bytes);
+        total += bytes;
+
+        int pending = 0;
+        ioctl(read_fd, FIONREAD, &pending);
+        available = std::max(pending, 0);
+    } while (available && total < max_read_size);
+
+    // Only whole objects are unpacked, in place, from the read buffer. An
+    // object that's still arriving stays in the buffer until it's complete.
+    //
+    // Redraw notifications are streamed. Their events are unpacked and
+    // handled one at a time, as soon as each one arrives, so a large redraw
+    // batch never has to be unpacked in full.
+    const char *data = read_buffer.data();
+    size_t size = read_buffer.size();
+    size_t complete = 0;
+    size_t events = 0;
+
+    while (complete < size) {
+        const char *object = data + complete;
+        size_t available = size - complete;
+
+        if (redraw_events) {
+            size_t length = scanner.scan(object, available);
+            if (!length) break;
+
+            unpacker.feed_borrowed(object, length);
+
+            while (msg::object *event = unpacker.unpack()) {
+                ui.redraw_event(*event);
+            }
+
+            complete += length;
+            events += 1;
+
+            if (--redraw_events == 0) {
+                ui.redraw_end();
+            }
+
+            continue;
+        }
+
+        if (!scanner.in_progress()) {
+            auto [match, length, count] = match_redraw_header(object, available);
+
+            if (match == header_match::incomplete) {
+                break;
+            }
+
+            if (match == header_match::matched) {
+                complete += length;
+                redraw_events = count;
+
+                if (count) {
+                    ui.redraw_begin();
+                }
+
+                continue;
+            }
+        }
+
+        size_t length = scanner.scan(object, available);
+        if (!length) break;
+
+        unpacker.feed_borrowed(object, length);
+
+        while (msg::object *obj = unpacker.unpack()) {
+            on_rpc_message(*obj);
+        }
+
+        complete += length;
+        events += 1;
     }
 
-    unpacker.feed(read_buffer, bytes);
+    read_buffer.consume(complete);
+    ui.stats.received(total, events);
+}
 
-    while (msg::object *obj = unpacker.unpack()) {
-        on_rpc_message(*obj);
+void process::io_can_send() {
+    outbound.drain([this](const char *data, size_t size) {
+        packer.pack_raw(data, size);
+    });
+
+    if (packer.size() && write_state == dispatch_source_state::suspended) {
+        dispatch_resume(write_source);
+        write_state = dispatch_source_state::resumed;
     }
 }
 
 void process::io_can_write() {
-    std::lock_guard lock(write_lock);
+    // Pick up anything queued since the send source last fired.
+    outbound.drain([this](const char *data, size_t size) {
+        packer.pack_raw(data, size);
+    });
+
     ssize_t bytes = write(write_fd, packer.data(), packer.size());
 
     if (bytes == -1) {
         return io_error();
     }
 
+    if (capture) {
+        capture->record(capture_direction::sent, packer.data(), bytes);
+    }
+
+    ui.stats.sent(bytes);
     packer.consume(bytes);
 
     if (!packer.size()) {
@@ -340,6 +610,7 @@ void process::io_cancel() {
         }
 
         dispatch_source_cancel(write_source);
+        dispatch_source_cancel(send_source);
         write_state = dispatch_source_state::cancelled;
     }
 }
@@ -440,12 +711,35 @@ void process::on_rpc_request(msg::array array) {
     msg::string name = array[2].get<msg::string>();
     msg::array args = array[3].get<msg::array>();
 
+    // A replayed Neovim process doesn't read responses, and its requests
+    // shouldn't have side effects, like changing the clipboard.
+    if (is_replaying()) {
+        return;
+    }
+
+    // Clipboard requests respond from the clipboard queue, large clipboards
+    // shouldn't hold up redraws.
     if (name == "clipboard_set") {
-        clipboard_set(args);
-        return rpc_respond(msgid, nullptr, nullptr);
+        return clipboard_set(args, clipboard_group, [this, msgid] {
+            rpc_respond(msgid, nullptr, nullptr);
+        });
     } else if (name == "clipboard_get") {
-        auto data = clipboard_get();
-        return rpc_respond(msgid, nullptr, data);
+        return clipboard_get(clipboard_group, [this, msgid](const clipboard_data &data) {
+            rpc_respond(msgid, nullptr, data);
+        });
+    } else if (name == "latency_stats") {
+        return rpc_respond(msgid, nullptr, ui.latency.report());
+    } else if (name == "glyph_cache_stats") {
+        return ui.window.glyph_cache_report([this, msgid](std::string_view report) {
+            rpc_respond(msgid, nullptr, report);
+        });
+    } else if (name == "frame_stats") {
+        return rpc_respond(msgid, nullptr, ui.stats.json());
+    } else if (name == "stats_overlay") {
+        // Draw a frame, so the overlay shows or hides straight away.
+        bool enabled = ui.stats.toggle_overlay();
+        ui.window.redraw();
+        return rpc_respond(msgid, nullptr, enabled);
     }
 
     rpc_respond(msgid, "Unknown method", nullptr);
@@ -454,39 +748,79 @@ void process::on_rpc_request(msg::array array) {
                 msg::to_string(args).c_str());
 }
 
+/// Returns the calling thread's scratch packer. Messages are packed into
+/// scratch space, then copied to the outbound queue whole.
+static msg::packer& scratch_packer() {
+    static thread_local msg::packer scratch;
+    return scratch;
+}
+
+/// Queues every message packed into scratch, and wakes the RPC queue if it
+/// isn't already going to drain the outbound queue.
+void process::send(msg::packer &scratch) {
+    bool was_empty = outbound.push(scratch.data(), scratch.size());
+    scratch.clear();
+
+    if (was_empty) {
+        dispatch_source_merge_data(send_source, 1);
+    }
+}
+
+template<typename ...Args>
+void process::pack_request(msg::packer &scratch, uint32_t msgid,
+                           std::string_view method, const Args& ...args) {
+    scratch.start_array(4);
+    scratch.pack_uint64(0);
+    scratch.pack_uint64(msgid);
+    scratch.pack_string(method);
+    scratch.start_array(sizeof...(Args));
+    (scratch.pack(args), ...);
+}
+
+/// Packs the pending mouse event, if any. Main thread only.
+void process::pack_pending_mouse(msg::packer &scratch) {
+    pending_mouse_event &pending = pending_mouse;
+
+    // Neovim's API has no repeat count, nvim_input_mouse takes one event. So
+    // merged wheel steps are still sent as count separate requests, and Neovim
+    // still handles each step. Merging only saves our per event work, packing
+    // and queueing each step and waking the RPC queue for it, and sends the
+    // steps in a single write.
+    for (size_t i=0; i<pending.count; ++i) {
+        pack_request(scratch, null_msgid, "nvim_input_mouse", pending.button,
+                     pending.action, pending.modifiers, 0, pending.row, pending.col);
+    }
+
+    pending.count = 0;
+}
+
 template<typename ...Args>
 void process::rpc_request(uint32_t msgid,
                           std::string_view method, const Args& ...args) {
-    std::lock_guard lock(write_lock);
+    msg::packer &scratch = scratch_packer();
 
-    packer.start_array(4);
-    packer.pack_uint64(0);
-    packer.pack_uint64(msgid);
-    packer.pack_string(method);
-    packer.start_array(sizeof...(Args));
-    (packer.pack(args), ...);
-
-    if (write_state == dispatch_source_state::suspended) {
-        dispatch_resume(write_source);
-        write_state = dispatch_source_state::resumed;
+    // Held back mouse input must reach Neovim before any later request made
+    // on the main thread.
+    if (pthread_main_np() && pending_mouse.count) {
+        pack_pending_mouse(scratch);
     }
+
+    pack_request(scratch, msgid, method, args...);
+    send(scratch);
 }
 
 template<typename Error, typename Response>
 void process::rpc_respond(uint32_t msgid,
                           const Error &error, const Response &response) {
-    std::lock_guard lock(write_lock);
+    msg::packer &scratch = scratch_packer();
 
-    packer.start_array(4);
-    packer.pack_uint64(1);
-    packer.pack_uint64(msgid);
-    packer.pack(error);
-    packer.pack(response);
+    scratch.start_array(4);
+    scratch.pack_uint64(1);
+    scratch.pack_uint64(msgid);
+    scratch.pack(error);
+    scratch.pack(response);
 
-    if (write_state == dispatch_source_state::suspended) {
-        dispatch_resume(write_source);
-        write_state = dispatch_source_state::resumed;
-    }
+    send(scratch);
 }
 
 /// Packs a string into a uint64_t at compile time.
@@ -667,8 +1001,14 @@ void process::try_resize(size_t width, size_t height) {
     rpc_request(null_msgid, "nvim_ui_try_resize", width, height);
 }
 
-void process::input(std::string_view input) {
+void process::input(std::string_view input, uint64_t key_time) {
+    os_signpost_interval_begin(rpc, OS_SIGNPOST_ID_EXCLUSIVE, "Input");
     rpc_request(null_msgid, "nvim_input", input);
+    os_signpost_interval_end(rpc, OS_SIGNPOST_ID_EXCLUSIVE, "Input");
+
+    if (key_time) {
+        ui.latency.input(key_time);
+    }
 }
 
 void process::feedkeys(std::string_view keys) {
@@ -700,8 +1040,55 @@ void process::error_writeln(std::string_view error) {
 
 void process::input_mouse(std::string_view button, std::string_view action,
                           std::string_view modifiers, size_t row, size_t col) {
-    rpc_request(null_msgid, "nvim_input_mouse",
-                button, action, modifiers, 0, row, col);
+    pending_mouse_event &pending = pending_mouse;
+
+    bool is_wheel = button == "wheel";
+    bool is_mergeable = is_wheel || action == "drag";
+
+    if (is_mergeable && pending.count && pending.button == button &&
+        pending.action == action && pending.modifiers == modifiers) {
+        if (!is_wheel) {
+            pending.row = row;
+            pending.col = col;
+            return;
+        }
+
+        if (pending.row == row && pending.col == col) {
+            pending.count += 1;
+            return;
+        }
+    }
+
+    msg::packer &scratch = scratch_packer();
+    pack_pending_mouse(scratch);
+
+    if (is_mergeable) {
+        pending.button = button;
+        pending.action = action;
+        pending.modifiers = modifiers;
+        pending.row = row;
+        pending.col = col;
+        pending.count = 1;
+
+        if (scratch.size()) {
+            send(scratch);
+        }
+
+        return;
+    }
+
+    pack_request(scratch, null_msgid, "nvim_input_mouse",
+                 button, action, modifiers, 0, row, col);
+
+    send(scratch);
+}
+
+void process::flush_input() {
+    if (pending_mouse.count) {
+        msg::packer &scratch = scratch_packer();
+        pack_pending_mouse(scratch);
+        send(scratch);
+    }
 }
 
 void process::drop_text(const std::vector<std::string_view> &text) {
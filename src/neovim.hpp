@@ -13,9 +13,12 @@
 #include <dispatch/dispatch.h>
 #include <functional>
 #include <deque>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "capture.hpp"
+#include "message_queue.hpp"
 #include "msgpack.hpp"
 #include "unfair_lock.hpp"
 #include "ui.hpp"
@@ -204,6 +207,18 @@ private:
         }
     };
 
+    /// A mouse event that hasn't been sent yet. Consecutive drags replace
+    /// the pending drag, consecutive wheel steps in the same direction
+    /// increment its count.
+    struct pending_mouse_event {
+        std::string button;
+        std::string action;
+        std::string modifiers;
+        size_t row;
+        size_t col;
+        size_t count;
+    };
+
     /// Tracks the current state of dispatch_sources.
     enum class dispatch_source_state {
         resumed,
@@ -215,18 +230,28 @@ private:
     dispatch_queue_t queue;
     dispatch_source_t read_source;
     dispatch_source_t write_source;
+    dispatch_source_t send_source;
     dispatch_semaphore_t semaphore;
+    dispatch_group_t clipboard_group;
     dispatch_source_state read_state;
     dispatch_source_state write_state;
     int read_fd;
     int write_fd;
-    char read_buffer[16384];
+    circular_buffer read_buffer;
+    msg::object_scanner scanner;
+    size_t redraw_events;
     msg::packer packer;
     msg::unpacker unpacker;
-    unfair_lock write_lock;
+    message_queue outbound;
+    pending_mouse_event pending_mouse;
     response_handler_table *handler_table;
+    std::unique_ptr<capture_writer> capture;
+    dispatch_semaphore_t replay_stop;
 
     int  io_init(int readfd, int writefd);
+    void io_can_send();
+    void send(msg::packer &scratch);
+    void pack_pending_mouse(msg::packer &scratch);
     void io_can_read();
     void io_can_write();
     void io_error();
@@ -242,6 +267,10 @@ private:
     void on_rpc_request(msg::array obj);
     void on_rpc_notification(msg::array obj);
 
+    template<typename ...Args>
+    void pack_request(msg::packer &scratch, uint32_t id,
+                      std::string_view method, const Args& ...args);
+
     template<typename ...Args>
     void rpc_request(uint32_t id, std::string_view method, const Args& ...args);
 
@@ -301,6 +330,32 @@ public:
     /// @returns An errno code if an error occurred, 0 if no error occurred.
     int connect(std::string_view addr);
 
+    /// Records the session's raw RPC traffic to a capture file.
+    /// Must be called before spawn() or connect().
+    /// @param path Path to the new capture file.
+    /// @returns An errno code if an error occurred, 0 if no error occurred.
+    int record(const char *path);
+
+    /// Replays a capture file instead of connecting to a Neovim process.
+    ///
+    /// The bytes received during the captured session are fed back to the
+    /// process object with their original timing. Anything sent is discarded,
+    /// as are requests made by the captured Neovim process. Once every record
+    /// has been replayed, or stop_replay() is called, the replay behaves as if
+    /// Neovim exited.
+    ///
+    /// @param path Path to the capture file.
+    /// @returns An errno code if an error occurred, 0 if no error occurred.
+    int replay(const char *path);
+
+    /// Ends a replay early. Does nothing if not replaying.
+    void stop_replay();
+
+    /// True if the process object is replaying a capture file.
+    bool is_replaying() const {
+        return replay_stop != nullptr;
+    }
+
     /// Synchronously attaches to the remote UI process.
     /// @param width    Requested screen columns.
     /// @param height   Requested screen rows.
@@ -337,8 +392,21 @@ public:
 
     /// Calls API method nvim_input.
     /// Used for raw keyboard input. Input should be escaped.
-    /// @param input Keyboard input.
-    void input(std::string_view input);
+    /// @param input    Keyboard input.
+    /// @param key_time Time of the key press the input answers, or zero. The
+    ///                 key press's latency is tracked until its frame is
+    ///                 presented. @see latency_tracker::now().
+    void input(std::string_view input, uint64_t key_time = 0);
+
+    /// The keypress to photon latency tracker.
+    latency_tracker* latency() {
+        return &ui.latency;
+    }
+
+    /// The renderer and RPC counters.
+    frame_stats* stats() {
+        return &ui.stats;
+    }
 
     /// Calls API method nvim_feedkeys.
     /// Keys is assumed to contain CSI bytes. Keys are not remapped.
@@ -412,12 +480,23 @@ public:
     /// @param row      Mouse row position.
     /// @param col      Mouse column position.
     ///
+    /// Drags and wheel events are held back until the next call to
+    /// flush_input(), or until any other request is made. A drag replaces a
+    /// pending drag of the same button, and a wheel event is merged with a
+    /// pending wheel event in the same direction and position.
+    ///
     /// Note: All indexes are zero based.
     void input_mouse(std::string_view button,
                      std::string_view action,
                      std::string_view modifiers,
                      size_t row, size_t col);
 
+    /// Sends any held back mouse input.
+    /// Called once per run loop turn, so that input events handled in the
+    /// same turn are written with a single write.
+    /// Note: Mouse input and flush_input() must be called on the main thread.
+    void flush_input();
+
     /// Tests how many of the given files are currently open.
     /// @param paths    Absolute paths of the files to consider.
     /// @param timeout  The timeout for the request.
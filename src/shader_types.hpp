@@ -32,22 +32,39 @@ struct glyph_rect {
     /// Translation vector from the font baseline to the glyph's top left corner.
     simd_short2 position;
 
-    /// The texture position of the rasterized glyph's top left corner where:
-    ///   x - The x position in pixel coordinates.
-    ///   y - The y position in pixel coordinates.
-    ///   z - The cache page the glyph is on.
-    simd_short3 texture_origin;
+    /// The texture position of the rasterized glyph's top left corner in
+    /// pixel coordinates.
+    simd_short2 texture_origin;
+
+    /// The cache page the glyph is on.
+    int16_t texture_page;
+
+    /// Non zero if the glyph is a coverage mask that should be tinted with the
+    /// glyph color. Zero if the glyph was rasterized in color.
+    uint16_t mask;
 };
 
 struct glyph_data {
     simd_short2 grid_position;
     uint32_t cell_width;
+    uint32_t color;
     glyph_rect rect;
 
     glyph_data() = default;
 
-    glyph_data(simd_short2 grid_position, uint32_t cell_width, glyph_rect rect):
-        grid_position(grid_position), cell_width(cell_width), rect(rect) {}
+    /// Constructs a new glyph_data object.
+    /// @param grid_position    The grid position of the glyph. The row is
+    ///                         informational, glyphs are drawn on the row of
+    ///                         the row slot they're stored in.
+    /// @param cell_width       The width of the glyph's cell in cells.
+    /// @param color            The tint color, only used for mask glyphs.
+    /// @param rect             The cached glyph.
+    glyph_data(simd_short2 grid_position, uint32_t cell_width,
+               uint32_t color, glyph_rect rect):
+        grid_position(grid_position),
+        cell_width(cell_width),
+        color(color),
+        rect(rect) {}
 };
 
 struct line_metrics {
@@ -61,9 +78,9 @@ struct line_metrics {
     uint16_t thickness;
 };
 
-/// Describes an underline, undercurl, or a strikethrough.
-/// Lines have the same width as cells. Adjacent line_data objects as used to
-/// draw continuous lines that are longer than a cell.
+/// Describes a run of underline, undercurl, or strikethrough.
+/// A run covers adjacent cells of a row with the same line style and color.
+/// Each run is drawn as a single quad, length cells wide.
 struct line_data {
     simd_short2 grid_position;
     uint32_t color;
@@ -71,19 +88,21 @@ struct line_data {
     uint16_t period;
     uint16_t thickness;
     uint16_t count;
+    uint16_t length;
 
     line_data() = default;
 
-    /// Constructs a new line_data object.
-    /// @param grid_position    The grid position of the line.
+    /// Constructs a new line_data object, one cell long.
+    /// @param grid_position    The grid position of the run's first cell.
     /// @param color            The color of the line.
     /// @param metrics          The line's metrics.
-    /// @param count            The position of the cell in the overall line.
+    /// @param count            The position of the run in the overall line.
     ///
-    /// The count paramter is a zero based index of the cell's position in the
-    /// overall line. For example, given the 5th cell in a row with an underline
-    /// stretching from the 4th cell to the 8th, count would be 1. This is
-    /// required to correctly render dotted lines. For solid lines, pass 0.
+    /// The count paramter is a zero based index of the run's first cell in the
+    /// overall line. For example, given a run starting at the 5th cell in a
+    /// row with an undercurl stretching from the 4th cell to the 8th, count
+    /// would be 1. This is required to correctly render dotted lines that
+    /// change color part way. For solid lines, pass 0.
     line_data(simd_short2 grid_position, uint32_t color,
               line_metrics metrics, uint16_t count = 0):
         grid_position(grid_position),
@@ -91,7 +110,8 @@ struct line_data {
         ytranslate(metrics.ytranslate),
         period(metrics.period),
         thickness(metrics.thickness),
-        count(count) {}
+        count(count),
+        length(1) {}
 };
 
 #endif // SHADER_TYPES_H
@@ -25,8 +25,10 @@ struct line_rasterizer_data {
 
 struct glyph_rasterizer_data {
     float4 position [[position]];
+    float4 color [[flat]];
     float2 texture_position;
-    uint32_t texture_index;
+    uint32_t texture_index [[flat]];
+    uint32_t mask [[flat]];
 };
 
 // Our vertex data represents rectangles as an origin + size tuple. To translate
@@ -47,11 +49,14 @@ constant float2 cursor_transforms[5][4] = {
     {{-1,  0}, {-1,  0}, { 0,  0}, { 0,  0}},
 };
 
+// Background and glyph data are stored in row slots. The grid row drawn from
+// each slot is given by the slot_rows table.
 vertex extern grid_rasterizer_data background_render(uint vertex_id [[vertex_id]],
                                                      uint instance_id [[instance_id]],
                                                      constant uniform_data &uniforms [[buffer(0)]],
-                                                     constant uint32_t *cell_colors [[buffer(1)]]) {
-    uint32_t row = instance_id / uniforms.grid_width;
+                                                     constant uint32_t *cell_colors [[buffer(1)]],
+                                                     constant uint16_t *slot_rows [[buffer(2)]]) {
+    uint32_t row = slot_rows[instance_id / uniforms.grid_width];
     uint32_t col = instance_id % uniforms.grid_width;
 
     float2 cell_vertex = float2(col, row) + transforms[vertex_id];
@@ -106,9 +111,9 @@ vertex extern line_rasterizer_data line_render(uint vertex_id [[vertex_id]],
     int16_t row = line.grid_position.y;
     int16_t col = line.grid_position.x;
 
-    // Lines have the same width as a cell.
+    // Line runs are a whole number of cells wide.
     // Their height is given by their thickness.
-    float2 line_size = float2(uniforms.cell_pixel_size.x, line.thickness);
+    float2 line_size = float2(uniforms.cell_pixel_size.x * line.length, line.thickness);
 
     // The offset of the line's top left corner in pixel coordinates.
     float2 line_offset = uniforms.cell_pixel_size * float2(col, row);
@@ -117,7 +122,7 @@ vertex extern line_rasterizer_data line_render(uint vertex_id [[vertex_id]],
     float2 pixel_position = line_offset + (line_size * transforms[vertex_id]);
     float2 position = float2(-1, 1) + (pixel_position * uniforms.pixel_size);
 
-    float line_position = line.count + transforms[vertex_id].x;
+    float line_position = line.count + (transforms[vertex_id].x * line.length);
     float period = uniforms.cell_pixel_size.x * line_position / line.period;
 
     line_rasterizer_data data;
@@ -130,10 +135,11 @@ vertex extern line_rasterizer_data line_render(uint vertex_id [[vertex_id]],
 vertex extern glyph_rasterizer_data glyph_render(uint vertex_id [[vertex_id]],
                                                  uint instance_id [[instance_id]],
                                                  constant uniform_data &uniforms [[buffer(0)]],
-                                                 constant glyph_data *glyphs [[buffer(1)]]) {
+                                                 constant glyph_data *glyphs [[buffer(1)]],
+                                                 constant uint16_t *slot_rows [[buffer(2)]]) {
     constant glyph_data &glyph = glyphs[instance_id];
     int16_t col = glyph.grid_position.x;
-    int16_t row = glyph.grid_position.y;
+    int16_t row = slot_rows[instance_id / uniforms.grid_width];
 
     // The position of the cell's top right corner in pixel coordinates.
     float2 cell_position = uniforms.cell_pixel_size * float2(col, row);
@@ -166,8 +172,10 @@ vertex extern glyph_rasterizer_data glyph_render(uint vertex_id [[vertex_id]],
 
     glyph_rasterizer_data data;
     data.position = float4(position.xy, 0, 1);
+    data.color = unpack_unorm4x8_srgb_to_float(glyph.color);
     data.texture_position = float2(glyph.rect.texture_origin.xy) + texture_offset;
-    data.texture_index = glyph.rect.texture_origin.z;
+    data.texture_index = glyph.rect.texture_page;
+    data.mask = glyph.rect.mask;
     return data;
 }
 
@@ -179,6 +187,9 @@ fragment float4 line_fill(line_rasterizer_data in [[stage_in]]) {
     return float4(in.color.rgb, select(0.0, 1.0, sinpi(in.period) > 0));
 }
 
+/// Outputs premultiplied colors.
+/// Color glyphs are stored premultiplied and are output as is. Mask glyphs
+/// store coverage in the alpha channel, which we tint with the glyph color.
 fragment float4 glyph_fill(glyph_rasterizer_data in [[stage_in]],
                            texture2d_array<float> texture [[texture(0)]]) {
     constexpr sampler texture_sampler(mag_filter::nearest,
@@ -186,5 +197,11 @@ fragment float4 glyph_fill(glyph_rasterizer_data in [[stage_in]],
                                       address::clamp_to_zero,
                                       coord::pixel);
 
-    return texture.sample(texture_sampler, in.texture_position, in.texture_index);
+    float4 sample = texture.sample(texture_sampler, in.texture_position, in.texture_index);
+
+    if (in.mask) {
+        return float4(in.color.rgb * sample.a, sample.a);
+    }
+
+    return sample;
 }
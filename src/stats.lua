@@ -0,0 +1,19 @@
+local client = vim.api.nvim_get_chan_info(1).client
+
+if (type(client) == "table" and client.name == "Neovim Mac") then
+    vim.api.nvim_create_user_command("NeovimMacStats", function()
+        print(vim.rpcrequest(1, "latency_stats"))
+    end, {})
+
+    vim.api.nvim_create_user_command("NeovimMacFrameStats", function()
+        print(vim.rpcrequest(1, "frame_stats"))
+    end, {})
+
+    vim.api.nvim_create_user_command("NeovimMacGlyphCacheStats", function()
+        print(vim.rpcrequest(1, "glyph_cache_stats"))
+    end, {})
+
+    vim.api.nvim_create_user_command("NeovimMacStatsOverlay", function()
+        vim.rpcrequest(1, "stats_overlay")
+    end, {})
+end
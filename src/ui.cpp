@@ -8,9 +8,12 @@
 //
 
 #include <algorithm>
+#include <cmath>
 #include <utility>
 #include <iostream>
+#include <tuple>
 #include <type_traits>
+#include <os/signpost.h>
 
 #include "log.h"
 #include "ui.hpp"
@@ -53,7 +56,7 @@ inline cell_attributes* hl_new_entry(highlight_table &table, size_t hlid) {
     }
 
     cell_attributes default_attrs = table[0];
-    table.resize(hlid, default_attrs);
+    table.resize(hlid + 1, default_attrs);
     return &table.back();
 }
 
@@ -64,12 +67,21 @@ void log_grid_out_of_bounds(const grid *grid, const char *event,
                       event, grid->width(), grid->height(), row, col);
 }
 
+template<typename T>
+struct is_optional : std::false_type {};
+
+template<typename T>
+struct is_optional<std::optional<T>> : std::true_type {};
+
 /// Type checking wrapper that:
 /// Allows narrowing integer conversions.
 /// Allows msg::object pass through.
+/// Allows std::optional<T> for trailing parameters that may be omitted.
 template<typename T>
 bool is(const msg::object &object) {
-    if constexpr (!std::is_same_v<T, msg::boolean> && std::is_integral_v<T>) {
+    if constexpr (is_optional<T>::value) {
+        return is<typename T::value_type>(object);
+    } else if constexpr (!std::is_same_v<T, msg::boolean> && std::is_integral_v<T>) {
         return object.is<msg::integer>();
     } else if constexpr (std::is_same_v<T, msg::object>) {
         return true;
@@ -83,7 +95,9 @@ bool is(const msg::object &object) {
 /// Allows msg::object pass through.
 template<typename T>
 T get(const msg::object &object) {
-    if constexpr (!std::is_same_v<T, msg::boolean> && std::is_integral_v<T>) {
+    if constexpr (is_optional<T>::value) {
+        return get<typename T::value_type>(object);
+    } else if constexpr (!std::is_same_v<T, msg::boolean> && std::is_integral_v<T>) {
         return object.get<msg::integer>().as<T>();
     } else if constexpr (std::is_same_v<T, msg::object>) {
         return object;
@@ -92,28 +106,143 @@ T get(const msg::object &object) {
     }
 }
 
+/// True if array has an argument of type T at index.
+/// Optional arguments may be missing.
+template<typename T>
+bool has_arg(const msg::array &array, size_t index) {
+    if (index < array.size()) {
+        return is<T>(array[index]);
+    }
+
+    return is_optional<T>::value;
+}
+
+/// Returns the argument of type T at the given index.
+/// Missing optional arguments are returned as std::nullopt.
+template<typename T>
+T get_arg(const msg::array &array, size_t index) {
+    if constexpr (is_optional<T>::value) {
+        if (index >= array.size()) {
+            return std::nullopt;
+        }
+    }
+
+    return get<T>(array[index]);
+}
+
 template<typename ...Ts, size_t ...Indexes>
 void call(ui_controller &controller,
           void(ui_controller::*member_function)(Ts...),
           const msg::array &array,
           std::integer_sequence<size_t, Indexes...>) {
-    (controller.*member_function)(get<Ts>(array[Indexes])...);
+    (controller.*member_function)(get_arg<Ts>(array, Indexes)...);
+}
+
+/// The index of alternative T in msg::object's variant.
+template<typename T, typename Variant = msg::object::variant_type>
+struct alternative_index;
+
+template<typename T, typename ...Alternatives>
+struct alternative_index<T, std::variant<Alternatives...>> {
+    static constexpr size_t find() {
+        constexpr bool matches[] = {std::is_same_v<T, Alternatives>...};
+
+        for (size_t i=0; i<sizeof...(Alternatives); ++i) {
+            if (matches[i]) return i;
+        }
+
+        return sizeof...(Alternatives);
+    }
+
+    static constexpr size_t value = find();
+    static_assert(value < sizeof...(Alternatives), "Not a msg::object type");
+};
+
+/// Accepts an object of any type.
+constexpr size_t any_alternative = SIZE_MAX;
+
+/// The variant index of an object accepted by is<T>(), or any_alternative.
+template<typename T>
+constexpr size_t expected_index() {
+    if constexpr (is_optional<T>::value) {
+        return expected_index<typename T::value_type>();
+    } else if constexpr (!std::is_same_v<T, msg::boolean> && std::is_integral_v<T>) {
+        return alternative_index<msg::integer>::value;
+    } else if constexpr (std::is_same_v<T, msg::object>) {
+        return any_alternative;
+    } else {
+        return alternative_index<T>::value;
+    }
+}
+
+/// Equivalent to get<T>(), without checking the object's type.
+/// Precondition: is<T>(object) returns true.
+template<typename T>
+T get_unchecked(const msg::object &object) {
+    if constexpr (is_optional<T>::value) {
+        return get_unchecked<typename T::value_type>(object);
+    } else if constexpr (!std::is_same_v<T, msg::boolean> && std::is_integral_v<T>) {
+        return object.get_unchecked<msg::integer>().as<T>();
+    } else if constexpr (std::is_same_v<T, msg::object>) {
+        return object;
+    } else {
+        return object.get_unchecked<T>();
+    }
+}
+
+/// True if array holds every argument of Ts, none of them omitted, in a
+/// single pass over the argument's variant indexes.
+template<typename ...Ts>
+bool has_all_args(const msg::array &array) {
+    // The trailing sentinel keeps the array non empty for zero arguments.
+    static constexpr size_t expected[] = {expected_index<Ts>()..., any_alternative};
+
+    if (array.size() < sizeof...(Ts)) {
+        return false;
+    }
+
+    for (size_t i=0; i<sizeof...(Ts); ++i) {
+        if (expected[i] != any_alternative && array[i].index() != expected[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/// Calls member function with arguments checked by has_all_args().
+template<typename ...Ts, size_t ...Indexes>
+void call_unchecked(ui_controller &controller,
+                    void(ui_controller::*member_function)(Ts...),
+                    const msg::array &array,
+                    std::integer_sequence<size_t, Indexes...>) {
+    (controller.*member_function)(get_unchecked<Ts>(array[Indexes])...);
 }
 
 /// Invokes member function with an array of arguments.
 /// If object is an array of objects whose types match the member function's
 /// signature, the member function is invoked. Otherwise a type error is logged.
+///
+/// Tuples that hold every argument are checked against the signature's
+/// variant indexes, and unpacked without further checks. Tuples that omit
+/// optional arguments, or don't match, take the argument by argument path.
 template<typename ...Ts>
 void apply_one(ui_controller *controller,
                void(ui_controller::*member_function)(Ts...),
                const msg::string &name, const msg::object &object) {
     if (object.is<msg::array>()) {
-        msg::array args = object.get<msg::array>();
-        
+        msg::array args = object.get_unchecked<msg::array>();
+
         constexpr size_t size = sizeof...(Ts);
+
+        if (has_all_args<Ts...>(args)) {
+            return call_unchecked(*controller, member_function, args,
+                                  std::make_integer_sequence<size_t, size>());
+        }
+
         size_t index = 0;
         
-        if (size <= args.size() && (is<Ts>(args[index++]) && ...)) {
+        if ((has_arg<Ts>(args, index++) && ...)) {
             return call(*controller, member_function, args,
                         std::make_integer_sequence<size_t, size>());
         }
@@ -138,13 +267,49 @@ void apply(ui_controller *controller,
 } // namespace
 
 grid* ui_controller::get_grid(size_t index) {
-    // We don't support ext_multigrid, so index should always be 1.
-    // If it isn't, we don't exaclty fail gracefully.
-    if (index != 1) {
-        std::abort();
+    // Without ext_multigrid, Neovim only ever draws to the global grid.
+    if (!ui_opts.ext_multigrid) {
+        if (index != 1) {
+            os_log_error(rpc, "Redraw error: Invalid grid - Grid=%zu", index);
+            return nullptr;
+        }
+
+        return writing;
     }
-    
-    return writing;
+
+    auto iter = windows.find(index);
+
+    if (iter == windows.end()) {
+        os_log_error(rpc, "Redraw error: Invalid grid - Grid=%zu", index);
+        return nullptr;
+    }
+
+    return &iter->second.grid;
+}
+
+ui_controller::grid_window* ui_controller::get_window(size_t grid, const char *event) {
+    auto iter = windows.find(grid);
+
+    if (iter == windows.end()) {
+        os_log_error(rpc, "Redraw error: Invalid grid - Event=%s, Grid=%zu",
+                     event, grid);
+        return nullptr;
+    }
+
+    return &iter->second;
+}
+
+/// Hashes a redraw event name. Usable at compile time.
+/// This is the 32 bit FNV-1a hash, it's cheap to compute and distinguishes
+/// every event name we handle.
+static constexpr uint32_t event_hash(std::string_view name) {
+    uint32_t hash = 2166136261u;
+
+    for (char c : name) {
+        hash = (hash ^ (unsigned char)c) * 16777619u;
+    }
+
+    return hash;
 }
 
 void ui_controller::redraw_event(const msg::object &event_object) {
@@ -161,56 +326,162 @@ void ui_controller::redraw_event(const msg::object &event_object) {
     msg::string name = event->at(0).get<msg::string>();
     msg::array args = event->subarray(1);
     
-    if (name == "grid_line") {
-        return apply(this, &ui_controller::grid_line, name, args);
-    } else if (name == "grid_resize") {
-        return apply(this, &ui_controller::grid_resize, name, args);
-    } else if (name == "grid_scroll") {
-        return apply(this, &ui_controller::grid_scroll, name, args);
-    } else if (name == "flush") {
-        return apply(this, &ui_controller::flush, name, args);
-    } else if (name == "grid_clear") {
-        return apply(this, &ui_controller::grid_clear, name, args);
-    } else if (name == "hl_attr_define") {
-        return apply(this, &ui_controller::hl_attr_define, name, args);
-    } else if (name == "default_colors_set") {
-        return apply(this, &ui_controller::default_colors_set, name, args);
-    } else if (name == "mode_info_set") {
-        return apply(this, &ui_controller::mode_info_set, name, args);
-    } else if (name == "mode_change") {
-        return apply(this, &ui_controller::mode_change, name, args);
-    } else if (name == "grid_cursor_goto") {
-        return apply(this, &ui_controller::grid_cursor_goto, name, args);
-    } else if (name == "set_title") {
-        return apply(this, &ui_controller::set_title, name, args);
-    } else if (name == "busy_start") {
-        return apply(this, &ui_controller::busy_start, name, args);
-    } else if (name == "busy_stop") {
-        return apply(this, &ui_controller::busy_stop, name, args);
-    }
-
-    // When options change, we should inform the delegate. Neovim tends to
-    // send redundant option change events, so only call the delegate if the
-    // options actually changed.
-    if (name == "option_set") {
-        std::lock_guard lock(option_lock);
-        ui_options oldopts = ui_opts;
-        apply(this, &ui_controller::set_option, name, args);
+    // We switch on a hash of the event name, and then confirm the match with
+    // a single string comparison. Colliding event names fail to compile, as
+    // they produce duplicate case labels.
+    switch (event_hash(name)) {
+        case event_hash("grid_line"):
+            if (name == "grid_line") {
+                return apply(this, &ui_controller::grid_line, name, args);
+            }
+            break;
 
-        if (ui_opts != oldopts && send_option_change()) {
-            window.options_set();
-        }
-        
-        return;
-    }
+        case event_hash("grid_resize"):
+            if (name == "grid_resize") {
+                return apply(this, &ui_controller::grid_resize, name, args);
+            }
+            break;
 
-    // The following events are ignored for now.
-    if (name == "mouse_on"     ||
-        name == "mouse_off"    ||
-        name == "set_icon"     ||
-        name == "hl_group_set" ||
-        name == "win_viewport" ) {
-        return;
+        case event_hash("grid_scroll"):
+            if (name == "grid_scroll") {
+                return apply(this, &ui_controller::grid_scroll, name, args);
+            }
+            break;
+
+        case event_hash("flush"):
+            if (name == "flush") {
+                return apply(this, &ui_controller::flush, name, args);
+            }
+            break;
+
+        case event_hash("grid_clear"):
+            if (name == "grid_clear") {
+                return apply(this, &ui_controller::grid_clear, name, args);
+            }
+            break;
+
+        case event_hash("hl_attr_define"):
+            if (name == "hl_attr_define") {
+                return apply(this, &ui_controller::hl_attr_define, name, args);
+            }
+            break;
+
+        case event_hash("default_colors_set"):
+            if (name == "default_colors_set") {
+                return apply(this, &ui_controller::default_colors_set, name, args);
+            }
+            break;
+
+        case event_hash("mode_info_set"):
+            if (name == "mode_info_set") {
+                return apply(this, &ui_controller::mode_info_set, name, args);
+            }
+            break;
+
+        case event_hash("mode_change"):
+            if (name == "mode_change") {
+                return apply(this, &ui_controller::mode_change, name, args);
+            }
+            break;
+
+        case event_hash("grid_cursor_goto"):
+            if (name == "grid_cursor_goto") {
+                return apply(this, &ui_controller::grid_cursor_goto, name, args);
+            }
+            break;
+
+        case event_hash("set_title"):
+            if (name == "set_title") {
+                return apply(this, &ui_controller::set_title, name, args);
+            }
+            break;
+
+        case event_hash("busy_start"):
+            if (name == "busy_start") {
+                return apply(this, &ui_controller::busy_start, name, args);
+            }
+            break;
+
+        case event_hash("busy_stop"):
+            if (name == "busy_stop") {
+                return apply(this, &ui_controller::busy_stop, name, args);
+            }
+            break;
+
+        case event_hash("grid_destroy"):
+            if (name == "grid_destroy") {
+                return apply(this, &ui_controller::grid_destroy, name, args);
+            }
+            break;
+
+        case event_hash("win_pos"):
+            if (name == "win_pos") {
+                return apply(this, &ui_controller::win_pos, name, args);
+            }
+            break;
+
+        case event_hash("win_float_pos"):
+            if (name == "win_float_pos") {
+                return apply(this, &ui_controller::win_float_pos, name, args);
+            }
+            break;
+
+        case event_hash("win_hide"):
+            if (name == "win_hide") {
+                return apply(this, &ui_controller::win_hide, name, args);
+            }
+            break;
+
+        // We don't support external windows, they're hidden instead.
+        case event_hash("win_external_pos"):
+            if (name == "win_external_pos") {
+                return apply(this, &ui_controller::win_hide, name, args);
+            }
+            break;
+
+        case event_hash("win_close"):
+            if (name == "win_close") {
+                return apply(this, &ui_controller::win_close, name, args);
+            }
+            break;
+
+        case event_hash("msg_set_pos"):
+            if (name == "msg_set_pos") {
+                return apply(this, &ui_controller::msg_set_pos, name, args);
+            }
+            break;
+
+        // When options change, we should inform the delegate. Neovim tends to
+        // send redundant option change events, so only call the delegate if
+        // the options actually changed.
+        case event_hash("option_set"):
+            if (name == "option_set") {
+                std::lock_guard lock(option_lock);
+                ui_options oldopts = ui_opts;
+                apply(this, &ui_controller::set_option, name, args);
+
+                if (ui_opts != oldopts && send_option_change()) {
+                    window.options_set();
+                }
+
+                return;
+            }
+            break;
+
+        // The following events are ignored for now.
+        case event_hash("mouse_on"):
+        case event_hash("mouse_off"):
+        case event_hash("set_icon"):
+        case event_hash("hl_group_set"):
+        case event_hash("win_viewport"):
+            if (name == "mouse_on"     ||
+                name == "mouse_off"    ||
+                name == "set_icon"     ||
+                name == "hl_group_set" ||
+                name == "win_viewport" ) {
+                return;
+            }
+            break;
     }
     
     os_log_info(rpc, "Redraw info: Unhandled event - Name=%.*s Args=%s",
@@ -218,119 +489,156 @@ void ui_controller::redraw_event(const msg::object &event_object) {
                 msg::to_string(args).c_str());
 }
 
+void ui_controller::redraw_begin() {
+    os_signpost_interval_begin(rpc, OS_SIGNPOST_ID_EXCLUSIVE, "Redraw");
+}
+
+void ui_controller::redraw_end() {
+    os_signpost_interval_end(rpc, OS_SIGNPOST_ID_EXCLUSIVE, "Redraw");
+}
+
 void ui_controller::redraw(msg::array events) {
+    redraw_begin();
+
     for (const msg::object &event : events) {
         redraw_event(event);
     }
+
+    redraw_end();
 }
 
 void ui_controller::grid_resize(size_t grid_id, size_t width, size_t height) {
-    grid *grid = get_grid(grid_id);
+    grid *grid;
+
+    // With ext_multigrid, grids are created by their first resize.
+    if (ui_opts.ext_multigrid) {
+        auto [iter, inserted] = windows.try_emplace(grid_id);
+        grid_window &layer = iter->second;
+
+        if (inserted) {
+            layer.row = 0;
+            layer.col = 0;
+            layer.floating = false;
+            layer.visible = grid_id == 1;
+            layer.zindex = grid_id == 1 ? -1 : 0;
+            layer.order = layout_order++;
+            layer.grid.graphemes = graphemes;
+        }
+
+        grid = &layer.grid;
+        layout_changed = true;
+    } else {
+        grid = get_grid(grid_id);
+    }
+
+    if (!grid) {
+        return;
+    }
+
     grid->grid_width = width;
     grid->grid_height = height;
     grid->cells.resize(width * height);
+    grid->mark_all_dirty();
+    release_graphemes();
 }
 
-template<typename ...Ts>
-static bool type_check(const msg::array &array) {
-    size_t index = 0;
-    return array.size() == sizeof...(Ts) && (array[index++].is<Ts>() && ...);
-}
-
-/// Represents a cell update from the grid_line event.
-struct cell_update {
-    msg::string text;
-    const cell_attributes *hlattr;
-    size_t repeat;
-    
-    cell_update(): hlattr(nullptr), repeat(0) {}
-
-    /// Set the cell_update from a msg::object.
-    /// @param object   An object from the cells array in a grid_line event.
-    /// @param hl_table  The highlight table.
-    /// @returns True if object type checked correctly, otherwise false.
-    bool set(const msg::object &object, const highlight_table &hl_table) {
-        if (!object.is<msg::array>()) {
-            return false;
-        }
-        
-        msg::array array = object.get<msg::array>();
-        
-        if (type_check<msg::string>(array)) {
-            text = array[0].get<msg::string>();
-            repeat = 1;
-            return true;
-        }
-        
-        if (type_check<msg::string, msg::integer>(array)) {
-            text = array[0].get<msg::string>();
-            hlattr = hl_get_entry(hl_table, array[1].get<msg::integer>());
-            repeat = 1;
-            return true;
-        }
-            
-        if (type_check<msg::string, msg::integer, msg::integer>(array)) {
-            text = array[0].get<msg::string>();
-            hlattr = hl_get_entry(hl_table, array[1].get<msg::integer>());
-            repeat = array[2].get<msg::integer>();
-            return true;
-        }
-        
-        return false;
-    }
-};
-
 void ui_controller::grid_line(size_t grid_id, size_t row,
                               size_t col, msg::array cells) {
     grid *grid = get_grid(grid_id);
+
+    if (!grid) {
+        return;
+    }
     
     if (row >= grid->height() || col >= grid->width()) {
         return log_grid_out_of_bounds(grid, "grid_line", row, col);
     }
     
-    cell *rowbegin = grid->get(row, 0);
-    cell *cell = rowbegin + col;
-    
-    size_t remaining = grid->width() - col;
-    cell_update update;
-    
+    packed_cell *rowbegin = grid->get(row, 0);
+    packed_cell *rowend = rowbegin + grid->width();
+    packed_cell *cell = rowbegin + col;
+
+    // Neovim omits the highlight ID if it's the same as the previous cell's.
+    uint16_t hlattr = 0;
+    grid->mark_dirty(row);
+
+    // grid_line makes up the bulk of redraw traffic, so rather than type
+    // checking each cell update against every possible form, we decode the
+    // cell updates in a single pass. Cell updates are arrays of the form:
+    // [text], [text, hl_id], or [text, hl_id, repeat].
     for (const msg::object &object : cells) {
-        if (!update.set(object, hl_table)) {
+        const msg::array *update = object.get_if<msg::array>();
+        const msg::string *text = nullptr;
+        const msg::integer *hlid = nullptr;
+        const msg::integer *repeat = nullptr;
+        size_t count = 1;
+
+        if (update && update->size() && update->size() <= 3) {
+            text = update->at(0).get_if<msg::string>();
+        }
+
+        if (text && update->size() >= 2) {
+            hlid = update->at(1).get_if<msg::integer>();
+            text = hlid ? text : nullptr;
+        }
+
+        if (hlid && update->size() == 3) {
+            repeat = update->at(2).get_if<msg::integer>();
+            text = repeat ? text : nullptr;
+        }
+
+        if (!text) {
             return os_log_error(rpc, "Redraw error: Cell update type error - "
                                      "Event=grid_line, Type=%s",
                                      msg::type_string(object).c_str());
         }
-        
-        if (update.repeat > remaining) {
+
+        // Cells store 16 bit highlight IDs. Larger IDs are rejected by
+        // hl_attr_define, so they refer to the default group.
+        if (hlid) {
+            uint64_t id = *hlid;
+            hlattr = id <= UINT16_MAX ? id : 0;
+        }
+
+        if (repeat) {
+            count = *repeat;
+        }
+
+        if (count > (size_t)(rowend - cell)) {
             return os_log_error(rpc, "Redraw error: Row overflow - "
                                      "Event=grid_line");
         }
 
         // Empty cells are the right cell of a double width char.
-        if (update.text.size() == 0) {
+        if (text->size() == 0) {
             // This should never happen. We'll be defensive about it.
             if (cell == rowbegin) {
                 return;
             }
             
-            nvim::cell *left = cell - 1;
-            left->attrs.flags |= cell_attributes::doublewidth;
-            cell->attrs = left->attrs;
-            cell->size = 0;
+            packed_cell *left = cell - 1;
+            left->flags |= cell_attributes::doublewidth;
+            *cell = packed_cell();
+            cell->hlid = left->hlid;
+            cell->flags = left->flags;
 
             // Double width chars never repeat.
             cell += 1;
-            remaining -= 1;
-        } else if (update.repeat > 0) {
-            const auto updated = nvim::cell(update.text, update.hlattr);
-            *cell = updated;
-
-            for (int i=1; i<update.repeat; ++i) {
-                cell[i] = updated;
+        } else if (count > 0) {
+            // Single byte text is always ASCII, which we can store without
+            // going through the general purpose constructor.
+            packed_cell updated;
+
+            if (text->size() == 1) {
+                char c = text->front();
+                updated.text = c == ' ' ? 0 : (uint8_t)c;
+                updated.hlid = hlattr;
+            } else {
+                updated = packed_cell(*text, hlattr, *graphemes);
             }
 
-            cell += update.repeat;
-            remaining -= update.repeat;
+            std::fill_n(cell, count, updated);
+            cell += count;
         }
     }
 }
@@ -338,16 +646,21 @@ void ui_controller::grid_line(size_t grid_id, size_t row,
 void ui_controller::grid_clear(size_t grid_id) {
     grid *grid = get_grid(grid_id);
 
-    cell empty;
-    empty.attrs.background = hl_table[0].background;
-
-    for (cell &cell : grid->cells) {
-        cell = empty;
+    if (!grid) {
+        return;
     }
+
+    std::fill(grid->cells.begin(), grid->cells.end(), packed_cell());
+    grid->mark_all_dirty();
+    release_graphemes();
 }
 
 void ui_controller::grid_cursor_goto(size_t grid_id, size_t row, size_t col) {
     grid *grid = get_grid(grid_id);
+
+    if (!grid) {
+        return;
+    }
     
     if (row >= grid->height() || col >= grid->width()) {
         return os_log_error(rpc, "Redraw error: Cursor out of bounds - "
@@ -358,6 +671,7 @@ void ui_controller::grid_cursor_goto(size_t grid_id, size_t row, size_t col) {
     
     grid->cursor_row = row;
     grid->cursor_col = col;
+    cursor_grid = grid_id;
 }
 
 void ui_controller::grid_scroll(size_t grid_id, size_t top, size_t bottom,
@@ -371,6 +685,11 @@ void ui_controller::grid_scroll(size_t grid_id, size_t top, size_t bottom,
     }
     
     grid *grid = get_grid(grid_id);
+
+    if (!grid) {
+        return;
+    }
+
     size_t height = bottom - top;
     size_t width = right - left;
     
@@ -380,7 +699,7 @@ void ui_controller::grid_scroll(size_t grid_id, size_t top, size_t bottom,
     
     long count;
     long row_width;
-    cell *dest;
+    packed_cell *dest;
     
     if (rows >= 0) {
         dest = grid->get(top, left);
@@ -392,14 +711,321 @@ void ui_controller::grid_scroll(size_t grid_id, size_t top, size_t bottom,
         count = height + rows;
     }
 
-    cell *src = dest + ((long)grid->width() * rows);
-    size_t copy_size = sizeof(cell) * width;
+    packed_cell *src = dest + ((long)grid->width() * rows);
+    size_t copy_size = sizeof(packed_cell) * width;
     
     for (long i=0; i<count; ++i) {
         memcpy(dest, src, copy_size);
         dest += row_width;
         src += row_width;
     }
+
+    // Full width scrolls are recorded as moves, so renderers can shift the
+    // rows they've already encoded instead of encoding the region again.
+    if (left == 0 && right == grid->width() && rows && count > 0) {
+        grid->mark_scrolled(top, bottom, rows);
+    } else {
+        grid->mark_dirty(top, bottom);
+    }
+}
+
+void ui_controller::grid_destroy(size_t grid) {
+    if (grid == 1) {
+        return os_log_error(rpc, "Redraw error: Invalid grid - "
+                                 "Event=grid_destroy, Grid=1");
+    }
+
+    windows.erase(grid);
+    layout_changed = true;
+}
+
+static bool has_interned(const grid &grid) {
+    const packed_cell *begin = grid.get(0, 0);
+    const packed_cell *end = begin + grid.cells_size();
+
+    return std::any_of(begin, end, [](const packed_cell &cell) {
+        return cell.interned();
+    });
+}
+
+// Interned graphemes are never removed, so the table only grows. Once a table
+// is large, we replace it whenever a clear or resize leaves no interned cells
+// in any grid we write to. Snapshots held by the renderer keep the old table.
+void ui_controller::release_graphemes() {
+    static constexpr size_t release_size = 65536;
+
+    if (graphemes->size() < release_size || has_interned(*writing)) {
+        return;
+    }
+
+    for (auto &[id, layer] : windows) {
+        if (has_interned(layer.grid)) {
+            return;
+        }
+    }
+
+    graphemes = std::make_shared<grapheme_table>();
+    writing->graphemes = graphemes;
+
+    for (auto &[id, layer] : windows) {
+        layer.grid.graphemes = graphemes;
+    }
+}
+
+void ui_controller::place_window(grid_window *layer, int64_t zindex) {
+    layer->visible = true;
+    layer->zindex = zindex;
+    layer->order = layout_order++;
+    layout_changed = true;
+}
+
+void ui_controller::win_pos(size_t grid, msg::object win, size_t row,
+                            size_t col, size_t width, size_t height) {
+    grid_window *layer = get_window(grid, "win_pos");
+
+    if (!layer) {
+        return;
+    }
+
+    // Neovim only sends win_pos when a window moves, but it's cheap to check.
+    if (layer->visible && !layer->floating &&
+        layer->row == (long)row && layer->col == (long)col) {
+        return;
+    }
+
+    layer->row = row;
+    layer->col = col;
+    layer->floating = false;
+    place_window(layer, 0);
+}
+
+void ui_controller::win_float_pos(size_t grid, msg::object win,
+                                  msg::string anchor, size_t anchor_grid,
+                                  double anchor_row, double anchor_col,
+                                  bool focusable, std::optional<int64_t> zindex) {
+    grid_window *layer = get_window(grid, "win_float_pos");
+
+    if (!layer) {
+        return;
+    }
+
+    // Anchors are one of "NW", "NE", "SW", or "SE". Floats are positioned
+    // relative to their anchor grid by layout().
+    layer->floating = true;
+    layer->anchor_grid = anchor_grid;
+    layer->anchor_row = anchor_row;
+    layer->anchor_col = anchor_col;
+    layer->anchor_north = anchor.size() < 1 || anchor[0] != 'S';
+    layer->anchor_west = anchor.size() < 2 || anchor[1] != 'E';
+
+    // Older versions of Neovim don't send a zindex, 50 is their default.
+    place_window(layer, zindex.value_or(50));
+}
+
+void ui_controller::win_hide(size_t grid) {
+    if (grid_window *layer = get_window(grid, "win_hide")) {
+        layer->visible = false;
+        layout_changed = true;
+    }
+}
+
+void ui_controller::win_close(size_t grid) {
+    if (grid_window *layer = get_window(grid, "win_close")) {
+        layer->visible = false;
+        layout_changed = true;
+    }
+}
+
+void ui_controller::msg_set_pos(size_t grid, size_t row,
+                                bool scrolled, msg::string sep) {
+    grid_window *layer = get_window(grid, "msg_set_pos");
+
+    if (!layer) {
+        return;
+    }
+
+    // The message grid spans the width of the screen, Neovim draws it above
+    // floats with a zindex of 200.
+    layer->row = row;
+    layer->col = 0;
+    layer->floating = false;
+    place_window(layer, 200);
+}
+
+void ui_controller::layout() {
+    layers.clear();
+
+    for (auto &[id, layer] : windows) {
+        if (layer.visible) {
+            layers.push_back(&layer);
+        }
+    }
+
+    std::sort(layers.begin(), layers.end(), [](const grid_window *left,
+                                               const grid_window *right) {
+        return std::tie(left->zindex, left->order) <
+               std::tie(right->zindex, right->order);
+    });
+
+    // Anchors are usually drawn below their floats, so they've already been
+    // positioned by the time we get to a float.
+    for (grid_window *layer : layers) {
+        if (!layer->floating) {
+            continue;
+        }
+
+        long row = std::lround(layer->anchor_row);
+        long col = std::lround(layer->anchor_col);
+        auto anchor = windows.find(layer->anchor_grid);
+
+        if (anchor != windows.end()) {
+            row += anchor->second.row;
+            col += anchor->second.col;
+        }
+
+        if (!layer->anchor_north) {
+            row -= layer->grid.height();
+        }
+
+        if (!layer->anchor_west) {
+            col -= layer->grid.width();
+        }
+
+        layer->row = row;
+        layer->col = col;
+    }
+}
+
+void ui_controller::compose() {
+    auto base = windows.find(1);
+
+    if (base == windows.end()) {
+        return;
+    }
+
+    grid *target = writing;
+    const grid &global = base->second.grid;
+
+    if (target->size() != global.size()) {
+        target->grid_width = global.width();
+        target->grid_height = global.height();
+        target->cells.resize(global.cells_size());
+        target->mark_all_dirty();
+        layout_changed = true;
+    }
+
+    if (layout_changed) {
+        layout();
+    }
+
+    // A row of the global grid is composed if any window covering it changed.
+    // Rows are composed bottom layer first, windows later in the layer order
+    // are drawn on top.
+    const long height = target->height();
+    const long width = target->width();
+    compose_rows.assign(height, layout_changed ? compose_dirty : compose_none);
+
+    for (auto layer = layers.begin(); layer != layers.end(); ++layer) {
+        const grid &grid = (*layer)->grid;
+        const long top = (*layer)->row;
+
+        // Scrolls of windows spanning the global grid are moves of the global
+        // grid too, so renderers can replay them. Rows drawn over by higher
+        // layers don't move with the window, they're marked as modified both
+        // before and after the moves, along with the rows they move to.
+        auto moves = grid.scroll_moves_since(grid.tick());
+        bool replay = !layout_changed && moves && moves->size() &&
+                      (*layer)->col == 0 && (long)grid.width() == width &&
+                      top >= 0 && top + (long)grid.height() <= height;
+
+        if (replay) {
+            auto covered = [&](long row) {
+                return std::any_of(layer + 1, layers.end(), [&](const grid_window *above) {
+                    return row >= above->row &&
+                           row < above->row + (long)above->grid.height() &&
+                           above->col < width &&
+                           above->col + (long)above->grid.width() > 0;
+                });
+            };
+
+            for (long row=top; row<top + (long)grid.height(); ++row) {
+                if (covered(row)) {
+                    target->mark_dirty(row);
+                    compose_rows[row] = compose_dirty;
+                }
+            }
+
+            for (const grid_scroll_move &move : *moves) {
+                target->mark_scrolled(top + move.top, top + move.bottom, move.rows);
+            }
+        }
+
+        for (size_t row=0; row<grid.height(); ++row) {
+            long target_row = top + (long)row;
+
+            if (target_row < 0 || target_row >= height ||
+                grid.row_tick(row) <= grid.tick()) {
+                continue;
+            }
+
+            compose_state &compose = compose_rows[target_row];
+
+            if (replay && grid.content_tick(row) <= grid.tick()) {
+                compose = std::max(compose, compose_moved);
+            } else {
+                compose = compose_dirty;
+            }
+        }
+    }
+
+    for (long row=0; row<height; ++row) {
+        if (compose_rows[row] == compose_none) {
+            continue;
+        }
+
+        for (const grid_window *layer : layers) {
+            long grid_row = row - layer->row;
+
+            if (grid_row < 0 || grid_row >= (long)layer->grid.height()) {
+                continue;
+            }
+
+            long begin = std::max(layer->col, 0l);
+            long end = std::min(layer->col + (long)layer->grid.width(), width);
+
+            if (begin < end) {
+                memcpy(target->get(row, begin),
+                       layer->grid.get(grid_row, begin - layer->col),
+                       sizeof(packed_cell) * (end - begin));
+            }
+        }
+
+        // Moved rows were marked by mark_scrolled, their contents didn't change.
+        if (compose_rows[row] == compose_dirty) {
+            target->mark_dirty(row);
+        }
+    }
+
+    // Every window's changes have been composed.
+    for (auto &[id, layer] : windows) {
+        layer.grid.draw_tick += 1;
+    }
+
+    // The cursor is positioned relative to its grid.
+    auto cursor = windows.find(cursor_grid);
+
+    if (cursor != windows.end()) {
+        const grid_window &layer = cursor->second;
+        long row = layer.row + (long)layer.grid.cursor_row;
+        long col = layer.col + (long)layer.grid.cursor_col;
+
+        if (row >= 0 && row < height && col >= 0 && col < width) {
+            target->cursor_row = row;
+            target->cursor_col = col;
+        }
+    }
+
+    layout_changed = false;
 }
 
 void ui_controller::busy_start() {
@@ -410,12 +1036,76 @@ void ui_controller::busy_stop() {
     writing->cursor_hidden = false;
 }
 
+// Copies the changes made since dest was last written to.
+// Both grids are snapshots of the same sequence of flushes, so if dest has a
+// draw tick of t, only rows with a row tick greater than t differ. Typical
+// flushes touch a handful of rows, so this avoids copying the entire grid.
+static void copy_damaged(grid *dest, const grid *src) {
+    if (dest->size() != src->size()) {
+        *dest = *src;
+        return;
+    }
+
+    const size_t width = src->width();
+    const size_t height = src->height();
+    const uint64_t tick = dest->tick();
+
+    for (size_t row=0; row<height; ++row) {
+        if (src->row_tick(row) > tick) {
+            memcpy(dest->get(row, 0), src->get(row, 0), sizeof(packed_cell) * width);
+        }
+    }
+}
+
 void ui_controller::flush() {
+    if (ui_opts.ext_multigrid) {
+        compose();
+    }
+
     grid *completed = writing;
+
+    // Cells are resolved against the highlight table as of their grid's last
+    // flush, so the table is copied into the grid whenever it has changed.
+    // Redefining an existing highlight group changes cells the renderer has
+    // already drawn, so every row is marked as modified.
+    if (completed->hl_version != hl_version) {
+        completed->hl_attrs = hl_table;
+        completed->hl_version = hl_version;
+    }
+
+    if (hl_redefined) {
+        completed->mark_all_dirty();
+        hl_redefined = false;
+    }
+
     completed->draw_tick += 1;
-    
+    completed->flush_time = frame_stats::now();
+    stats.flushed();
+
+    // Tag the grid with the key press it answers, the renderer measures the
+    // rest of the key press's latency.
+    if (uint64_t input_time = latency.take_input()) {
+        latency.record(latency_stage::flush, input_time);
+        completed->last_input = input_time;
+    }
+
+    os_signpost_event_emit(rpc, OS_SIGNPOST_ID_EXCLUSIVE, "Flush");
+
     writing = complete.exchange(completed);
-    *writing = *completed;
+    copy_damaged(writing, completed);
+
+    writing->graphemes = completed->graphemes;
+    writing->row_ticks = completed->row_ticks;
+    writing->content_ticks = completed->content_ticks;
+    writing->scroll_moves = completed->scroll_moves;
+    writing->scroll_floor = completed->scroll_floor;
+    writing->cursor_attrs = completed->cursor_attrs;
+    writing->cursor_row = completed->cursor_row;
+    writing->cursor_col = completed->cursor_col;
+    writing->cursor_hidden = completed->cursor_hidden;
+    writing->draw_tick = completed->draw_tick;
+    writing->last_input = completed->last_input;
+    writing->flush_time = completed->flush_time;
 
     if (signal_flush) {
         dispatch_semaphore_signal(signal_flush);
@@ -452,10 +1142,10 @@ void ui_controller::default_colors_set(uint32_t fg, uint32_t bg, uint32_t sp) {
     for (cell_attributes &attrs : hl_table) {
         adjust_defaults(def, attrs);
     }
-    
-    for (cell &cell : writing->cells) {
-        adjust_defaults(def, cell.attrs);
-    }
+
+    // Cells refer to the highlight table, so only the table needs adjusting.
+    hl_version += 1;
+    writing->mark_all_dirty();
     
     window.default_background_color_set();
 }
@@ -472,6 +1162,14 @@ static inline void set_rgb_color(rgb_color &color, const msg::object &object) {
 }
 
 void ui_controller::hl_attr_define(size_t hlid, msg::map definition) {
+    if (hlid > UINT16_MAX) {
+        return os_log_error(rpc, "Redraw error: Highlight ID out of range - "
+                                 "Event=hl_attr_define, ID=%zu", hlid);
+    }
+
+    hl_redefined |= hlid < hl_table.size();
+    hl_version += 1;
+
     cell_attributes *attrs = hl_new_entry(hl_table, hlid);
     
     for (const auto& [key, value] : definition) {
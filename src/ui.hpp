@@ -11,8 +11,16 @@
 #define UI_HPP
 
 #include <dispatch/dispatch.h>
+#include <algorithm>
 #include <array>
 #include <atomic>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <unordered_map>
+#include "frame_stats.hpp"
+#include "latency.hpp"
 #include "msgpack.hpp"
 #include "unfair_lock.hpp"
 
@@ -134,41 +142,172 @@ enum class font_attributes {
 /// Holds up to six (maxcombine in Neovim) UTF-8 encoded code points.
 using grapheme_cluster = std::array<char, 24>;
 
-/// A grid cell.
+/// Interns grapheme clusters that are too long to be stored in a packed_cell.
+///
+/// Entries are never removed, and once added they never move, so grids on
+/// other threads can look up entries while new entries are being added, as
+/// long as the entries they refer to were added before the grid was flushed.
+/// Grids share ownership of their table. The ui_controller replaces a large
+/// table with an empty one when a clear or resize leaves no interned cells,
+/// grids that still refer to the old table keep it alive.
+class grapheme_table {
+private:
+    static constexpr size_t chunk_size = 65536;
+    static constexpr size_t max_chunks = 256;
+
+    std::array<std::unique_ptr<grapheme_cluster[]>, max_chunks> chunks;
+    std::unordered_map<std::string_view, uint32_t> indexes;
+    size_t count;
+
+public:
+    /// The maximum number of interned grapheme clusters.
+    static constexpr size_t capacity = chunk_size * max_chunks;
+
+    grapheme_table(): count(0) {}
+
+    grapheme_table(const grapheme_table&) = delete;
+    grapheme_table& operator=(const grapheme_table&) = delete;
+
+    /// The number of interned grapheme clusters.
+    size_t size() const {
+        return count;
+    }
+
+    /// Returns the index of text, adding text to the table if needed.
+    /// Text is trimmed to the size of a grapheme_cluster.
+    /// @returns The index of text, or std::nullopt if the table is full.
+    std::optional<uint32_t> intern(std::string_view text) {
+        text = text.substr(0, sizeof(grapheme_cluster));
+
+        if (auto iter = indexes.find(text); iter != indexes.end()) {
+            return iter->second;
+        }
+
+        if (count == capacity) {
+            return std::nullopt;
+        }
+
+        auto &chunk = chunks[count / chunk_size];
+
+        if (!chunk) {
+            chunk.reset(new grapheme_cluster[chunk_size]);
+        }
+
+        grapheme_cluster &entry = chunk[count % chunk_size];
+        entry = {};
+        memcpy(entry.data(), text.data(), text.size());
+
+        uint32_t index = static_cast<uint32_t>(count++);
+        indexes.emplace(std::string_view(entry.data(), text.size()), index);
+        return index;
+    }
+
+    /// Returns the grapheme cluster at the given index.
+    const grapheme_cluster& get(uint32_t index) const {
+        return chunks[index / chunk_size][index % chunk_size];
+    }
+};
+
+/// A grid cell as stored in a grid.
+///
+/// Packed cells are 8 bytes. Graphemes of up to four UTF-8 code units are
+/// stored inline, longer grapheme clusters are stored in a grapheme_table.
+/// Attributes are stored as a highlight ID, and are resolved by the grid.
+/// The only attribute kept per cell is the doublewidth flag.
+class packed_cell {
+private:
+    // Inline text is stored zero padded. A lead byte of 0xFF never occurs in
+    // UTF-8, we use it to tag indexes into the grapheme table.
+    static constexpr uint32_t interned_tag = 0xFF000000;
+
+    uint32_t text;
+    uint16_t hlid;
+    uint16_t flags;
+
+    friend class ui_controller;
+
+public:
+    /// An empty cell with the default highlight group.
+    packed_cell(): text(0), hlid(0), flags(0) {}
+
+    /// Packs the given text and highlight ID.
+    ///
+    /// @param cell_text    UTF-8 encoded text representing a single grapheme.
+    /// @param cell_hlid    The cell's highlight ID.
+    /// @param graphemes    The table used to intern long grapheme clusters.
+    packed_cell(std::string_view cell_text, uint16_t cell_hlid,
+                grapheme_table &graphemes): text(0), hlid(cell_hlid), flags(0) {
+        if (cell_text.size() == 1 && cell_text.front() == ' ') {
+            return;
+        }
+
+        if (cell_text.size() < 4 || (cell_text.size() == 4 && cell_text[3] != '\xFF')) {
+            memcpy(&text, cell_text.data(), cell_text.size());
+            return;
+        }
+
+        if (auto index = graphemes.intern(cell_text)) {
+            text = interned_tag | *index;
+        } else {
+            // U+FFFD REPLACEMENT CHARACTER.
+            memcpy(&text, "\xEF\xBF\xBD", 3);
+        }
+    }
+
+    /// True if the cell is empty, false otherwise.
+    bool empty() const {
+        return text == 0;
+    }
+
+    /// True if the cell's text is stored in a grapheme table.
+    bool interned() const {
+        return (text & interned_tag) == interned_tag;
+    }
+
+    /// The index of the cell's text in its grapheme table.
+    /// Only meaningful if interned() is true.
+    uint32_t grapheme_index() const {
+        return text & ~interned_tag;
+    }
+
+    /// The cell's inline text, zero padded to four bytes.
+    /// Only meaningful if interned() is false.
+    uint32_t inline_text() const {
+        return text;
+    }
+
+    /// The cell's highlight ID.
+    uint16_t hl_id() const {
+        return hlid;
+    }
+
+    /// The cell's flags, a subset of cell_attributes::flag.
+    uint16_t cell_flags() const {
+        return flags;
+    }
+};
+
+/// A grid cell with its grapheme and attributes resolved.
 /// A cell consists of a grapheme and various attributes that control their
-/// appearance.
+/// appearance. Cells are obtained from a grid, see grid::resolve().
 class cell {
 private:
     grapheme_cluster text;
     uint16_t size;
     cell_attributes attrs;
 
-    friend class ui_controller;
-
 public:
     /// Zero initialized cell.
     cell(): text{}, size{}, attrs{} {}
 
     /// Constructs a cell with the given text and attributes.
     ///
-    /// @param cell_text    UTF-8 encoded text representing a single grapheme.
-    /// @param cell_attrs   The new cell's attributes.
-    ///
-    /// Note: Text is stored in a grapheme_cluster and is trimmed if needed.
-    cell(msg::string cell_text, const cell_attributes *cell_attrs) {
-        text = {};
-        attrs = *cell_attrs;
-
-        if (cell_text.size() == 1 && *cell_text.data() == ' ') {
-            size = 0;
-        } else {
-            size = std::min(cell_text.size(), sizeof(grapheme_cluster));
-
-            for (size_t i=0; i<size; ++i) {
-                text[i] = cell_text[i];
-            }
-        }
-    }
+    /// @param cell_text    The cell's zero padded grapheme cluster.
+    /// @param text_size    The size of the text in cell_text.
+    /// @param cell_attrs   The cell's attributes.
+    cell(const grapheme_cluster &cell_text, uint16_t text_size,
+         const cell_attributes &cell_attrs):
+        text(cell_text), size(text_size), attrs(cell_attrs) {}
 
     /// The cell's grapheme as a grapheme_cluster.
     grapheme_cluster grapheme() const {
@@ -285,48 +424,48 @@ private:
     cursor_attributes attrs_;
     size_t row_;
     size_t col_;
-    const cell *ptr_;
+    nvim::cell cell_;
 
 public:
     /// A default constructed cursor should only be assigned to or destroyed.
     /// This constructor is only provided because Objective-C++ requires C++
     /// instance variables to be default constructible.
-    cursor(): attrs_(), row_(0), col_(0), ptr_(nullptr) {}
+    cursor(): attrs_(), row_(0), col_(0), cell_() {}
 
     /// Construct a new cursor object.
     /// @param row      The row position of the cursor.
     /// @param col      The column position of the cursor.
-    /// @param ptr      A pointer to the cursor's underlying cell.
+    /// @param cell     The cursor's underlying cell.
     /// @param attrs    The cursor's attributes.
-    cursor(size_t row, size_t col, const cell *ptr, cursor_attributes attrs):
-        attrs_(attrs), row_(row), col_(col), ptr_(ptr) {
+    cursor(size_t row, size_t col, const nvim::cell &cell, cursor_attributes attrs):
+        attrs_(attrs), row_(row), col_(col), cell_(cell) {
         if (attrs_.special.is_default()) {
-            attrs_.special = ptr->special();
+            attrs_.special = cell.special();
         }
 
         if (attrs_.background.is_default()) {
             if (attrs_.foreground.is_default()) {
-                attrs_.background = ptr->foreground();
-                attrs_.foreground = ptr->background();
+                attrs_.background = cell.foreground();
+                attrs_.foreground = cell.background();
                 return;
             }
 
-            attrs_.background = ptr->background();
+            attrs_.background = cell.background();
         }
 
         if (attrs_.foreground.is_default()) {
-            attrs_.foreground = ptr->foreground();
+            attrs_.foreground = cell.foreground();
         }
     }
 
     /// A reference to the underlying cell.
     const nvim::cell& cell() const {
-        return *ptr_;
+        return cell_;
     }
 
     /// The width of the underlying cell.
     uint32_t width() const {
-        return ptr_->width();
+        return cell_.width();
     }
 
     /// Get the cursor shape.
@@ -402,43 +541,180 @@ public:
     }
 };
 
+/// A scroll applied to every column of the rows in [top, bottom).
+/// Row r of the region receives the contents of row r + rows.
+struct grid_scroll_move {
+    uint64_t tick;
+    uint32_t top;
+    uint32_t bottom;
+    int32_t rows;
+
+    /// Applies the move to a table with one entry per grid row.
+    template<typename T>
+    void apply(std::vector<T> &table) const {
+        auto first = table.begin() + top;
+        auto last = table.begin() + bottom;
+
+        if (rows > 0) {
+            std::rotate(first, first + rows, last);
+        } else {
+            std::rotate(first, last + rows, last);
+        }
+    }
+
+    /// Returns the row the contents of row are moved to, or SIZE_MAX if the
+    /// contents were scrolled out of the region.
+    size_t moved_row(size_t row) const {
+        if (row < top || row >= bottom) {
+            return row;
+        }
+
+        long moved = static_cast<long>(row) - rows;
+
+        if (moved < static_cast<long>(top) || moved >= static_cast<long>(bottom)) {
+            return SIZE_MAX;
+        }
+
+        return moved;
+    }
+};
+
 /// A grid of cells.
 ///
 /// Grid's are conceptually a 2d array of cells. They are created and updated
-/// by a ui_controller in response to redraw events.
+/// by a ui_controller in response to redraw events. Cells are stored packed,
+/// use resolve() to obtain a cell's grapheme and attributes.
 class grid {
 private:
-    std::vector<cell> cells;
+    std::vector<packed_cell> cells;
+    std::vector<cell_attributes> hl_attrs;
+    std::shared_ptr<const grapheme_table> graphemes;
+    uint64_t hl_version;
+    std::vector<uint64_t> row_ticks;
+    std::vector<uint64_t> content_ticks;
+    std::vector<grid_scroll_move> scroll_moves;
+    uint64_t scroll_floor;
     size_t grid_width;
     size_t grid_height;
     cursor_attributes cursor_attrs;
     size_t cursor_row;
     size_t cursor_col;
     uint64_t draw_tick;
+    uint64_t last_input;
+    uint64_t flush_time;
     bool cursor_hidden;
 
     friend class ui_controller;
 
+    /// Marks row as modified by the next flush.
+    void mark_dirty(size_t row) {
+        row_ticks[row] = draw_tick + 1;
+        content_ticks[row] = draw_tick + 1;
+    }
+
+    /// Marks rows in the range [begin, end) as modified by the next flush.
+    void mark_dirty(size_t begin, size_t end) {
+        std::fill(row_ticks.begin() + begin,
+                  row_ticks.begin() + end, draw_tick + 1);
+
+        std::fill(content_ticks.begin() + begin,
+                  content_ticks.begin() + end, draw_tick + 1);
+    }
+
+    /// Marks every row as modified by the next flush.
+    /// Recorded scroll moves are discarded, they can no longer be replayed.
+    void mark_all_dirty() {
+        row_ticks.assign(grid_height, draw_tick + 1);
+        content_ticks.assign(grid_height, draw_tick + 1);
+        scroll_moves.clear();
+        scroll_floor = draw_tick + 1;
+    }
+
+    /// Records a full width scroll of the rows in [top, bottom).
+    /// Every row in the region is marked as modified, but content ticks move
+    /// along with the rows they describe, so clients that replay the move only
+    /// need to update the exposed rows and rows that were otherwise modified.
+    void mark_scrolled(size_t top, size_t bottom, long rows) {
+        auto begin = content_ticks.begin();
+
+        if (rows > 0) {
+            std::rotate(begin + top, begin + top + rows, begin + bottom);
+            std::fill(begin + bottom - rows, begin + bottom, draw_tick + 1);
+        } else {
+            std::rotate(begin + top, begin + bottom + rows, begin + bottom);
+            std::fill(begin + top, begin + top - rows, draw_tick + 1);
+        }
+
+        std::fill(row_ticks.begin() + top,
+                  row_ticks.begin() + bottom, draw_tick + 1);
+
+        if (scroll_moves.size() == max_scroll_moves) {
+            scroll_floor = std::max(scroll_floor, scroll_moves.front().tick);
+            scroll_moves.erase(scroll_moves.begin());
+        }
+
+        scroll_moves.push_back(grid_scroll_move{draw_tick + 1,
+                                                static_cast<uint32_t>(top),
+                                                static_cast<uint32_t>(bottom),
+                                                static_cast<int32_t>(rows)});
+    }
+
 public:
-    grid(): grid_width(0), grid_height(0), draw_tick(0), cursor_hidden(0) {}
+    /// The number of scroll moves kept for renderers to catch up with.
+    static constexpr size_t max_scroll_moves = 64;
+
+    grid(): hl_attrs(1), hl_version(0), scroll_floor(0),
+            grid_width(0), grid_height(0), draw_tick(0), last_input(0),
+            flush_time(0), cursor_hidden(0) {}
 
-    const cell* begin() const {
+    const packed_cell* begin() const {
         return cells.data();
     }
 
-    const cell* end() const {
+    const packed_cell* end() const {
         return cells.data() + cells.size();
     }
 
     /// A pointer to the cell at the given row and column.
-    cell* get(size_t row, size_t col) {
+    packed_cell* get(size_t row, size_t col) {
         return cells.data() + (row * grid_width) + col;
     }
 
     /// A const pointer to the cell at the given row and column position.
-    const cell* get(size_t row, size_t col) const {
+    const packed_cell* get(size_t row, size_t col) const {
         return cells.data() + (row * grid_width) + col;
     }
+
+    /// Resolves the grapheme and attributes of a cell from this grid.
+    /// Attributes are resolved using the highlight table as of the grid's
+    /// last flush.
+    nvim::cell resolve(const packed_cell &packed) const {
+        size_t hlid = packed.hl_id();
+        cell_attributes attrs = hlid < hl_attrs.size() ? hl_attrs[hlid] : hl_attrs[0];
+        attrs.flags |= packed.cell_flags();
+
+        if (packed.empty()) {
+            return nvim::cell(grapheme_cluster{}, 0, attrs);
+        }
+
+        grapheme_cluster text;
+
+        if (packed.interned()) {
+            text = graphemes->get(packed.grapheme_index());
+        } else {
+            uint32_t inline_text = packed.inline_text();
+            text = {};
+            memcpy(text.data(), &inline_text, sizeof(inline_text));
+        }
+
+        auto size = std::find(text.begin(), text.end(), 0) - text.begin();
+        return nvim::cell(text, size, attrs);
+    }
+
+    /// Resolves the cell at the given row and column position.
+    nvim::cell resolve(size_t row, size_t col) const {
+        return resolve(*get(row, col));
+    }
     
     /// Return whether to hide cursor.
     bool hide_cursor() const {
@@ -449,7 +725,7 @@ public:
     nvim::cursor cursor() const {
         return nvim::cursor(cursor_row,
                             cursor_col,
-                            get(cursor_row, cursor_col),
+                            resolve(cursor_row, cursor_col),
                             cursor_attrs);
     }
 
@@ -472,6 +748,53 @@ public:
     size_t cells_size() const {
         return cells.size();
     }
+
+    /// The flush tick of the grid. Incremented by one on every flush.
+    uint64_t tick() const {
+        return draw_tick;
+    }
+
+    /// The time of the latest key press answered by this grid, or an earlier
+    /// grid. Zero if there is no such key press. @see latency_tracker.
+    uint64_t input_time() const {
+        return last_input;
+    }
+
+    /// The time of the flush that completed this grid. @see frame_stats.
+    uint64_t flushed_time() const {
+        return flush_time;
+    }
+
+    /// The tick of the last flush that modified the given row.
+    /// A row has changed since tick t if row_tick(row) > t. Changes to the
+    /// cursor are not tracked, clients should compare cursor() themselves.
+    uint64_t row_tick(size_t row) const {
+        return row_ticks[row];
+    }
+
+    /// The tick of the last flush that modified the contents of the given row,
+    /// following the contents through the scroll moves made since.
+    /// After replaying scroll_moves(t), a row has changed since tick t if
+    /// content_tick(row) > t.
+    uint64_t content_tick(size_t row) const {
+        return content_ticks[row];
+    }
+
+    /// Returns the scroll moves made after tick t in the order they were made.
+    /// Only a limited number of scroll moves are kept. If some of the moves
+    /// made after tick t were discarded, returns std::nullopt.
+    std::optional<std::span<const grid_scroll_move>> scroll_moves_since(uint64_t t) const {
+        if (t < scroll_floor) {
+            return std::nullopt;
+        }
+
+        auto first = std::find_if(scroll_moves.begin(), scroll_moves.end(),
+                                  [t](const grid_scroll_move &move) {
+            return move.tick > t;
+        });
+
+        return std::span<const grid_scroll_move>(first, scroll_moves.end());
+    }
 };
 
 /// Neovim UI options. See nvim :help ui-ext-options.
@@ -500,7 +823,7 @@ inline bool operator!=(const ui_options &left, const ui_options &right) {
 /// as such it is implemented in NVWindowController.mm.
 class window_controller {
 private:
-    void *controller;
+    void *controller = nullptr;
 
 public:
     window_controller() = default;
@@ -528,6 +851,10 @@ public:
     
     /// Called when the default background color changes.
     void default_background_color_set();
+
+    /// Calls handler on the main thread with a report of the glyph caches of
+    /// each render context, see NVRenderContextManager glyphCacheReport.
+    void glyph_cache_report(std::function<void(std::string_view)> handler);
 };
 
 /// Responsible for handling Neovim UI events.
@@ -539,6 +866,9 @@ private:
     dispatch_semaphore_t signal_flush;
     dispatch_semaphore_t signal_enter;
     std::vector<cell_attributes> hl_table;
+    uint64_t hl_version;
+    bool hl_redefined;
+    std::shared_ptr<grapheme_table> graphemes;
     std::vector<cursor_attributes> mode_table;
 
     // We use a multi buffering scheme with our grid objects.
@@ -554,6 +884,42 @@ private:
     grid *writing;
     grid *drawing;
 
+    // With ext_multigrid, Neovim draws each window to its own grid. Grid 1 is
+    // the global grid, other grids are positioned relative to it. We keep a
+    // single buffered grid per window, and compose them into the writing grid
+    // on flush. Only rows that changed since the last flush are composed.
+    // Scrolls of full width windows are recorded as moves of the global grid,
+    // other changes mark whole rows of the global grid as modified.
+    struct grid_window {
+        nvim::grid grid;
+        long row;
+        long col;
+        size_t anchor_grid;
+        double anchor_row;
+        double anchor_col;
+        bool anchor_north;
+        bool anchor_west;
+        bool floating;
+        bool visible;
+        int64_t zindex;
+        uint64_t order;
+    };
+
+    std::unordered_map<size_t, grid_window> windows;
+    std::vector<grid_window*> layers;
+    // How a row of the global grid is composed, in order of precedence.
+    // Moved rows are copied, but their contents are known to the renderer.
+    enum compose_state : char {
+        compose_none,
+        compose_moved,
+        compose_dirty
+    };
+
+    std::vector<compose_state> compose_rows;
+    uint64_t layout_order;
+    size_t cursor_grid;
+    bool layout_changed;
+
     unfair_lock option_lock;
     std::string option_title;
     std::string option_guifont;
@@ -561,7 +927,15 @@ private:
 
     grid* get_grid(size_t index);
 
-    void redraw_event(const msg::object &event);
+    grid_window* get_window(size_t grid, const char *event);
+
+    void release_graphemes();
+
+    void place_window(grid_window *layer, int64_t zindex);
+
+    void layout();
+
+    void compose();
 
     void flush();
     
@@ -580,6 +954,21 @@ private:
     void grid_scroll(size_t grid, size_t top, size_t bottom,
                      size_t left, size_t right, long rows);
 
+    void grid_destroy(size_t grid);
+
+    void win_pos(size_t grid, msg::object win, size_t row, size_t col,
+                 size_t width, size_t height);
+
+    void win_float_pos(size_t grid, msg::object win, msg::string anchor,
+                       size_t anchor_grid, double anchor_row, double anchor_col,
+                       bool focusable, std::optional<int64_t> zindex);
+
+    void win_hide(size_t grid);
+
+    void win_close(size_t grid);
+
+    void msg_set_pos(size_t grid, size_t row, bool scrolled, msg::string sep);
+
     void hl_attr_define(size_t id, msg::map attrs);
 
     void mode_info_set(bool enabled, msg::array property_maps);
@@ -598,6 +987,8 @@ private:
 
 public:
     window_controller window;
+    latency_tracker latency;
+    frame_stats stats;
 
     ui_controller(): hl_table(1), option_title("NVIM") {
         signal_flush = nullptr;
@@ -605,6 +996,19 @@ public:
         complete = &triple_buffered[0];
         writing  = &triple_buffered[1];
         drawing  = &triple_buffered[2];
+        hl_version = 1;
+        hl_redefined = false;
+        layout_order = 0;
+
+        graphemes = std::make_shared<grapheme_table>();
+
+        for (grid &grid : triple_buffered) {
+            grid.graphemes = graphemes;
+        }
+
+        cursor_grid = 1;
+        layout_changed = true;
+        ui_opts = {};
 
         // Since neovim commit 08545bd45, neovim only sends a
         // single `default_colors_set` event at startup just
@@ -697,6 +1101,13 @@ public:
     /// Handle a Neovim RPC redraw notification.
     /// @param events The paramters of the RPC notification.
     void redraw(msg::array events);
+
+    /// Handle a redraw notification one event at a time.
+    /// Call redraw_begin(), then redraw_event() with each element of the
+    /// notification's parameters, as they're unpacked, then redraw_end().
+    void redraw_begin();
+    void redraw_event(const msg::object &event);
+    void redraw_end();
 };
 
 /// Describes a user selected font.
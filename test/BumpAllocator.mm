@@ -165,4 +165,64 @@
     }
 }
 
+- (void)testDeallocAllRetainsHighWaterMark {
+    bump_allocator allocator(512);
+
+    for (int i=0; i<64; ++i) {
+        allocator.alloc(128);
+    }
+
+    size_t peak = allocator.capacity();
+    allocator.dealloc_all();
+
+    XCTAssertGreaterThan(allocator.capacity(), peak);
+    XCTAssertGreaterThanOrEqual(allocator.remaining(), 64 * 128);
+    XCTAssertGreaterThanOrEqual(allocator.stats().peak_bytes, 64 * 128);
+}
+
+- (void)testSteadyStateDoesNotMalloc {
+    bump_allocator allocator(512);
+
+    for (int i=0; i<64; ++i) {
+        allocator.alloc(128);
+    }
+
+    allocator.dealloc_all();
+    size_t mallocs = allocator.stats().mallocs;
+
+    for (int cycle=0; cycle<8; ++cycle) {
+        for (int i=0; i<64; ++i) {
+            void *ptr = allocator.alloc(128);
+            AssertRegionValid(ptr, 128);
+        }
+
+        allocator.dealloc_all();
+    }
+
+    XCTAssertEqual(allocator.stats().mallocs, mallocs);
+}
+
+- (void)testChunksAreBounded {
+    bump_allocator allocator(64);
+
+    for (int cycle=0; cycle<8; ++cycle) {
+        for (int i=0; i<1024; ++i) {
+            allocator.alloc(64 << cycle);
+        }
+
+        allocator.dealloc_all();
+    }
+
+    XCTAssertLessThanOrEqual(allocator.stats().chunks, 5);
+}
+
+- (void)testFreeBuffersArePoisoned {
+    bump_allocator allocator(128);
+    char *ptr = static_cast<char*>(allocator.alloc(64));
+    allocator.alloc(1024);
+    allocator.dealloc_all();
+
+    AssertRegionPoisoned(ptr, 64);
+}
+
 @end
@@ -0,0 +1,147 @@
+//
+//  Neovim Mac Test
+//  Capture.mm
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <XCTest/XCTest.h>
+
+#include "capture.hpp"
+
+static std::string temporary_path() {
+    NSString *name = [NSString stringWithFormat:@"capture-%@", [[NSUUID UUID] UUIDString]];
+    return [[NSTemporaryDirectory() stringByAppendingPathComponent:name] fileSystemRepresentation];
+}
+
+static off_t file_size(const std::string &path) {
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 ? info.st_size : -1;
+}
+
+@interface testCapture : XCTestCase
+@end
+
+@implementation testCapture {
+    std::string path;
+}
+
+- (void)setUp {
+    path = temporary_path();
+}
+
+- (void)tearDown {
+    unlink(path.c_str());
+}
+
+- (void)writeRecords {
+    capture_writer writer;
+    XCTAssertEqual(writer.open(path.c_str()), 0);
+
+    writer.record(capture_direction::received, "hello", 5);
+    writer.record(capture_direction::sent, "", 0);
+    writer.record(capture_direction::sent, "world!", 6);
+}
+
+- (void)testRoundTrip {
+    [self writeRecords];
+
+    capture_reader reader;
+    XCTAssertEqual(reader.open(path.c_str()), 0);
+
+    auto first = reader.next();
+    XCTAssertTrue(first.has_value());
+    XCTAssertEqual(first->direction, capture_direction::received);
+    XCTAssertTrue(first->data == "hello");
+
+    // Empty records aren't written.
+    auto second = reader.next();
+    XCTAssertTrue(second.has_value());
+    XCTAssertEqual(second->direction, capture_direction::sent);
+    XCTAssertTrue(second->data == "world!");
+    XCTAssertGreaterThanOrEqual(second->time, first->time);
+
+    XCTAssertFalse(reader.next().has_value());
+    XCTAssertFalse(reader.next().has_value());
+}
+
+- (void)testTruncatedFinalRecord {
+    [self writeRecords];
+    XCTAssertEqual(truncate(path.c_str(), file_size(path) - 2), 0);
+
+    capture_reader reader;
+    XCTAssertEqual(reader.open(path.c_str()), 0);
+
+    auto first = reader.next();
+    XCTAssertTrue(first.has_value());
+    XCTAssertTrue(first->data == "hello");
+
+    XCTAssertFalse(reader.next().has_value());
+}
+
+- (void)testTruncatedFinalHeader {
+    [self writeRecords];
+
+    // Leave the first record, and part of the second record's header.
+    XCTAssertEqual(truncate(path.c_str(), 8 + 16 + 5 + 10), 0);
+
+    capture_reader reader;
+    XCTAssertEqual(reader.open(path.c_str()), 0);
+    XCTAssertTrue(reader.next().has_value());
+    XCTAssertFalse(reader.next().has_value());
+}
+
+- (void)testBadMagic {
+    [self writeRecords];
+
+    int fd = open(path.c_str(), O_WRONLY);
+    XCTAssertNotEqual(fd, -1);
+    XCTAssertEqual(pwrite(fd, "XXXX", 4, 0), 4);
+    close(fd);
+
+    capture_reader reader;
+    XCTAssertEqual(reader.open(path.c_str()), EINVAL);
+}
+
+- (void)testEmptyFile {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    XCTAssertNotEqual(fd, -1);
+    close(fd);
+
+    capture_reader reader;
+    XCTAssertEqual(reader.open(path.c_str()), EINVAL);
+}
+
+- (void)testMissingFile {
+    capture_reader reader;
+    XCTAssertEqual(reader.open(path.c_str()), ENOENT);
+}
+
+- (void)testQuietSessionIsFlushed {
+    capture_writer writer;
+    XCTAssertEqual(writer.open(path.c_str()), 0);
+    writer.record(capture_direction::received, "hello", 5);
+
+    // No further records arrive, the flush timer writes the record out.
+    NSDate *deadline = [NSDate dateWithTimeIntervalSinceNow:5];
+
+    while (file_size(path) < 8 + 16 + 5 && [deadline timeIntervalSinceNow] > 0) {
+        usleep(50000);
+    }
+
+    capture_reader reader;
+    XCTAssertEqual(reader.open(path.c_str()), 0);
+
+    auto record = reader.next();
+    XCTAssertTrue(record.has_value());
+    XCTAssertTrue(record->data == "hello");
+}
+
+@end
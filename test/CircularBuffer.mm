@@ -358,4 +358,31 @@ static inline bool all_of(const circular_buffer &buffer, char val) {
     }
 }
 
+- (void)testSpaceIsRemainingCapacity {
+    circular_buffer buffer(1024);
+    XCTAssertEqual(buffer.space(), buffer.capacity());
+
+    buffer.insert("1234", 4);
+    XCTAssertEqual(buffer.space(), buffer.capacity() - 4);
+}
+
+- (void)testCommitAppendsBytesWrittenToEnd {
+    std::string_view input("1234567890123");
+
+    circular_buffer buffer(1024);
+    size_t capacity = buffer.capacity();
+    size_t lim = capacity * 4;
+
+    for (int i=0; i<lim; ++i) {
+        memcpy(buffer.end(), input.data(), input.size());
+        buffer.commit(input.size());
+        XCTAssertEqual(buffer.size(), input.size());
+        XCTAssertEqual(buffer, input);
+
+        buffer.consume(input.size());
+        XCTAssertEqual(buffer.size(), 0);
+        XCTAssertEqual(buffer.capacity(), capacity);
+    }
+}
+
 @end
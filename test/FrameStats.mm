@@ -0,0 +1,128 @@
+//
+//  Neovim Mac Test
+//  FrameStats.mm
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#include <string>
+#include <thread>
+#include <XCTest/XCTest.h>
+
+#include "frame_stats.hpp"
+
+@interface testFrameStats : XCTestCase
+@end
+
+@implementation testFrameStats
+
+- (void)testEmptySummary {
+    frame_stats stats;
+    frame_stats_summary summary = stats.summary();
+    XCTAssertEqual(summary.frames, 0);
+    XCTAssertEqual(summary.cells, 0);
+}
+
+- (void)testRecentKeepsNewestSamples {
+    frame_stats stats;
+
+    for (uint64_t i=0; i<frame_stats::capacity * 2; ++i) {
+        frame_sample sample = {};
+        sample.cells = i;
+        stats.push(sample);
+    }
+
+    frame_sample samples[frame_stats::capacity];
+    size_t count = stats.recent(samples, frame_stats::capacity);
+    XCTAssertEqual(count, frame_stats::capacity);
+
+    for (size_t i=0; i<count; ++i) {
+        XCTAssertEqual(samples[i].cells, frame_stats::capacity + i);
+    }
+
+    count = stats.recent(samples, 4);
+    XCTAssertEqual(count, 4);
+    XCTAssertEqual(samples[3].cells, frame_stats::capacity * 2 - 1);
+}
+
+- (void)testSummaryRates {
+    frame_stats stats;
+
+    // Ten frames, a tenth of a second apart, with 100 bytes and 2 events
+    // received before each one.
+    for (uint64_t i=0; i<10; ++i) {
+        stats.received(100, 2);
+
+        frame_sample sample = {};
+        sample.time = i * 100000000;
+        sample.cells = 40;
+        sample.present_latency = i % 2 ? 4000000 : 0;
+        stats.push(sample);
+    }
+
+    frame_stats_summary summary = stats.summary();
+    XCTAssertEqual(summary.frames, 10);
+    XCTAssertEqualWithAccuracy(summary.seconds, 0.9, 1e-9);
+    XCTAssertEqualWithAccuracy(summary.cells, 40, 1e-9);
+    XCTAssertEqualWithAccuracy(summary.present_mean, 4, 1e-9);
+    XCTAssertEqualWithAccuracy(summary.present_max, 4, 1e-9);
+    XCTAssertEqualWithAccuracy(summary.rpc_received_per_sec, 1000, 1e-6);
+    XCTAssertEqualWithAccuracy(summary.rpc_events_per_sec, 20, 1e-6);
+}
+
+- (void)testPacingCounters {
+    frame_stats stats;
+
+    // Three flushes coalesced into two frames over five display refreshes.
+    for (int i=0; i<3; ++i) stats.flushed();
+    for (int i=0; i<5; ++i) stats.refreshed();
+    for (int i=0; i<2; ++i) stats.push(frame_sample{});
+
+    frame_stats_summary summary = stats.summary();
+    XCTAssertEqual(summary.flushes, 3);
+    XCTAssertEqual(summary.refreshes, 5);
+    XCTAssertEqual(summary.presented, 2);
+
+    std::string json = stats.json();
+    XCTAssertNotEqual(json.find("\"flushes\":3,"), std::string::npos);
+    XCTAssertNotEqual(json.find("\"refreshes\":5,"), std::string::npos);
+    XCTAssertNotEqual(json.find("\"presented\":2}"), std::string::npos);
+}
+
+- (void)testToggleOverlay {
+    frame_stats stats;
+    XCTAssertFalse(stats.overlay_enabled());
+    XCTAssertTrue(stats.toggle_overlay());
+    XCTAssertTrue(stats.overlay_enabled());
+    XCTAssertFalse(stats.toggle_overlay());
+    XCTAssertFalse(stats.overlay_enabled());
+}
+
+- (void)testConcurrentReadsAreNotTorn {
+    frame_stats stats;
+
+    std::thread writer([&stats] {
+        for (uint64_t i=0; i<100000; ++i) {
+            frame_sample sample = {};
+            sample.cells = i;
+            sample.glyph_hits = i;
+            stats.push(sample);
+        }
+    });
+
+    frame_sample samples[frame_stats::capacity];
+
+    for (int i=0; i<1000; ++i) {
+        size_t count = stats.recent(samples, frame_stats::capacity);
+
+        for (size_t j=0; j<count; ++j) {
+            XCTAssertEqual(samples[j].cells, samples[j].glyph_hits);
+        }
+    }
+
+    writer.join();
+}
+
+@end
@@ -0,0 +1,111 @@
+//
+//  Neovim Mac Test
+//  Graphemes.mm
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <XCTest/XCTest.h>
+
+#include "RedrawWriter.hpp"
+#include "ui.hpp"
+
+namespace {
+
+// Enough cells to intern past the size at which tables are replaced.
+constexpr size_t grid_width = 256;
+constexpr size_t grid_height = 257;
+
+// Five byte graphemes are too long to be stored inline.
+std::string numbered_grapheme(size_t number) {
+    char text[8];
+    snprintf(text, sizeof(text), "%05zu", number);
+    return text;
+}
+
+} // namespace
+
+@interface testGraphemes : XCTestCase
+@end
+
+@implementation testGraphemes {
+    std::unique_ptr<nvim::ui_controller> ui;
+    redraw_writer writer;
+}
+
+- (void)setUp {
+    ui = std::make_unique<nvim::ui_controller>();
+    writer.event("grid_resize", std::tuple(1, grid_width, grid_height));
+}
+
+- (void)writeGrapheme:(const std::string &)grapheme row:(size_t)row {
+    redraw_writer::line_cells cells = {{grapheme, 0}};
+    writer.event("grid_line", std::tuple(1, row, 0, cells, false));
+}
+
+/// Writes a distinct interned grapheme to every cell of the grid.
+- (void)fillGrid {
+    for (size_t row=0; row<grid_height; ++row) {
+        redraw_writer::line_cells cells;
+
+        for (size_t col=0; col<grid_width; ++col) {
+            cells.emplace_back(numbered_grapheme(row * grid_width + col), 0);
+        }
+
+        writer.event("grid_line", std::tuple(1, row, 0, cells, false));
+    }
+}
+
+- (const nvim::grid*)drawGrid {
+    writer.flush();
+    writer.redraw(*ui);
+    return ui->get_global_grid();
+}
+
+- (void)testSmallTableIsKept {
+    [self writeGrapheme:"hello" row:0];
+    [self drawGrid];
+
+    writer.event("grid_clear", std::tuple(1));
+    [self writeGrapheme:"world" row:0];
+    const nvim::grid *grid = [self drawGrid];
+
+    XCTAssertEqual(grid->get(0, 0)->grapheme_index(), 1);
+    XCTAssertTrue(grid->resolve(0, 0).grapheme_view() == "world");
+}
+
+- (void)testTableIsReplacedAfterClear {
+    [self fillGrid];
+    const nvim::grid *grid = [self drawGrid];
+    XCTAssertTrue(grid->resolve(grid_height - 1, 0).grapheme_view() ==
+                  numbered_grapheme((grid_height - 1) * grid_width));
+
+    writer.event("grid_clear", std::tuple(1));
+    [self writeGrapheme:"hello" row:0];
+    grid = [self drawGrid];
+
+    XCTAssertEqual(grid->get(0, 0)->grapheme_index(), 0);
+    XCTAssertTrue(grid->resolve(0, 0).grapheme_view() == "hello");
+    XCTAssertTrue(grid->resolve(1, 0).empty());
+}
+
+- (void)testTableIsKeptWhileCellsAreInterned {
+    [self fillGrid];
+    [self drawGrid];
+
+    writer.event("grid_resize", std::tuple(1, grid_width, grid_height + 1));
+    [self writeGrapheme:"hello" row:grid_height];
+    const nvim::grid *grid = [self drawGrid];
+
+    XCTAssertEqual(grid->get(grid_height, 0)->grapheme_index(),
+                   grid_width * grid_height);
+    XCTAssertTrue(grid->resolve(0, 1).grapheme_view() == numbered_grapheme(1));
+    XCTAssertTrue(grid->resolve(grid_height, 0).grapheme_view() == "hello");
+}
+
+@end
@@ -0,0 +1,239 @@
+//
+//  Neovim Mac Test
+//  GridScroll.mm
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <XCTest/XCTest.h>
+
+#include "RedrawWriter.hpp"
+#include "SlotRenderer.hpp"
+#include "ui.hpp"
+
+namespace {
+
+constexpr size_t grid_width = 8;
+constexpr size_t grid_height = 10;
+
+std::string numbered_line(size_t number) {
+    std::string text = "line" + std::to_string(number);
+    text.resize(grid_width, ' ');
+    return text;
+}
+
+} // namespace
+
+@interface testGridScroll : XCTestCase
+@end
+
+@implementation testGridScroll {
+    std::unique_ptr<nvim::ui_controller> ui;
+    redraw_writer writer;
+    slot_renderer renderer;
+    size_t next_line;
+}
+
+- (void)setUp {
+    ui = std::make_unique<nvim::ui_controller>();
+    next_line = 0;
+
+    writer.event("grid_resize", std::tuple(1, grid_width, grid_height));
+
+    for (size_t row=0; row<grid_height; ++row) {
+        writer.line(1, row, 0, numbered_line(next_line++));
+    }
+
+    writer.flush();
+    [self drawGrid];
+}
+
+- (const nvim::grid*)drawGrid {
+    writer.redraw(*ui);
+    const nvim::grid *grid = ui->get_global_grid();
+    renderer.draw(grid);
+    return grid;
+}
+
+/// Scrolls the rows in [top, bottom) by rows, and writes the exposed rows.
+- (void)scroll:(size_t)top bottom:(size_t)bottom rows:(long)rows {
+    writer.event("grid_scroll", std::tuple(1, top, bottom, 0, grid_width, rows, 0));
+
+    if (rows > 0) {
+        for (size_t row=bottom - rows; row<bottom; ++row) {
+            writer.line(1, row, 0, numbered_line(next_line++));
+        }
+    } else {
+        for (size_t row=top; row<top - rows; ++row) {
+            writer.line(1, row, 0, numbered_line(next_line++));
+        }
+    }
+
+    writer.flush();
+}
+
+- (void)testScrollUp {
+    [self scroll:0 bottom:grid_height rows:1];
+    const nvim::grid *grid = [self drawGrid];
+
+    XCTAssertTrue(renderer.replayed);
+    XCTAssertEqual(renderer.rows_encoded, 1);
+    XCTAssertTrue(renderer.matches(grid));
+    XCTAssertTrue(row_text(grid, 0) == numbered_line(1));
+}
+
+- (void)testScrollDown {
+    [self scroll:0 bottom:grid_height rows:-2];
+    const nvim::grid *grid = [self drawGrid];
+
+    XCTAssertTrue(renderer.replayed);
+    XCTAssertEqual(renderer.rows_encoded, 2);
+    XCTAssertTrue(renderer.matches(grid));
+    XCTAssertTrue(row_text(grid, 2) == numbered_line(0));
+}
+
+- (void)testScrollRegion {
+    [self scroll:2 bottom:7 rows:2];
+    const nvim::grid *grid = [self drawGrid];
+
+    XCTAssertTrue(renderer.replayed);
+    XCTAssertEqual(renderer.rows_encoded, 2);
+    XCTAssertTrue(renderer.matches(grid));
+    XCTAssertTrue(row_text(grid, 1) == numbered_line(1));
+    XCTAssertTrue(row_text(grid, 2) == numbered_line(4));
+    XCTAssertTrue(row_text(grid, 7) == numbered_line(7));
+}
+
+- (void)testMultipleMovesBetweenDraws {
+    uint64_t tick = renderer.tick;
+
+    [self scroll:0 bottom:grid_height rows:1];
+    writer.redraw(*ui);
+    [self scroll:3 bottom:8 rows:-3];
+    writer.redraw(*ui);
+    [self scroll:0 bottom:grid_height rows:2];
+
+    const nvim::grid *grid = [self drawGrid];
+    auto moves = grid->scroll_moves_since(tick);
+
+    XCTAssertTrue(moves.has_value());
+    XCTAssertEqual(moves->size(), 3);
+    XCTAssertTrue(renderer.replayed);
+    XCTAssertEqual(renderer.rows_encoded, 6);
+    XCTAssertTrue(renderer.matches(grid));
+}
+
+- (void)testMultipleMovesInOneFlush {
+    writer.event("grid_scroll", std::tuple(1, 0, grid_height, 0, grid_width, 1, 0));
+    writer.event("grid_scroll", std::tuple(1, 0, grid_height, 0, grid_width, -1, 0));
+    writer.line(1, 0, 0, numbered_line(next_line++));
+    writer.line(1, grid_height - 1, 0, numbered_line(next_line++));
+    writer.flush();
+
+    const nvim::grid *grid = [self drawGrid];
+
+    XCTAssertTrue(renderer.replayed);
+    XCTAssertTrue(renderer.matches(grid));
+}
+
+- (void)testPartialWidthScrollIsNotRecorded {
+    uint64_t tick = renderer.tick;
+
+    writer.event("grid_scroll", std::tuple(1, 0, grid_height, 0, grid_width / 2, 1, 0));
+    writer.flush();
+
+    const nvim::grid *grid = [self drawGrid];
+    auto moves = grid->scroll_moves_since(tick);
+
+    XCTAssertTrue(moves.has_value());
+    XCTAssertEqual(moves->size(), 0);
+    XCTAssertEqual(renderer.rows_encoded, grid_height);
+    XCTAssertTrue(renderer.matches(grid));
+}
+
+- (void)testHistoryAtFloor {
+    uint64_t tick = renderer.tick;
+
+    for (size_t i=0; i<nvim::grid::max_scroll_moves; ++i) {
+        [self scroll:0 bottom:grid_height rows:1];
+        writer.redraw(*ui);
+    }
+
+    const nvim::grid *grid = [self drawGrid];
+    auto moves = grid->scroll_moves_since(tick);
+
+    XCTAssertTrue(moves.has_value());
+    XCTAssertEqual(moves->size(), nvim::grid::max_scroll_moves);
+    XCTAssertTrue(renderer.replayed);
+    XCTAssertTrue(renderer.matches(grid));
+}
+
+- (void)testFallbackPastFloor {
+    uint64_t tick = renderer.tick;
+
+    for (size_t i=0; i<=nvim::grid::max_scroll_moves; ++i) {
+        [self scroll:0 bottom:grid_height rows:1];
+        writer.redraw(*ui);
+    }
+
+    const nvim::grid *grid = [self drawGrid];
+
+    XCTAssertFalse(grid->scroll_moves_since(tick).has_value());
+    XCTAssertFalse(renderer.replayed);
+    XCTAssertEqual(renderer.rows_encoded, grid_height);
+    XCTAssertTrue(renderer.matches(grid));
+
+    // Later draws replay moves again.
+    [self scroll:0 bottom:grid_height rows:1];
+    grid = [self drawGrid];
+
+    XCTAssertTrue(renderer.replayed);
+    XCTAssertEqual(renderer.rows_encoded, 1);
+    XCTAssertTrue(renderer.matches(grid));
+}
+
+- (void)testClearDiscardsMoves {
+    uint64_t tick = renderer.tick;
+
+    [self scroll:0 bottom:grid_height rows:1];
+    writer.event("grid_clear", std::tuple(1));
+    writer.flush();
+
+    const nvim::grid *grid = [self drawGrid];
+
+    XCTAssertFalse(grid->scroll_moves_since(tick).has_value());
+    XCTAssertTrue(renderer.matches(grid));
+}
+
+- (void)testMoveApply {
+    std::vector<int> rows = {0, 1, 2, 3, 4, 5};
+
+    nvim::grid_scroll_move {0, 1, 5, 1}.apply(rows);
+    XCTAssertTrue((rows == std::vector<int>{0, 2, 3, 4, 1, 5}));
+
+    nvim::grid_scroll_move {0, 1, 5, -2}.apply(rows);
+    XCTAssertTrue((rows == std::vector<int>{0, 4, 1, 2, 3, 5}));
+}
+
+- (void)testMovedRow {
+    nvim::grid_scroll_move up = {0, 2, 8, 2};
+    XCTAssertEqual(up.moved_row(1), 1);
+    XCTAssertEqual(up.moved_row(8), 8);
+    XCTAssertEqual(up.moved_row(2), SIZE_MAX);
+    XCTAssertEqual(up.moved_row(3), SIZE_MAX);
+    XCTAssertEqual(up.moved_row(4), 2);
+    XCTAssertEqual(up.moved_row(7), 5);
+
+    nvim::grid_scroll_move down = {0, 2, 8, -2};
+    XCTAssertEqual(down.moved_row(2), 4);
+    XCTAssertEqual(down.moved_row(5), 7);
+    XCTAssertEqual(down.moved_row(6), SIZE_MAX);
+    XCTAssertEqual(down.moved_row(7), SIZE_MAX);
+}
+
+@end
@@ -0,0 +1,49 @@
+//
+//  Neovim Mac Test
+//  Latency.mm
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#include <XCTest/XCTest.h>
+
+#include "latency.hpp"
+
+@interface testLatency : XCTestCase
+@end
+
+@implementation testLatency
+
+- (void)testFirstInputIsPending {
+    latency_tracker tracker;
+    uint64_t now = latency_tracker::now();
+
+    tracker.input(now - 2000000);
+    tracker.input(now - 1000000);
+
+    XCTAssertEqual(tracker.take_input(), now - 2000000);
+    XCTAssertEqual(tracker.take_input(), 0);
+    XCTAssertEqual(tracker.summary(latency_stage::input).samples, 2);
+}
+
+- (void)testRecordMeasuresFromInput {
+    latency_tracker tracker;
+    uint64_t input = latency_tracker::now() - 5000000;
+    tracker.record(latency_stage::flush, input);
+
+    latency_summary summary = tracker.summary(latency_stage::flush);
+    XCTAssertEqual(summary.samples, 1);
+    XCTAssertGreaterThanOrEqual(summary.p50, 5000000);
+    XCTAssertLessThan(summary.p50, 5000000000);
+}
+
+- (void)testFutureInputIsSkipped {
+    latency_tracker tracker;
+    tracker.record(latency_stage::present, latency_tracker::now() + 1000000000);
+
+    XCTAssertEqual(tracker.summary(latency_stage::present).samples, 0);
+}
+
+@end
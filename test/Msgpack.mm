@@ -1200,6 +1200,99 @@ static inline bool all_a(const char *begin, const char *end) {
     XCTAssertFalse(unpacker.unpack());
 }
 
+- (void)testUnpackBorrowed {
+    std::array<msg::object, 3> array{{
+        msg::make_object<msg::string>("test"),
+        msg::make_object<msg::binary>((unsigned char*)"\x01\x02", 2),
+        msg::make_object<msg::extension>((char*)"\x01\xff", 2)
+    }};
+
+    auto packed = packed_data("\x93\xa4\x74\x65\x73\x74\xc4\x02\x01\x02"
+                              "\xd4\x01\xff");
+
+    auto value = msg::make_object<msg::array>(array.data(), array.size());
+
+    msg::unpacker unpacker;
+    unpacker.feed_borrowed(packed.data(), packed.size());
+    msg::object *obj = unpacker.unpack();
+
+    XCTAssertTrue(obj);
+    XCTAssertTrue(*obj == value);
+
+    const msg::array &unpacked = obj->get<msg::array>();
+    XCTAssertEqual(unpacked[0].get<msg::string>().data(), packed.data() + 2);
+    XCTAssertEqual((char*)unpacked[1].get<msg::binary>().data(), packed.data() + 8);
+    XCTAssertEqual(unpacked[2].get<msg::extension>().data(), packed.data() + 11);
+    XCTAssertFalse(unpacker.unpack());
+
+    // Regular feeding still copies.
+    unpacker.feed(packed.data(), packed.size());
+    obj = unpacker.unpack();
+
+    XCTAssertTrue(obj);
+    XCTAssertTrue(*obj == value);
+    XCTAssertNotEqual(obj->get<msg::array>()[0].get<msg::string>().data(),
+                      packed.data() + 2);
+    XCTAssertFalse(unpacker.unpack());
+}
+
+- (void)testScanCompleteObjects {
+    auto packed = packed_data("\x7b\xc0\xa4\x74\x65\x73\x74\xcd\x01\xb0"
+                              "\x92\x01\x81\xa1\x30\xc3\xd5\x01\x02\x03");
+
+    const size_t sizes[] = {1, 1, 5, 3, 6, 4};
+
+    msg::object_scanner scanner;
+    const char *data = packed.data();
+    size_t remaining = packed.size();
+
+    for (size_t size : sizes) {
+        XCTAssertEqual(scanner.scan(data, remaining), size);
+        data += size;
+        remaining -= size;
+    }
+
+    XCTAssertEqual(remaining, 0);
+    XCTAssertEqual(scanner.scan(data, remaining), 0);
+}
+
+- (void)testScanLengthPrefixedObjects {
+    auto packed = packed_data("\xd9\x02\x61\x61\xc5\x00\x01\xff"
+                              "\xdc\x00\x02\x01\x02\xde\x00\x01\x01\x02"
+                              "\xc7\x01\x05\xff");
+
+    const size_t sizes[] = {4, 4, 5, 5, 4};
+
+    msg::object_scanner scanner;
+    const char *data = packed.data();
+    size_t remaining = packed.size();
+
+    for (size_t size : sizes) {
+        XCTAssertEqual(scanner.scan(data, remaining), size);
+        data += size;
+        remaining -= size;
+    }
+
+    XCTAssertEqual(remaining, 0);
+}
+
+- (void)testScanIncompleteObjects {
+    auto packed = packed_data("\x94\x01\xa5\x68\x65\x6c\x6c\x6f\x81\xa1"
+                              "\x61\x92\xc3\xca\x40\x60\x00\x00\xc4\x02"
+                              "\xaa\xbb");
+
+    // Scanning resumes from wherever the previous scan ran out of data.
+    for (size_t i=0; i<packed.size(); ++i) {
+        msg::object_scanner scanner;
+
+        for (size_t j=0; j<=i; ++j) {
+            XCTAssertEqual(scanner.scan(packed.data(), j), 0);
+        }
+
+        XCTAssertEqual(scanner.scan(packed.data(), packed.size()), packed.size());
+    }
+}
+
 - (void)testOneShotUnpackUnsignedIntegerFixedMin {
     auto value = msg::integer(0);
     auto packed = packed_data("\x00");
@@ -0,0 +1,379 @@
+//
+//  Neovim Mac Test
+//  Multigrid.mm
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <XCTest/XCTest.h>
+
+#include "RedrawWriter.hpp"
+#include "SlotRenderer.hpp"
+#include "ui.hpp"
+
+namespace {
+
+constexpr size_t screen_width = 20;
+constexpr size_t screen_height = 10;
+
+/// True if the rectangle at row, col of size width x height is filled with c.
+bool filled(const nvim::grid *grid, long row, long col,
+            size_t width, size_t height, char c) {
+    for (long r=row; r<row + (long)height; ++r) {
+        std::string text = row_text(grid, r);
+
+        for (long x=col; x<col + (long)width; ++x) {
+            if (text[x] != c) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/// The number of cells of the grid containing c.
+size_t count(const nvim::grid *grid, char c) {
+    size_t total = 0;
+
+    for (size_t row=0; row<grid->height(); ++row) {
+        std::string text = row_text(grid, row);
+        total += std::count(text.begin(), text.end(), c);
+    }
+
+    return total;
+}
+
+} // namespace
+
+@interface testMultigrid : XCTestCase
+@end
+
+@implementation testMultigrid {
+    std::unique_ptr<nvim::ui_controller> ui;
+    redraw_writer writer;
+    slot_renderer renderer;
+}
+
+// The global grid is filled with '.', grid 2 is a 6x4 window of 'a' at row 2,
+// column 3.
+- (void)setUp {
+    ui = std::make_unique<nvim::ui_controller>();
+
+    writer.event("option_set", std::tuple("ext_multigrid", true));
+    writer.event("grid_resize", std::tuple(1, screen_width, screen_height));
+    writer.fill(1, screen_width, screen_height, '.');
+
+    [self addGrid:2 width:6 height:4 fill:'a'];
+    [self windowPosition:2 row:2 col:3];
+    [self flush];
+}
+
+- (const nvim::grid*)flush {
+    writer.flush();
+    writer.redraw(*ui);
+    return ui->get_global_grid();
+}
+
+- (void)addGrid:(size_t)grid width:(size_t)width height:(size_t)height fill:(char)c {
+    writer.event("grid_resize", std::tuple(grid, width, height));
+    writer.fill(grid, width, height, c);
+}
+
+- (void)windowPosition:(size_t)grid row:(size_t)row col:(size_t)col {
+    writer.event("win_pos", std::tuple(grid, 1000 + grid, row, col, 0, 0));
+}
+
+- (void)floatPosition:(size_t)grid anchor:(const char*)anchor anchorGrid:(size_t)anchorGrid
+                  row:(double)row col:(double)col zindex:(int)zindex {
+    writer.event("win_float_pos", std::tuple(grid, 1000 + grid, anchor, anchorGrid,
+                                             row, col, true, zindex));
+}
+
+/// Writes a distinct line of text to every row of grid.
+- (void)addNumberedGrid:(size_t)grid width:(size_t)width height:(size_t)height {
+    writer.event("grid_resize", std::tuple(grid, width, height));
+
+    for (size_t row=0; row<height; ++row) {
+        [self numberedLine:grid row:row width:width];
+    }
+}
+
+- (void)numberedLine:(size_t)grid row:(size_t)row width:(size_t)width {
+    static size_t number = 0;
+    std::string text = "line" + std::to_string(number++);
+    text.resize(width, ' ');
+    writer.line(grid, row, 0, text);
+}
+
+/// Scrolls every row of grid up by one, and writes the exposed row.
+- (void)scrollUp:(size_t)grid width:(size_t)width height:(size_t)height {
+    writer.event("grid_scroll", std::tuple(grid, 0, height, 0, width, 1, 0));
+    [self numberedLine:grid row:height - 1 width:width];
+}
+
+- (const nvim::grid*)draw {
+    const nvim::grid *grid = [self flush];
+    renderer.draw(grid);
+    return grid;
+}
+
+- (void)testWindowPosition {
+    const nvim::grid *grid = [self flush];
+
+    XCTAssertTrue(filled(grid, 2, 3, 6, 4, 'a'));
+    XCTAssertEqual(count(grid, 'a'), 24);
+}
+
+- (void)testGridHiddenUntilPositioned {
+    [self addGrid:3 width:2 height:2 fill:'f'];
+    const nvim::grid *grid = [self flush];
+
+    XCTAssertEqual(count(grid, 'f'), 0);
+}
+
+- (void)testWindowMoves {
+    [self windowPosition:2 row:5 col:10];
+    const nvim::grid *grid = [self flush];
+
+    XCTAssertTrue(filled(grid, 5, 10, 6, 4, 'a'));
+    XCTAssertTrue(filled(grid, 2, 3, 6, 3, '.'));
+    XCTAssertEqual(count(grid, 'a'), 24);
+}
+
+- (void)testWindowChangesAreComposed {
+    writer.line(2, 1, 2, "xy");
+    const nvim::grid *grid = [self flush];
+
+    XCTAssertTrue(row_text(grid, 3).substr(5, 2) == "xy");
+    XCTAssertEqual(count(grid, 'a'), 22);
+}
+
+- (void)testFloatAnchors {
+    [self addGrid:3 width:2 height:2 fill:'f'];
+
+    // Anchored to grid 2 at row 1, column 2, which is row 3, column 5 of the
+    // global grid. The anchor names the corner of the float placed there.
+    struct {
+        const char *anchor;
+        long row;
+        long col;
+    } cases[] = {
+        {"NW", 3, 5},
+        {"NE", 3, 3},
+        {"SW", 1, 5},
+        {"SE", 1, 3},
+    };
+
+    for (const auto &expected : cases) {
+        [self floatPosition:3 anchor:expected.anchor anchorGrid:2 row:1 col:2 zindex:50];
+        const nvim::grid *grid = [self flush];
+
+        XCTAssertTrue(filled(grid, expected.row, expected.col, 2, 2, 'f'),
+                      @"Anchor=%s", expected.anchor);
+        XCTAssertEqual(count(grid, 'f'), 4, @"Anchor=%s", expected.anchor);
+    }
+}
+
+- (void)testFloatAnchoredToGlobalGrid {
+    [self addGrid:3 width:2 height:2 fill:'f'];
+    [self floatPosition:3 anchor:"NW" anchorGrid:1 row:7 col:12 zindex:50];
+    const nvim::grid *grid = [self flush];
+
+    XCTAssertTrue(filled(grid, 7, 12, 2, 2, 'f'));
+    XCTAssertEqual(count(grid, 'f'), 4);
+}
+
+- (void)testFloatFollowsAnchor {
+    [self addGrid:3 width:2 height:2 fill:'f'];
+    [self floatPosition:3 anchor:"NW" anchorGrid:2 row:0 col:0 zindex:50];
+    [self flush];
+
+    [self windowPosition:2 row:4 col:8];
+    const nvim::grid *grid = [self flush];
+
+    XCTAssertTrue(filled(grid, 4, 8, 2, 2, 'f'));
+    XCTAssertEqual(count(grid, 'f'), 4);
+}
+
+- (void)testFloatsAreClipped {
+    [self addGrid:3 width:4 height:4 fill:'f'];
+    [self floatPosition:3 anchor:"NW" anchorGrid:1 row:8 col:18 zindex:50];
+    const nvim::grid *grid = [self flush];
+
+    XCTAssertTrue(filled(grid, 8, 18, 2, 2, 'f'));
+    XCTAssertEqual(count(grid, 'f'), 4);
+
+    [self floatPosition:3 anchor:"SE" anchorGrid:1 row:1 col:1 zindex:50];
+    grid = [self flush];
+
+    XCTAssertTrue(filled(grid, 0, 0, 1, 1, 'f'));
+    XCTAssertEqual(count(grid, 'f'), 1);
+}
+
+- (void)testZindexLayering {
+    [self addGrid:3 width:2 height:2 fill:'f'];
+    [self addGrid:4 width:2 height:2 fill:'g'];
+
+    // Higher zindexes are drawn on top, regardless of placement order.
+    [self floatPosition:4 anchor:"NW" anchorGrid:1 row:0 col:0 zindex:60];
+    [self floatPosition:3 anchor:"NW" anchorGrid:1 row:0 col:0 zindex:50];
+    const nvim::grid *grid = [self flush];
+    XCTAssertTrue(filled(grid, 0, 0, 2, 2, 'g'));
+
+    // Equal zindexes are drawn in placement order, latest on top.
+    [self floatPosition:4 anchor:"NW" anchorGrid:1 row:0 col:0 zindex:50];
+    grid = [self flush];
+    XCTAssertTrue(filled(grid, 0, 0, 2, 2, 'g'));
+
+    [self floatPosition:3 anchor:"NW" anchorGrid:1 row:0 col:0 zindex:50];
+    grid = [self flush];
+    XCTAssertTrue(filled(grid, 0, 0, 2, 2, 'f'));
+
+    // Floats are drawn above windows placed after them.
+    [self floatPosition:3 anchor:"NW" anchorGrid:1 row:2 col:3 zindex:50];
+    [self windowPosition:2 row:2 col:4];
+    grid = [self flush];
+    XCTAssertTrue(filled(grid, 2, 3, 2, 2, 'f'));
+    XCTAssertTrue(filled(grid, 2, 5, 5, 4, 'a'));
+}
+
+- (void)testMessageGridIsDrawnAboveFloats {
+    [self addGrid:3 width:2 height:2 fill:'f'];
+    [self addGrid:4 width:screen_width height:2 fill:'m'];
+    [self floatPosition:3 anchor:"NW" anchorGrid:1 row:8 col:0 zindex:100];
+    writer.event("msg_set_pos", std::tuple(4, 8, false, ""));
+    const nvim::grid *grid = [self flush];
+
+    XCTAssertTrue(filled(grid, 8, 0, screen_width, 2, 'm'));
+    XCTAssertEqual(count(grid, 'f'), 0);
+}
+
+- (void)testHideRecomposes {
+    [self addGrid:3 width:2 height:2 fill:'f'];
+    [self floatPosition:3 anchor:"NW" anchorGrid:2 row:0 col:0 zindex:50];
+    [self flush];
+
+    writer.event("win_hide", std::tuple(3));
+    const nvim::grid *grid = [self flush];
+    XCTAssertEqual(count(grid, 'f'), 0);
+    XCTAssertTrue(filled(grid, 2, 3, 6, 4, 'a'));
+
+    writer.event("win_hide", std::tuple(2));
+    grid = [self flush];
+    XCTAssertEqual(count(grid, 'a'), 0);
+    XCTAssertEqual(count(grid, '.'), screen_width * screen_height);
+
+    [self windowPosition:2 row:2 col:3];
+    grid = [self flush];
+    XCTAssertTrue(filled(grid, 2, 3, 6, 4, 'a'));
+}
+
+- (void)testCloseRecomposes {
+    writer.event("win_close", std::tuple(2));
+    const nvim::grid *grid = [self flush];
+
+    XCTAssertEqual(count(grid, 'a'), 0);
+}
+
+- (void)testDestroyRecomposes {
+    [self addGrid:3 width:2 height:2 fill:'f'];
+    [self floatPosition:3 anchor:"NW" anchorGrid:1 row:0 col:0 zindex:50];
+    [self flush];
+
+    writer.event("grid_destroy", std::tuple(3));
+    const nvim::grid *grid = [self flush];
+    XCTAssertEqual(count(grid, 'f'), 0);
+    XCTAssertTrue(filled(grid, 0, 0, 2, 2, '.'));
+
+    // The global grid can't be destroyed.
+    writer.event("grid_destroy", std::tuple(1));
+    grid = [self flush];
+    XCTAssertEqual(count(grid, '.'), screen_width * screen_height - 24);
+}
+
+- (void)testFullWidthScrollIsReplayed {
+    [self addNumberedGrid:3 width:screen_width height:5];
+    [self windowPosition:3 row:4 col:0];
+    [self draw];
+
+    [self scrollUp:3 width:screen_width height:5];
+    const nvim::grid *grid = [self draw];
+
+    XCTAssertTrue(renderer.replayed);
+    XCTAssertEqual(renderer.rows_encoded, 1);
+    XCTAssertTrue(renderer.matches(grid));
+}
+
+- (void)testCoveredRowsAreEncoded {
+    [self addNumberedGrid:3 width:screen_width height:5];
+    [self windowPosition:3 row:4 col:0];
+    [self addGrid:4 width:2 height:2 fill:'f'];
+    [self floatPosition:4 anchor:"NW" anchorGrid:3 row:1 col:5 zindex:50];
+    [self draw];
+
+    // The float covers rows 5 and 6, their contents move to rows 4 and 5.
+    [self scrollUp:3 width:screen_width height:5];
+    const nvim::grid *grid = [self draw];
+
+    XCTAssertTrue(renderer.replayed);
+    XCTAssertEqual(renderer.rows_encoded, 4);
+    XCTAssertTrue(renderer.matches(grid));
+    XCTAssertTrue(filled(grid, 5, 5, 2, 2, 'f'));
+}
+
+- (void)testPartialWidthScrollIsNotReplayed {
+    [self draw];
+
+    writer.event("grid_scroll", std::tuple(2, 0, 4, 0, 6, 1, 0));
+    writer.line(2, 3, 0, "bbbbbb");
+    const nvim::grid *grid = [self draw];
+
+    XCTAssertFalse(renderer.replayed);
+    XCTAssertEqual(renderer.rows_encoded, 4);
+    XCTAssertTrue(renderer.matches(grid));
+    XCTAssertTrue(filled(grid, 5, 3, 6, 1, 'b'));
+}
+
+- (void)testScrollIsNotReplayedAfterLayoutChanges {
+    [self addNumberedGrid:3 width:screen_width height:5];
+    [self windowPosition:3 row:4 col:0];
+    [self draw];
+
+    [self scrollUp:3 width:screen_width height:5];
+    [self windowPosition:3 row:5 col:0];
+    const nvim::grid *grid = [self draw];
+
+    XCTAssertFalse(renderer.replayed);
+    XCTAssertTrue(renderer.matches(grid));
+}
+
+- (void)testCursorTranslation {
+    writer.event("grid_cursor_goto", std::tuple(2, 1, 4));
+    const nvim::grid *grid = [self flush];
+
+    XCTAssertEqual(grid->cursor().row(), 3);
+    XCTAssertEqual(grid->cursor().col(), 7);
+
+    // The cursor follows its window.
+    [self windowPosition:2 row:5 col:10];
+    grid = [self flush];
+
+    XCTAssertEqual(grid->cursor().row(), 6);
+    XCTAssertEqual(grid->cursor().col(), 14);
+
+    [self addGrid:3 width:2 height:2 fill:'f'];
+    [self floatPosition:3 anchor:"NW" anchorGrid:1 row:7 col:12 zindex:50];
+    writer.event("grid_cursor_goto", std::tuple(3, 1, 1));
+    grid = [self flush];
+
+    XCTAssertEqual(grid->cursor().row(), 8);
+    XCTAssertEqual(grid->cursor().col(), 13);
+}
+
+@end
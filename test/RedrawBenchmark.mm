@@ -0,0 +1,530 @@
+//
+//  Neovim Mac Test
+//  RedrawBenchmark.mm
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#include <time.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <XCTest/XCTest.h>
+#include "capture.hpp"
+#include "msgpack.hpp"
+#include "ui.hpp"
+
+namespace {
+
+/// A redraw stream as it's read from a Neovim process. Every message is a
+/// redraw notification ending in a flush event.
+struct redraw_trace {
+    std::string bytes;
+    size_t events = 0;
+    size_t frames = 0;
+};
+
+/// Writes redraw notifications. Each batch holds a fixed number of events,
+/// each event a fixed number of argument tuples.
+class trace_writer {
+private:
+    msg::packer packer;
+    redraw_trace &trace;
+    uint64_t seed;
+
+public:
+    static constexpr size_t grid_width = 160;
+    static constexpr size_t grid_height = 48;
+
+    trace_writer(redraw_trace &trace): trace(trace), seed(0x2545F4914F6CDD1D) {}
+
+    /// Appends the written notifications to the trace.
+    void finish() {
+        trace.bytes.append(packer.data(), packer.size());
+        packer.clear();
+    }
+
+    /// A deterministic pseudo random number in [0, max).
+    uint32_t random(uint32_t max) {
+        seed = seed * 6364136223846793005 + 1442695040888963407;
+        return (seed >> 33) % max;
+    }
+
+    void start_batch(uint32_t events) {
+        packer.start_array(3);
+        packer.pack_uint64(2);
+        packer.pack_string("redraw");
+        packer.start_array(events);
+    }
+
+    void start_event(std::string_view name, uint32_t tuples) {
+        packer.start_array(tuples + 1);
+        packer.pack_string(name);
+        trace.events += tuples;
+    }
+
+    void flush() {
+        start_event("flush", 1);
+        packer.start_array(0);
+        trace.frames += 1;
+    }
+
+    void grid_resize(size_t width, size_t height) {
+        start_event("grid_resize", 1);
+        packer.pack(std::tuple(1, width, height));
+    }
+
+    void default_colors_set(uint32_t fg, uint32_t bg) {
+        start_event("default_colors_set", 1);
+        packer.pack(std::tuple(fg, bg, 0xFF0000u, 0, 0));
+    }
+
+    void hl_attr_define(size_t first, size_t count) {
+        start_event("hl_attr_define", (uint32_t)count);
+
+        for (size_t id = first; id < first + count; ++id) {
+            packer.start_array(4);
+            packer.pack_uint64(id);
+            packer.start_map(3);
+            packer.pack_string("foreground");
+            packer.pack_uint64(random(0xFFFFFF));
+            packer.pack_string("background");
+            packer.pack_uint64(random(0xFFFFFF));
+            packer.pack_string(random(2) ? "bold" : "italic");
+            packer.pack_bool(true);
+            packer.start_map(0);
+            packer.start_array(0);
+        }
+    }
+
+    void grid_cursor_goto(size_t row, size_t col) {
+        start_event("grid_cursor_goto", 1);
+        packer.pack(std::tuple(1, row, col));
+    }
+
+    void grid_scroll(size_t top, size_t bottom, long rows) {
+        start_event("grid_scroll", 1);
+        packer.pack(std::tuple(1, top, bottom, 0, grid_width, rows, 0));
+    }
+
+    /// Starts a grid_line tuple, must be followed by cells.
+    void start_line(size_t row, size_t col, uint32_t cells) {
+        packer.start_array(5);
+        packer.pack_uint64(1);
+        packer.pack_uint64(row);
+        packer.pack_uint64(col);
+        packer.start_array(cells);
+    }
+
+    void end_line() {
+        packer.pack_bool(false);
+    }
+
+    void cell(std::string_view text) {
+        packer.start_array(1);
+        packer.pack_string(text);
+    }
+
+    void cell(std::string_view text, size_t hlid) {
+        packer.start_array(2);
+        packer.pack_string(text);
+        packer.pack_uint64(hlid);
+    }
+
+    void cell(std::string_view text, size_t hlid, size_t repeat) {
+        packer.start_array(3);
+        packer.pack_string(text);
+        packer.pack_uint64(hlid);
+        packer.pack_uint64(repeat);
+    }
+
+    /// Writes a line of words, a new highlight every word, indented with
+    /// blanks. Cells without a highlight ID reuse the previous cell's.
+    void words_line(size_t row, size_t hl_count) {
+        static constexpr std::string_view words[] = {
+            "if", "return", "const", "size_t", "std::vector", "->", "{", "}",
+            "for", "auto", "&&", "nullptr", "//", "template", "=", "(void)*",
+            "λ", "→", "ñandú", "[[nodiscard]]", "0x7f", "\"str\"", "ℝ", "::"
+        };
+
+        std::vector<std::pair<std::string_view, size_t>> cells;
+        size_t indent = random(12);
+        size_t col = indent;
+
+        while (col < grid_width) {
+            std::string_view word = words[random(std::size(words))];
+            size_t hlid = 1 + random((uint32_t)hl_count);
+
+            for (size_t i = 0; i < word.size() && col < grid_width; ++col) {
+                size_t size = 1;
+
+                while (i + size < word.size() && (word[i + size] & 0xC0) == 0x80) {
+                    size += 1;
+                }
+
+                cells.emplace_back(word.substr(i, size), hlid);
+                hlid = 0;
+                i += size;
+            }
+
+            if (col < grid_width) {
+                cells.emplace_back(" ", SIZE_MAX);
+                col += 1;
+            }
+        }
+
+        start_line(row, 0, (uint32_t)cells.size() + 1);
+        cell(" ", 0, indent);
+
+        for (auto [text, hlid] : cells) {
+            if (hlid == SIZE_MAX) {
+                cell(text, 0);
+            } else if (hlid) {
+                cell(text, hlid);
+            } else {
+                cell(text);
+            }
+        }
+
+        end_line();
+    }
+
+    /// Writes the first frame, a blank grid.
+    void setup(size_t hl_count) {
+        start_batch(5);
+        grid_resize(grid_width, grid_height);
+        default_colors_set(0xDDDDDD, 0x1E1E1E);
+        hl_attr_define(1, hl_count);
+        start_event("grid_line", grid_height);
+
+        for (size_t row = 0; row < grid_height; ++row) {
+            start_line(row, 0, 1);
+            cell(" ", 0, grid_width);
+            end_line();
+        }
+
+        flush();
+    }
+};
+
+/// Scrolling through a source file with <C-e>, one line per frame.
+redraw_trace scrolling_trace() {
+    redraw_trace trace;
+    trace_writer writer(trace);
+    writer.setup(64);
+
+    for (size_t frame = 0; frame < 2000; ++frame) {
+        writer.start_batch(4);
+        writer.grid_scroll(0, trace_writer::grid_height - 2, 1);
+        writer.start_event("grid_line", 2);
+        writer.words_line(trace_writer::grid_height - 3, 64);
+        writer.words_line(trace_writer::grid_height - 1, 4);
+        writer.grid_cursor_goto(writer.random(trace_writer::grid_height - 2), 0);
+        writer.flush();
+    }
+
+    writer.finish();
+    return trace;
+}
+
+/// A build log in :terminal, several lines of output per flush.
+redraw_trace terminal_trace() {
+    redraw_trace trace;
+    trace_writer writer(trace);
+    writer.setup(16);
+
+    for (size_t frame = 0; frame < 2000; ++frame) {
+        long lines = 1 + writer.random(6);
+
+        writer.start_batch(4);
+        writer.grid_scroll(0, trace_writer::grid_height, lines);
+        writer.start_event("grid_line", (uint32_t)lines);
+
+        for (long i = lines; i > 0; --i) {
+            writer.words_line(trace_writer::grid_height - i, 16);
+        }
+
+        writer.grid_cursor_goto(trace_writer::grid_height - 1, 0);
+        writer.flush();
+    }
+
+    writer.finish();
+    return trace;
+}
+
+/// A file with a large colorscheme, frequently redefining its highlights, as
+/// happens when switching colorschemes or with plugins animating highlights.
+redraw_trace colorscheme_trace() {
+    static constexpr size_t hl_count = 800;
+
+    redraw_trace trace;
+    trace_writer writer(trace);
+    writer.setup(hl_count);
+
+    for (size_t frame = 0; frame < 400; ++frame) {
+        bool redefine = frame % 10 == 0;
+
+        writer.start_batch(redefine ? 4 : 3);
+
+        if (redefine) {
+            writer.hl_attr_define(1 + writer.random(hl_count - 100), 100);
+        }
+
+        writer.start_event("grid_line", trace_writer::grid_height);
+
+        for (size_t row = 0; row < trace_writer::grid_height; ++row) {
+            writer.words_line(row, hl_count);
+        }
+
+        writer.grid_cursor_goto(writer.random(trace_writer::grid_height), 0);
+        writer.flush();
+    }
+
+    writer.finish();
+    return trace;
+}
+
+/// True if object is a redraw notification.
+bool is_redraw(const msg::object &object) {
+    const msg::array *message = object.get_if<msg::array>();
+
+    return message && message->size() == 3 &&
+           message->at(0).is<msg::integer>() &&
+           message->at(0).get<msg::integer>() == 2 &&
+           message->at(1).is<msg::string>() &&
+           message->at(1).get<msg::string>() == "redraw" &&
+           message->at(2).is<msg::array>();
+}
+
+/// Reads the bytes received during a captured session. Messages other than
+/// redraw notifications are skipped by replay().
+std::optional<redraw_trace> capture_trace(const char *path) {
+    capture_reader reader;
+
+    if (reader.open(path)) {
+        return std::nullopt;
+    }
+
+    redraw_trace trace;
+
+    while (auto record = reader.next()) {
+        if (record->direction == capture_direction::received) {
+            trace.bytes.append(record->data);
+        }
+    }
+
+    // The capture may have ended part way through a message.
+    msg::object_scanner scanner;
+    size_t complete = 0;
+
+    while (size_t size = scanner.scan(trace.bytes.data() + complete,
+                                      trace.bytes.size() - complete)) {
+        complete += size;
+    }
+
+    trace.bytes.resize(complete);
+
+    msg::unpacker unpacker;
+    unpacker.feed_borrowed(trace.bytes.data(), trace.bytes.size());
+
+    while (msg::object *obj = unpacker.unpack()) {
+        if (!is_redraw(*obj)) {
+            continue;
+        }
+
+        for (const msg::object &event : obj->get<msg::array>()[2].get<msg::array>()) {
+            const msg::array *array = event.get_if<msg::array>();
+
+            if (!array || !array->size()) {
+                continue;
+            }
+
+            trace.events += array->size() - 1;
+
+            if (array->at(0).is<msg::string>() &&
+                array->at(0).get<msg::string>() == "flush") {
+                trace.frames += 1;
+            }
+        }
+    }
+
+    return trace;
+}
+
+/// Builds per cell instance data from grids, as -[NVGridView displayLayer:]
+/// does, without a GPU or font rasterizer. Glyphs are looked up in a cache
+/// keyed by grapheme and font attributes, standing in for the glyph manager.
+class headless_renderer {
+private:
+    struct glyph_instance {
+        uint32_t glyph;
+        uint32_t color;
+        uint16_t row;
+        uint16_t col;
+    };
+
+    std::vector<uint32_t> backgrounds;
+    std::vector<glyph_instance> glyphs;
+    std::unordered_map<std::string, uint32_t> glyph_cache;
+    std::string key;
+    uint64_t tick = 0;
+
+public:
+    size_t rows_encoded = 0;
+
+    void draw(const nvim::grid *grid) {
+        size_t width = grid->width();
+        size_t height = grid->height();
+
+        if (backgrounds.size() != grid->cells_size()) {
+            backgrounds.assign(grid->cells_size(), 0);
+            tick = 0;
+        }
+
+        glyphs.clear();
+
+        for (size_t row = 0; row < height; ++row) {
+            if (grid->row_tick(row) <= tick) {
+                continue;
+            }
+
+            rows_encoded += 1;
+
+            for (size_t col = 0; col < width; ++col) {
+                nvim::cell cell = grid->resolve(row, col);
+                backgrounds[row * width + col] = cell.background().rgb();
+
+                if (cell.empty()) {
+                    continue;
+                }
+
+                key.assign(cell.grapheme_view());
+                key.push_back((char)cell.font_attributes());
+
+                auto [iter, inserted] = glyph_cache.try_emplace(key, glyph_cache.size());
+
+                glyphs.push_back(glyph_instance{iter->second,
+                                                cell.foreground().rgb(),
+                                                (uint16_t)row, (uint16_t)col});
+            }
+        }
+
+        tick = grid->tick();
+    }
+};
+
+struct replay_result {
+    uint64_t cpu_time;
+    uint64_t wall_time;
+};
+
+/// Replays a trace through the unpacker, a ui_controller, and the headless
+/// renderer, drawing once per flush.
+replay_result replay(const redraw_trace &trace) {
+    auto ui = std::make_unique<nvim::ui_controller>();
+    headless_renderer renderer;
+    msg::unpacker unpacker;
+
+    uint64_t cpu_start = clock_gettime_nsec_np(CLOCK_THREAD_CPUTIME_ID);
+    uint64_t wall_start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+
+    unpacker.feed_borrowed(trace.bytes.data(), trace.bytes.size());
+
+    while (msg::object *obj = unpacker.unpack()) {
+        if (is_redraw(*obj)) {
+            ui->redraw(obj->get<msg::array>()[2].get<msg::array>());
+            renderer.draw(ui->get_global_grid());
+        }
+    }
+
+    return replay_result{
+        clock_gettime_nsec_np(CLOCK_THREAD_CPUTIME_ID) - cpu_start,
+        clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - wall_start
+    };
+}
+
+} // namespace
+
+@interface testRedrawBenchmark : XCTestCase
+@end
+
+@implementation testRedrawBenchmark
+
+- (void)setUp {
+    [super setUp];
+    [self setContinueAfterFailure:NO];
+}
+
+- (void)logTrace:(const redraw_trace&)trace name:(NSString*)name result:(replay_result)result {
+    double seconds = result.wall_time / 1e9;
+
+    NSLog(@"%@: %zu events, %zu frames, %.1f MB - "
+           "%.0f events/s, %.1f MB/s, %.3f ms CPU per frame",
+          name, trace.events, trace.frames, trace.bytes.size() / 1e6,
+          trace.events / seconds, trace.bytes.size() / 1e6 / seconds,
+          result.cpu_time / 1e6 / std::max<size_t>(trace.frames, 1));
+}
+
+- (void)measureTrace:(const redraw_trace&)trace name:(NSString*)name {
+    __block replay_result result;
+
+    [self measureWithMetrics:@[[[XCTClockMetric alloc] init], [[XCTCPUMetric alloc] init]]
+                       block:^{
+        result = replay(trace);
+    }];
+
+    [self logTrace:trace name:name result:result];
+}
+
+- (void)testScrolling {
+    [self measureTrace:scrolling_trace() name:@"Scrolling"];
+}
+
+- (void)testTerminal {
+    [self measureTrace:terminal_trace() name:@"Terminal"];
+}
+
+- (void)testColorscheme {
+    [self measureTrace:colorscheme_trace() name:@"Colorscheme"];
+}
+
+/// Benchmarks every capture file in $NVIM_MAC_BENCHMARK_CAPTURES.
+/// Record captures by setting NVPreferencesCaptureDirectory.
+- (void)testCaptures {
+    NSString *directory = NSProcessInfo.processInfo.environment[@"NVIM_MAC_BENCHMARK_CAPTURES"];
+
+    if (!directory) {
+        XCTSkip(@"NVIM_MAC_BENCHMARK_CAPTURES is not set");
+    }
+
+    NSArray<NSString*> *files = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:directory
+                                                                                    error:nil];
+
+    std::vector<redraw_trace> traces;
+
+    for (NSString *file in files) {
+        if (![[file pathExtension] isEqualToString:@"nvcap"]) {
+            continue;
+        }
+
+        NSString *path = [directory stringByAppendingPathComponent:file];
+        auto trace = capture_trace([path fileSystemRepresentation]);
+        XCTAssertTrue(trace.has_value(), @"Invalid capture file: %@", path);
+
+        [self logTrace:*trace name:file result:replay(*trace)];
+        traces.push_back(std::move(*trace));
+    }
+
+    // XCTest measures once per test method, so every capture is measured
+    // together.
+    [self measureWithMetrics:@[[[XCTClockMetric alloc] init], [[XCTCPUMetric alloc] init]]
+                       block:^{
+        for (const redraw_trace &trace : traces) {
+            replay(trace);
+        }
+    }];
+}
+
+@end
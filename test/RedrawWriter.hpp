@@ -0,0 +1,95 @@
+//
+//  Neovim Mac Test
+//  RedrawWriter.hpp
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#ifndef REDRAW_WRITER_HPP
+#define REDRAW_WRITER_HPP
+
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+#include "msgpack.hpp"
+#include "ui.hpp"
+
+/// Packs redraw events, and sends them to a ui_controller as a single redraw
+/// notification, as they'd arrive from a Neovim process.
+class redraw_writer {
+private:
+    msg::packer packer;
+    std::vector<std::string> events;
+
+public:
+    using line_cells = std::vector<std::tuple<std::string, int>>;
+
+    /// Queues an event with the given argument tuples.
+    template<typename ...Tuples>
+    void event(std::string_view name, const Tuples& ...tuples) {
+        packer.start_array(sizeof...(Tuples) + 1);
+        packer.pack_string(name);
+        (packer.pack(tuples), ...);
+
+        events.emplace_back(packer.data(), packer.size());
+        packer.clear();
+    }
+
+    /// Queues a grid_line event writing text to a row, one cell per byte.
+    void line(size_t grid, size_t row, size_t col, std::string_view text) {
+        line_cells cells;
+
+        for (char c : text) {
+            cells.emplace_back(std::string(1, c), 0);
+        }
+
+        event("grid_line", std::tuple(grid, row, col, cells, false));
+    }
+
+    /// Queues grid_line events filling every row of a grid with c.
+    void fill(size_t grid, size_t width, size_t height, char c) {
+        for (size_t row=0; row<height; ++row) {
+            line(grid, row, 0, std::string(width, c));
+        }
+    }
+
+    void flush() {
+        event("flush", std::tuple());
+    }
+
+    /// Sends the queued events to ui as a single redraw notification.
+    void redraw(nvim::ui_controller &ui) {
+        packer.start_array(3);
+        packer.pack_uint64(2);
+        packer.pack_string("redraw");
+        packer.start_array((uint32_t)events.size());
+
+        for (const std::string &event : events) {
+            packer.pack_raw(event.data(), event.size());
+        }
+
+        events.clear();
+
+        msg::unpacker unpacker;
+        unpacker.feed_borrowed(packer.data(), packer.size());
+        ui.redraw(unpacker.unpack()->get<msg::array>()[2].get<msg::array>());
+        packer.clear();
+    }
+};
+
+/// Returns the text of a grid row, empty cells read as spaces.
+static inline std::string row_text(const nvim::grid *grid, size_t row) {
+    std::string text;
+
+    for (size_t col=0; col<grid->width(); ++col) {
+        nvim::cell cell = grid->resolve(row, col);
+        text.append(cell.empty() ? " " : cell.grapheme_view());
+    }
+
+    return text;
+}
+
+#endif // REDRAW_WRITER_HPP
@@ -0,0 +1,81 @@
+//
+//  Neovim Mac Test
+//  SlotRenderer.hpp
+//
+//  Copyright © 2020 Jay Sandhu. All rights reserved.
+//  This file is distributed under the MIT License.
+//  See LICENSE.txt for details.
+//
+
+#ifndef SLOT_RENDERER_HPP
+#define SLOT_RENDERER_HPP
+
+#include <numeric>
+#include <string>
+#include <vector>
+#include "RedrawWriter.hpp"
+#include "ui.hpp"
+
+/// Keeps a copy of every row in a slot, and follows the grid's scroll moves
+/// by rotating the row to slot table, as -[NVGridView displayLayer:] does.
+/// Only rows the moves don't account for are copied again.
+struct slot_renderer {
+    std::vector<std::string> slots;
+    std::vector<size_t> row_slots;
+    uint64_t tick = 0;
+    size_t rows_encoded = 0;
+    bool replayed = false;
+
+    void draw(const nvim::grid *grid) {
+        rows_encoded = 0;
+        replayed = false;
+
+        if (slots.size() != grid->height()) {
+            slots.resize(grid->height());
+            row_slots.resize(grid->height());
+            std::iota(row_slots.begin(), row_slots.end(), 0);
+
+            for (size_t row=0; row<grid->height(); ++row) {
+                slots[row] = row_text(grid, row);
+                rows_encoded += 1;
+            }
+
+            tick = grid->tick();
+            return;
+        }
+
+        auto moves = grid->scroll_moves_since(tick);
+
+        if (moves) {
+            for (const nvim::grid_scroll_move &move : *moves) {
+                move.apply(row_slots);
+            }
+
+            replayed = moves->size() != 0;
+        }
+
+        for (size_t row=0; row<grid->height(); ++row) {
+            uint64_t row_tick = moves ? grid->content_tick(row) : grid->row_tick(row);
+
+            if (row_tick > tick) {
+                slots[row_slots[row]] = row_text(grid, row);
+                rows_encoded += 1;
+            }
+        }
+
+        tick = grid->tick();
+    }
+
+    /// True if every row's slot holds the row's current text.
+    bool matches(const nvim::grid *grid) const {
+        for (size_t row=0; row<grid->height(); ++row) {
+            if (slots[row_slots[row]] != row_text(grid, row)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+};
+
+#endif // SLOT_RENDERER_HPP